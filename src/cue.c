@@ -0,0 +1,428 @@
+/***************************************************************************/
+/*
+** CUE - Cue sheets, shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cue.h"
+
+/***************************************************************************/
+
+static const struct {
+  const char *name;
+  int mode;
+  int sectorsize;
+} cue_types[] = {
+  { "AUDIO",      0, 2352 },
+  { "CDG",        0, 2448 },
+  { "MODE1/2048", 1, 2048 },
+  { "MODE1/2352", 1, 2352 },
+  { "MODE2/2336", 2, 2336 },
+  { "MODE2/2352", 2, 2352 },
+  { "CDI/2336",   2, 2336 },
+  { "CDI/2352",   2, 2352 }
+};
+
+/*
+** Set the type of a track from its name in a TRACK line.  Returns nonzero
+** if it's not one we know.
+*/
+int cue_settype(struct cuetrack *t, const char *type) {
+  size_t i;
+  for(i = 0; i < sizeof(cue_types) / sizeof(cue_types[0]); i++) {
+    if(!strcasecmp(type, cue_types[i].name)) {
+      strcpy(t->type, cue_types[i].name);
+      t->mode = cue_types[i].mode;
+      t->sectorsize = cue_types[i].sectorsize;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+** Next word of a line, which may be in quotes.  Returns what's after it.
+*/
+static const char *cue_word(const char *s, char *out, size_t size) {
+  size_t n = 0;
+  while(isspace((unsigned char)*s)) s++;
+  if(*s == '"') {
+    for(s++; *s && *s != '"'; s++) {
+      if(n + 1 < size) out[n++] = *s;
+    }
+    if(*s) s++;
+  } else {
+    for(; *s && !isspace((unsigned char)*s); s++) {
+      if(n + 1 < size) out[n++] = *s;
+    }
+  }
+  out[n] = 0;
+  return s;
+}
+
+/*
+** mm:ss:ff in sectors, or -1
+*/
+static off_t cue_msf(const char *s) {
+  unsigned m, sec, f;
+  char c;
+  if(sscanf(s, "%u:%u:%u%c", &m, &sec, &f, &c) != 3) return -1;
+  if(sec >= 60 || f >= 75) return -1;
+  return ((off_t)m * 60 + sec) * 75 + f;
+}
+
+static int cue_addline(char **block, const char *line) {
+  size_t had = *block ? strlen(*block) : 0;
+  char *p = realloc(*block, had + strlen(line) + 2);
+  if(!p) return 1;
+  strcpy(p + had, line);
+  strcat(p + had, "\n");
+  *block = p;
+  return 0;
+}
+
+/*
+** Read a cue sheet.  Complains and returns nonzero if it's not usable.
+*/
+int cue_read(struct cuesheet *c, const char *filename) {
+  char line[1024];
+  char word[512];
+  const char *rest = line;
+  int lineno = 0;
+  struct cuetrack *t = NULL;
+  int i;
+  FILE *f;
+  memset(c, 0, sizeof(*c));
+  f = fopen(filename, "r");
+  if(!f) {
+    perror(filename);
+    return 1;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    const char *args;
+    size_t len = strlen(line);
+    lineno++;
+    while(len && isspace((unsigned char)line[len - 1])) line[--len] = 0;
+    rest = line;
+    /* UTF-8 byte order mark */
+    if(lineno == 1 && !memcmp(rest, "\xEF\xBB\xBF", 3)) rest += 3;
+    while(isspace((unsigned char)*rest)) rest++;
+    if(!*rest) continue;
+    args = cue_word(rest, word, sizeof(word));
+    if(!strcasecmp(word, "FILE")) {
+      char type[32];
+      if(c->nfiles == CUE_MAXTRACKS) goto bad;
+      args = cue_word(args, word, sizeof(word));
+      cue_word(args, type, sizeof(type));
+      if(!word[0]) goto bad;
+      if(strcasecmp(type, "BINARY")) {
+        fprintf(stderr, "%s:%d: only BINARY files are supported\n", filename, lineno);
+        goto fail;
+      }
+      c->files[c->nfiles] = malloc(strlen(word) + 1);
+      if(!c->files[c->nfiles]) goto fail;
+      strcpy(c->files[c->nfiles++], word);
+      t = NULL;
+    } else if(!strcasecmp(word, "TRACK")) {
+      if(!c->nfiles || c->ntracks == CUE_MAXTRACKS) goto bad;
+      t = &c->track[c->ntracks++];
+      args = cue_word(args, word, sizeof(word));
+      t->number = atoi(word);
+      cue_word(args, word, sizeof(word));
+      if(t->number < 1 || t->number > 99 || cue_settype(t, word)) goto bad;
+      t->file = c->nfiles - 1;
+    } else if(!strcasecmp(word, "INDEX")) {
+      off_t pos;
+      if(!t || t->nindex == CUE_MAXINDEX) goto bad;
+      if(t->file != c->nfiles - 1) {
+        fprintf(stderr, "%s:%d: track %02d spans more than one file\n",
+          filename, lineno, t->number);
+        goto fail;
+      }
+      args = cue_word(args, word, sizeof(word));
+      t->indexnum[t->nindex] = atoi(word);
+      cue_word(args, word, sizeof(word));
+      pos = cue_msf(word);
+      if(pos < 0) goto bad;
+      if(t->nindex && pos < t->indexpos[t->nindex - 1]) goto bad;
+      t->indexpos[t->nindex++] = pos;
+    } else if(t) {
+      if(cue_addline(t->nindex ? &t->after : &t->before, rest)) goto fail;
+    } else if(!c->nfiles) {
+      if(cue_addline(&c->header, rest)) goto fail;
+    }
+    /* Anything else between a FILE and its first TRACK is dropped */
+  }
+  if(ferror(f)) {
+    perror(filename);
+    goto fail;
+  }
+  fclose(f);
+  if(!c->ntracks) {
+    fprintf(stderr, "%s: no tracks\n", filename);
+    cue_free(c);
+    return 1;
+  }
+  for(i = 0; i < c->ntracks; i++) {
+    t = &c->track[i];
+    if(
+      !t->nindex ||
+      ((i > 0) && (t->file == t[-1].file) &&
+        (t->indexpos[0] < t[-1].indexpos[t[-1].nindex - 1]))
+    ) {
+      fprintf(stderr, "%s: track %02d is out of place\n", filename, t->number);
+      cue_free(c);
+      return 1;
+    }
+  }
+  return 0;
+bad:
+  fprintf(stderr, "%s:%d: can't make sense of \"%s\"\n", filename, lineno, rest);
+fail:
+  fclose(f);
+  cue_free(c);
+  return 1;
+}
+
+static void cue_lines(FILE *f, const char *block, const char *indent) {
+  while(block && *block) {
+    const char *end = strchr(block, '\n');
+    fprintf(f, "%s%.*s\r\n", indent, (int)(end - block), block);
+    block = end + 1;
+  }
+}
+
+/*
+** Write a cue sheet out, with the usual indentation and line endings
+*/
+void cue_write(const struct cuesheet *c, FILE *f) {
+  int file = -1;
+  int i, k;
+  cue_lines(f, c->header, "");
+  for(i = 0; i < c->ntracks; i++) {
+    const struct cuetrack *t = &c->track[i];
+    if(t->file != file) {
+      file = t->file;
+      fprintf(f, "FILE \"%s\" BINARY\r\n", c->files[file]);
+    }
+    fprintf(f, "  TRACK %02d %s\r\n", t->number, t->type);
+    cue_lines(f, t->before, "    ");
+    for(k = 0; k < t->nindex; k++) {
+      off_t p = t->indexpos[k];
+      fprintf(f, "    INDEX %02d %02d:%02d:%02d\r\n", t->indexnum[k],
+        (int)(p / 4500), (int)(p / 75 % 60), (int)(p % 75));
+    }
+    cue_lines(f, t->after, "    ");
+  }
+}
+
+void cue_free(struct cuesheet *c) {
+  int i;
+  free(c->header);
+  for(i = 0; i < c->nfiles; i++) free(c->files[i]);
+  for(i = 0; i < c->ntracks; i++) {
+    free(c->track[i].before);
+    free(c->track[i].after);
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+/*
+** Turn the sheet into one for the files joined together into "name", given
+** where each of them starts.  Returns nonzero if one of them isn't a whole
+** number of sectors long.
+*/
+int cue_merge(struct cuesheet *c, const off_t *starts, const char *name) {
+  int i, k;
+  for(i = 0; i < c->ntracks; i++) {
+    if(starts[c->track[i].file] % c->track[i].sectorsize) return 1;
+  }
+  for(i = 0; i < c->ntracks; i++) {
+    struct cuetrack *t = &c->track[i];
+    for(k = 0; k < t->nindex; k++) t->indexpos[k] += starts[t->file] / t->sectorsize;
+    t->file = 0;
+  }
+  for(k = 0; k < c->nfiles; k++) free(c->files[k]);
+  c->files[0] = malloc(strlen(name) + 1);
+  if(!c->files[0]) abort();
+  strcpy(c->files[0], name);
+  c->nfiles = 1;
+  return 0;
+}
+
+/***************************************************************************/
+/*
+** Where a file named in a cue sheet is: relative to the cue sheet, unless
+** it's an absolute path
+*/
+char *cue_path(const char *cuefile, const char *name) {
+  size_t dir = strlen(cuefile);
+  char *path;
+  while(dir && (cuefile[dir - 1] != '/') && (cuefile[dir - 1] != '\\')) dir--;
+  if((name[0] == '/') || (name[0] == '\\') || (name[0] && (name[1] == ':'))) dir = 0;
+  path = malloc(dir + strlen(name) + 1);
+  if(!path) abort();
+  memcpy(path, cuefile, dir);
+  strcpy(path + dir, name);
+  return path;
+}
+
+/*
+** The files of a cue sheet, one after another, read as a single stream that
+** can be seeked like one file.  It has no descriptor of its own.
+*/
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__)
+#define USE_CUEFILES
+
+struct cuefiles {
+  int n;
+  FILE *f[CUE_MAXTRACKS];
+  off_t start[CUE_MAXTRACKS + 1];
+  off_t pos;
+};
+
+static long cuefiles_read(struct cuefiles *cf, char *buf, size_t size) {
+  size_t done = 0;
+  int k = 0;
+  while(done < size) {
+    size_t got;
+    while((k < cf->n) && (cf->pos >= cf->start[k + 1])) k++;
+    if(k == cf->n) break;
+    if(fseeko(cf->f[k], cf->pos - cf->start[k], SEEK_SET)) return -1;
+    got = fread(buf + done, 1, size - done, cf->f[k]);
+    if(!got) {
+      if(ferror(cf->f[k])) return -1;
+      /* Shorter than it was */
+      break;
+    }
+    cf->pos += got;
+    done += got;
+  }
+  return (long)done;
+}
+
+static int cuefiles_seek(struct cuefiles *cf, off_t *offset, int whence) {
+  off_t pos = *offset;
+  switch(whence) {
+  case SEEK_CUR: pos += cf->pos;           break;
+  case SEEK_END: pos += cf->start[cf->n];  break;
+  }
+  if(pos < 0) return -1;
+  cf->pos = pos;
+  *offset = pos;
+  return 0;
+}
+
+static int cuefiles_close(struct cuefiles *cf) {
+  int k;
+  int err = 0;
+  for(k = 0; k < cf->n; k++) err |= fclose(cf->f[k]);
+  free(cf);
+  return err ? -1 : 0;
+}
+
+#ifdef __GLIBC__
+static ssize_t cuefiles_cookie_read(void *cookie, char *buf, size_t size) {
+  return cuefiles_read(cookie, buf, size);
+}
+static int cuefiles_cookie_seek(void *cookie, off64_t *offset, int whence) {
+  off_t pos = (off_t)*offset;
+  if(cuefiles_seek(cookie, &pos, whence)) return -1;
+  *offset = pos;
+  return 0;
+}
+static int cuefiles_cookie_close(void *cookie) {
+  return cuefiles_close(cookie);
+}
+#else
+static int cuefiles_fun_read(void *cookie, char *buf, int size) {
+  return (int)cuefiles_read(cookie, buf, (size_t)size);
+}
+static fpos_t cuefiles_fun_seek(void *cookie, fpos_t offset, int whence) {
+  off_t pos = (off_t)offset;
+  if(cuefiles_seek(cookie, &pos, whence)) return -1;
+  return (fpos_t)pos;
+}
+static int cuefiles_fun_close(void *cookie) {
+  return cuefiles_close(cookie);
+}
+#endif
+#endif
+
+/*
+** Open the files of "c" (read from "cuefile") as one stream.  "starts", if
+** not NULL, gets where each file starts in it, and where the last one ends.
+** Complains and returns NULL if that doesn't work out.
+*/
+FILE *cue_open(const struct cuesheet *c, const char *cuefile, off_t *starts) {
+#ifdef USE_CUEFILES
+  struct cuefiles *cf = calloc(1, sizeof(*cf));
+  FILE *f;
+  int k;
+  if(!cf) abort();
+  for(k = 0; k < c->nfiles; k++) {
+    char *path = cue_path(cuefile, c->files[k]);
+    off_t size;
+    cf->f[k] = fopen(path, "rb");
+    if(!cf->f[k] || fseeko(cf->f[k], 0, SEEK_END) || ((size = ftello(cf->f[k])) < 0)) {
+      perror(path);
+      free(path);
+      if(cf->f[k]) k++;
+      cf->n = k;
+      cuefiles_close(cf);
+      return NULL;
+    }
+    free(path);
+    cf->start[k + 1] = cf->start[k] + size;
+    cf->n = k + 1;
+  }
+  if(starts) memcpy(starts, cf->start, sizeof(off_t) * (cf->n + 1));
+#ifdef __GLIBC__
+  {
+    cookie_io_functions_t io;
+    io.read = cuefiles_cookie_read;
+    io.write = NULL;
+    io.seek = cuefiles_cookie_seek;
+    io.close = cuefiles_cookie_close;
+    f = fopencookie(cf, "rb", io);
+  }
+#else
+  f = funopen(cf, cuefiles_fun_read, NULL, cuefiles_fun_seek, cuefiles_fun_close);
+#endif
+  if(!f) {
+    perror(cuefile);
+    cuefiles_close(cf);
+  }
+  return f;
+#else
+  (void)c;
+  (void)starts;
+  fprintf(stderr, "%s: reading the files of a cue sheet isn't supported here\n", cuefile);
+  return NULL;
+#endif
+}
@@ -0,0 +1,66 @@
+/***************************************************************************/
+/*
+** CUE - Cue sheets, shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __CUE_H__
+#define __CUE_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+** The parts of a cue sheet that say where the tracks are.  Index positions
+** are in sectors from the start of the track's file.  Lines that don't
+** matter here (REM, CATALOG, FLAGS, ISRC, PREGAP and so on) are kept as they
+** are, so the sheet can be written out again with the tracks moved around.
+*/
+#define CUE_MAXTRACKS (99)
+#define CUE_MAXINDEX  (100)
+
+struct cuetrack {
+  int number;
+  int file;
+  char type[16];
+  int mode;             /* 0 for audio */
+  int sectorsize;
+  int nindex;
+  int indexnum[CUE_MAXINDEX];
+  off_t indexpos[CUE_MAXINDEX];
+  char *before;         /* lines before the first INDEX */
+  char *after;          /* and after it (POSTGAP) */
+};
+
+struct cuesheet {
+  char *header;         /* lines before the first FILE */
+  int nfiles;
+  char *files[CUE_MAXTRACKS];
+  int ntracks;
+  struct cuetrack track[CUE_MAXTRACKS];
+};
+
+int cue_read(struct cuesheet *c, const char *filename);
+void cue_write(const struct cuesheet *c, FILE *f);
+void cue_free(struct cuesheet *c);
+int cue_settype(struct cuetrack *t, const char *type);
+
+char *cue_path(const char *cuefile, const char *name);
+FILE *cue_open(const struct cuesheet *c, const char *cuefile, off_t *starts);
+int cue_merge(struct cuesheet *c, const off_t *starts, const char *name);
+
+#endif
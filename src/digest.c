@@ -0,0 +1,566 @@
+/***************************************************************************/
+/*
+** DIGEST - Checksums of whole images, shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/***************************************************************************/
+/*
+** CRC32 (the zlib/PKZIP one), eight bytes at a time
+*/
+static uint32_t crc32_lut[8][256];
+static int crc32_ready;
+
+static void crc32_init(void) {
+  uint32_t i, j, c;
+  for(i = 0; i < 256; i++) {
+    c = i;
+    for(j = 0; j < 8; j++) c = (c >> 1) ^ (c & 1 ? 0xEDB88320 : 0);
+    crc32_lut[0][i] = c;
+  }
+  for(i = 0; i < 256; i++) {
+    c = crc32_lut[0][i];
+    for(j = 1; j < 8; j++) {
+      c = (c >> 8) ^ crc32_lut[0][c & 0xFF];
+      crc32_lut[j][i] = c;
+    }
+  }
+  crc32_ready = 1;
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t len) {
+  crc = ~crc;
+  while(len >= 8) {
+    uint32_t a = crc ^ (
+      ((uint32_t)p[0] <<  0) | ((uint32_t)p[1] <<  8) |
+      ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    crc =
+      crc32_lut[7][(a >>  0) & 0xFF] ^ crc32_lut[6][(a >>  8) & 0xFF] ^
+      crc32_lut[5][(a >> 16) & 0xFF] ^ crc32_lut[4][(a >> 24) & 0xFF] ^
+      crc32_lut[3][p[4]] ^ crc32_lut[2][p[5]] ^
+      crc32_lut[1][p[6]] ^ crc32_lut[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while(len--) crc = (crc >> 8) ^ crc32_lut[0][(crc ^ *p++) & 0xFF];
+  return ~crc;
+}
+
+/***************************************************************************/
+/*
+** MD5 (RFC 1321)
+*/
+static const uint32_t md5_k[64] = {
+  0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
+  0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+  0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+  0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+  0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
+  0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+  0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
+  0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+  0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+  0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+  0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+  0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+  0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
+  0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+  0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+  0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+static const unsigned char md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[16];
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  int i;
+  for(i = 0; i < 16; i++) {
+    w[i] =
+      ((uint32_t)p[i * 4 + 0] <<  0) | ((uint32_t)p[i * 4 + 1] <<  8) |
+      ((uint32_t)p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+  }
+#define MD5_ROUND(f, g) do { \
+    uint32_t t = a + (f) + md5_k[i] + w[g]; \
+    a = d; \
+    d = c; \
+    c = b; \
+    b += ROL(t, md5_r[i]); \
+  } while(0)
+  for(i =  0; i < 16; i++) MD5_ROUND((b & c) | (~b & d), i);
+  for(     ; i < 32; i++) MD5_ROUND((d & b) | (~d & c), (5 * i + 1) & 15);
+  for(     ; i < 48; i++) MD5_ROUND(b ^ c ^ d, (3 * i + 5) & 15);
+  for(     ; i < 64; i++) MD5_ROUND(c ^ (b | ~d), (7 * i) & 15);
+#undef MD5_ROUND
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+}
+
+/***************************************************************************/
+/*
+** SHA-1 (FIPS 180-4)
+*/
+static void sha1_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[16];
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  int i;
+  for(i = 0; i < 16; i++) {
+    w[i] =
+      ((uint32_t)p[i * 4 + 0] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+      ((uint32_t)p[i * 4 + 2] <<  8) | ((uint32_t)p[i * 4 + 3] <<  0);
+  }
+  /* The message schedule is kept in a ring of 16 words */
+#define SHA1_ROUND(f, k) do { \
+    uint32_t t; \
+    if(i >= 16) { \
+      t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15]; \
+      w[i & 15] = ROL(t, 1); \
+    } \
+    t = ROL(a, 5) + (f) + e + (k) + w[i & 15]; \
+    e = d; \
+    d = c; \
+    c = ROL(b, 30); \
+    b = a; \
+    a = t; \
+  } while(0)
+  for(i =  0; i < 20; i++) SHA1_ROUND((b & c) | (~b & d), 0x5A827999);
+  for(     ; i < 40; i++) SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1);
+  for(     ; i < 60; i++) SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8F1BBCDC);
+  for(     ; i < 80; i++) SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6);
+#undef SHA1_ROUND
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+/***************************************************************************/
+/*
+** SHA-256 (FIPS 180-4)
+*/
+static const uint32_t sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+  0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+  0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+  0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+  0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+  0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static void sha256_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[64];
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+  int i;
+  for(i = 0; i < 16; i++) {
+    w[i] =
+      ((uint32_t)p[i * 4 + 0] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+      ((uint32_t)p[i * 4 + 2] <<  8) | ((uint32_t)p[i * 4 + 3] <<  0);
+  }
+  for(; i < 64; i++) {
+    uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  for(i = 0; i < 64; i++) {
+    uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+      ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
+
+/***************************************************************************/
+
+static const char *digest_names[] = { "crc32", "md5", "sha1", "sha256" };
+
+/*
+** Parse a comma-separated list of digest names, or "all".  Returns the set
+** of DIGEST_* flags, or -1 if something isn't recognized.
+*/
+int digests_parse(const char *list) {
+  int which = 0;
+  while(*list) {
+    size_t len = strcspn(list, ",");
+    int i;
+    if(len == 3 && !strncmp(list, "all", 3)) {
+      which |= DIGEST_ALL;
+    } else {
+      for(i = 0; i < 4; i++) {
+        if(strlen(digest_names[i]) == len && !strncmp(list, digest_names[i], len)) break;
+      }
+      if(i == 4) return -1;
+      which |= 1 << i;
+    }
+    list += len;
+    if(*list) list++;
+  }
+  return which ? which : -1;
+}
+
+/*
+** Name of a single DIGEST_* flag
+*/
+const char *digest_name(int which) {
+  int i;
+  for(i = 0; i < 4; i++) {
+    if(which == (1 << i)) return digest_names[i];
+  }
+  return "?";
+}
+
+void digests_init(struct digests *d, int which) {
+  static const uint32_t md5_h[4] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476
+  };
+  static const uint32_t sha1_h[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+  };
+  static const uint32_t sha256_h[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+  };
+  memset(d, 0, sizeof(*d));
+  d->which = which;
+  if(!crc32_ready) crc32_init();
+  memcpy(d->md5, md5_h, sizeof(md5_h));
+  memcpy(d->sha1, sha1_h, sizeof(sha1_h));
+  memcpy(d->sha256, sha256_h, sizeof(sha256_h));
+}
+
+/*
+** Run whole 64-byte blocks through the block-based digests
+*/
+static void digests_blocks(struct digests *d, const unsigned char *p, size_t n) {
+  for(; n; n--, p += 64) {
+    if(d->which & DIGEST_MD5) md5_block(d->md5, p);
+    if(d->which & DIGEST_SHA1) sha1_block(d->sha1, p);
+    if(d->which & DIGEST_SHA256) sha256_block(d->sha256, p);
+  }
+}
+
+void digests_update(struct digests *d, const void *data, size_t len) {
+  const unsigned char *p = data;
+  if(d->which & DIGEST_CRC32) d->crc32 = crc32_update(d->crc32, p, len);
+  d->length += len;
+  if(!(d->which & (DIGEST_MD5 | DIGEST_SHA1 | DIGEST_SHA256))) return;
+  if(d->blockfill) {
+    size_t b = 64 - d->blockfill;
+    if(b > len) b = len;
+    memcpy(d->block + d->blockfill, p, b);
+    d->blockfill += b;
+    p += b;
+    len -= b;
+    if(d->blockfill < 64) return;
+    digests_blocks(d, d->block, 1);
+    d->blockfill = 0;
+  }
+  digests_blocks(d, p, len / 64);
+  p += len & ~(size_t)63;
+  len &= 63;
+  memcpy(d->block, p, len);
+  d->blockfill = len;
+}
+
+/*
+** Pad the last block: MD5 stores the bit length little endian, the SHAs big
+** endian
+*/
+static void digest_pad(
+  const struct digests *d,
+  unsigned char *pad,
+  int bigendian
+) {
+  size_t n = d->blockfill;
+  uint64_t bits = d->length * 8;
+  size_t end;
+  int i;
+  memcpy(pad, d->block, n);
+  pad[n++] = 0x80;
+  end = (n > 56) ? 128 : 64;
+  memset(pad + n, 0, end - n);
+  for(i = 0; i < 8; i++) {
+    pad[end - 8 + (bigendian ? 7 - i : i)] = (unsigned char)(bits >> (8 * i));
+  }
+}
+
+void digests_final(struct digests *d) {
+  unsigned char pad[128];
+  if(d->which & DIGEST_MD5) {
+    digest_pad(d, pad, 0);
+    md5_block(d->md5, pad);
+    if(d->blockfill >= 56) md5_block(d->md5, pad + 64);
+  }
+  if(d->which & (DIGEST_SHA1 | DIGEST_SHA256)) {
+    digest_pad(d, pad, 1);
+    if(d->which & DIGEST_SHA1) {
+      sha1_block(d->sha1, pad);
+      if(d->blockfill >= 56) sha1_block(d->sha1, pad + 64);
+    }
+    if(d->which & DIGEST_SHA256) {
+      sha256_block(d->sha256, pad);
+      if(d->blockfill >= 56) sha256_block(d->sha256, pad + 64);
+    }
+  }
+}
+
+/*
+** Get one finished digest as bytes, in the order it's usually written out.
+** Returns its size.
+*/
+size_t digest_result(const struct digests *d, int which, unsigned char *out) {
+  const uint32_t *h;
+  size_t words;
+  size_t i;
+  switch(which) {
+  case DIGEST_CRC32:
+    h = &d->crc32; words = 1;
+    break;
+  case DIGEST_MD5:
+    for(i = 0; i < 16; i++) out[i] = (unsigned char)(d->md5[i / 4] >> (8 * (i % 4)));
+    return 16;
+  case DIGEST_SHA1:
+    h = d->sha1; words = 5;
+    break;
+  case DIGEST_SHA256:
+    h = d->sha256; words = 8;
+    break;
+  default:
+    return 0;
+  }
+  for(i = 0; i < words * 4; i++) out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+  return words * 4;
+}
+
+/*
+** Write out the finished digests, one per line: dot-padded like the rest of
+** the report with "dots", otherwise as "name hex" after a line with the
+** length, for other programs to read
+*/
+void digests_print(const struct digests *d, FILE *f, int dots) {
+  int w;
+  if(!dots) fprintf(f, "size %llu\n", (unsigned long long)d->length);
+  for(w = 1; w <= DIGEST_ALL; w <<= 1) {
+    unsigned char r[DIGEST_MAXSIZE];
+    size_t n, k;
+    if(!(d->which & w)) continue;
+    n = digest_result(d, w, r);
+    if(dots) {
+      fprintf(f, "%s%.*s ", digest_name(w), (int)(24 - strlen(digest_name(w))),
+        "........................");
+    } else {
+      fprintf(f, "%s ", digest_name(w));
+    }
+    for(k = 0; k < n; k++) fprintf(f, "%02x", r[k]);
+    fprintf(f, "\n");
+  }
+}
+
+/***************************************************************************/
+/*
+** Helper thread
+*/
+static const unsigned char zero_block[65536];
+
+static void digests_zeros(struct digests *d, uint64_t len) {
+  while(len) {
+    size_t n = (len > sizeof(zero_block)) ? sizeof(zero_block) : (size_t)len;
+    digests_update(d, zero_block, n);
+    len -= n;
+  }
+}
+
+#ifdef DIGEST_THREAD
+static void *digester_thread(void *arg) {
+  struct digester *g = arg;
+  pthread_mutex_lock(&g->lock);
+  for(;;) {
+    size_t n, at;
+    while((g->head == g->tail) && !g->done) pthread_cond_wait(&g->more, &g->lock);
+    if(g->head == g->tail) break;
+    n = (size_t)(g->head - g->tail);
+    pthread_mutex_unlock(&g->lock);
+    /* Hand space back a batch at a time, so the producer never waits long */
+    at = (size_t)(g->tail % DIGESTER_RING);
+    if(n > DIGESTER_RING - at) n = DIGESTER_RING - at;
+    if(n > DIGESTER_BATCH) n = DIGESTER_BATCH;
+    digests_update(&g->d, g->ring + at, n);
+    pthread_mutex_lock(&g->lock);
+    g->tail += n;
+    pthread_cond_signal(&g->room);
+  }
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+static void digester_publish(struct digester *g) {
+  pthread_mutex_lock(&g->lock);
+  g->head += g->pending;
+  g->pending = 0;
+  pthread_cond_signal(&g->more);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/*
+** Copy into the ring; "data" NULL means zeros
+*/
+static void digester_put(struct digester *g, const unsigned char *data, uint64_t len) {
+  while(len) {
+    size_t n, at;
+    if(!g->space) {
+      pthread_mutex_lock(&g->lock);
+      g->head += g->pending;
+      g->pending = 0;
+      pthread_cond_signal(&g->more);
+      while(g->head - g->tail == DIGESTER_RING) pthread_cond_wait(&g->room, &g->lock);
+      g->space = DIGESTER_RING - (size_t)(g->head - g->tail);
+      pthread_mutex_unlock(&g->lock);
+    }
+    at = (size_t)((g->head + g->pending) % DIGESTER_RING);
+    n = g->space;
+    if(n > DIGESTER_RING - at) n = DIGESTER_RING - at;
+    if(n > len) n = (size_t)len;
+    if(data) {
+      memcpy(g->ring + at, data, n);
+      data += n;
+    } else {
+      memset(g->ring + at, 0, n);
+    }
+    g->pending += n;
+    g->space -= n;
+    len -= n;
+    if(g->pending >= DIGESTER_BATCH) digester_publish(g);
+  }
+}
+#endif
+
+void digester_start(struct digester *g, int which) {
+  digests_init(&g->d, which);
+  g->finished = 0;
+#ifdef DIGEST_THREAD
+  g->threaded = 0;
+  if(!which) return;
+  g->ring = malloc(DIGESTER_RING);
+  if(!g->ring) return;
+  g->head = 0;
+  g->tail = 0;
+  g->done = 0;
+  g->pending = 0;
+  g->space = DIGESTER_RING;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->more, NULL);
+  pthread_cond_init(&g->room, NULL);
+  if(pthread_create(&g->thread, NULL, digester_thread, g)) {
+    pthread_cond_destroy(&g->room);
+    pthread_cond_destroy(&g->more);
+    pthread_mutex_destroy(&g->lock);
+    free(g->ring);
+    return;
+  }
+  g->threaded = 1;
+#endif
+}
+
+void digester_update(struct digester *g, const void *data, size_t len) {
+  if(!g->d.which) return;
+#ifdef DIGEST_THREAD
+  if(g->threaded) {
+    digester_put(g, data, len);
+    return;
+  }
+#endif
+  digests_update(&g->d, data, len);
+}
+
+void digester_zeros(struct digester *g, uint64_t len) {
+  if(!g->d.which) return;
+#ifdef DIGEST_THREAD
+  if(g->threaded) {
+    digester_put(g, NULL, len);
+    return;
+  }
+#endif
+  digests_zeros(&g->d, len);
+}
+
+/*
+** Wait for the thread to catch up, and finish the digests (once)
+*/
+void digester_finish(struct digester *g) {
+  if(g->finished) return;
+  g->finished = 1;
+#ifdef DIGEST_THREAD
+  if(g->threaded) {
+    pthread_mutex_lock(&g->lock);
+    g->head += g->pending;
+    g->pending = 0;
+    g->done = 1;
+    pthread_cond_signal(&g->more);
+    pthread_mutex_unlock(&g->lock);
+    pthread_join(g->thread, NULL);
+    pthread_cond_destroy(&g->room);
+    pthread_cond_destroy(&g->more);
+    pthread_mutex_destroy(&g->lock);
+    free(g->ring);
+    g->threaded = 0;
+  }
+#endif
+  if(g->d.which) digests_final(&g->d);
+}
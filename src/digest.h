@@ -0,0 +1,98 @@
+/***************************************************************************/
+/*
+** DIGEST - Checksums of whole images, shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define DIGEST_THREAD
+#endif
+
+/*
+** The digests Redump and friends use to identify images.  Any combination
+** of them is computed over the same stream of data.
+*/
+#define DIGEST_CRC32  (1)
+#define DIGEST_MD5    (2)
+#define DIGEST_SHA1   (4)
+#define DIGEST_SHA256 (8)
+#define DIGEST_ALL    (15)
+
+#define DIGEST_MAXSIZE (32)
+
+struct digests {
+  int which;
+  uint64_t length;
+  uint32_t crc32;
+  uint32_t md5[4];
+  uint32_t sha1[5];
+  uint32_t sha256[8];
+  /* Partial 64-byte block, shared by the block-based ones */
+  unsigned char block[64];
+  size_t blockfill;
+};
+
+int digests_parse(const char *list);
+void digests_init(struct digests *d, int which);
+void digests_update(struct digests *d, const void *data, size_t len);
+void digests_final(struct digests *d);
+size_t digest_result(const struct digests *d, int which, unsigned char *out);
+const char *digest_name(int which);
+void digests_print(const struct digests *d, FILE *f, int dots);
+
+/*
+** Digests worked out on a helper thread, so that the pass producing the
+** data doesn't wait for them.  Data is copied into a ring, which the thread
+** works through in batches; without threads, it's digested on the spot.
+** Nothing is done if no digests were asked for.
+*/
+#define DIGESTER_RING  (8 * 1048576)
+#define DIGESTER_BATCH (262144)
+
+struct digester {
+  struct digests d;
+  int finished;
+#ifdef DIGEST_THREAD
+  int threaded;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  pthread_cond_t room;
+  unsigned char *ring;
+  uint64_t head;
+  uint64_t tail;
+  int done;
+  /* The producer's own: written but not handed over yet, and known free */
+  size_t pending;
+  size_t space;
+#endif
+};
+
+void digester_start(struct digester *g, int which);
+void digester_update(struct digester *g, const void *data, size_t len);
+void digester_zeros(struct digester *g, uint64_t len);
+void digester_finish(struct digester *g);
+
+#endif
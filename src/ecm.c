@@ -29,16 +29,34 @@
 */
 /***************************************************************************/
 #define _FILE_OFFSET_BITS 64
-/*#define ENABLE_EXTRA_CHECKS*/
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef ENABLE_EXTRA_CHECKS
-#include <limits.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
+#include "cue.h"
+#include "digest.h"
+#include "ecmio.h"
+#include "ecmidx.h"
+#include "ecm2.h"
+#include "libecm.h"
+
 #if !defined(_FILE_OFFSET_BITS) || _FILE_OFFSET_BITS != 64
 #define ORIGINAL_MODE
 #endif
@@ -86,420 +104,693 @@ char* GetByteSize(off_t size, char* dst) {
 
 /***************************************************************************/
 
-/* LUTs used for computing ECC/EDC */
-static ecc_uint8 ecc_f_lut[256];
-static ecc_uint8 ecc_b_lut[256];
-static ecc_uint32 edc_lut[256];
+off_t mycounter_analyze;
+off_t mycounter_encode;
+off_t mycounter_total;
+
+void resetcounter(off_t total) {
+  mycounter_analyze = 0;
+  mycounter_encode = 0;
+  mycounter_total = total;
+}
+
+/*
+** When the total is unknown (input is a pipe), show the byte counts instead
+*/
+void showcounter(off_t analyze, off_t encode) {
+  if(mycounter_total < 0) {
+    char strbuff1[64];
+    char strbuff2[64];
+    fprintf(stderr, "Analyzing %s Encoding %s        \r",
+      GetByteSize(analyze, strbuff1), GetByteSize(encode, strbuff2)
+    );
+  } else {
+    off_t a = (analyze+64)/128;
+    off_t e = (encode+64)/128;
+    off_t d = (mycounter_total+64)/128;
+    if(!d) d = 1;
+    fprintf(stderr,
+#ifdef ORIGINAL_MODE
+      "Analyzing (%02d%%) Encoding (%02d%%)\r",
+      (100*a) / d, (100*e) / d
+#else
+      "Analyzing (%02lld%%) Encoding (%02lld%%)\r",
+      (long long)((100*a) / d), (long long)((100*e) / d)
+#endif
+    );
+  }
+}
+
+void setcounter_analyze(off_t n) {
+  if((n >> 20) != (mycounter_analyze >> 20)) {
+    showcounter(n, mycounter_encode);
+  }
+  mycounter_analyze = n;
+}
 
-/* Init routine */
-static void eccedc_init(void) {
-  ecc_uint32 i, j, edc;
-  for(i = 0; i < 256; i++) {
-    j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-    ecc_f_lut[i] = j;
-    ecc_b_lut[i ^ j] = i;
-    edc = i;
-    for(j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-    edc_lut[i] = edc;
+void setcounter_encode(off_t n) {
+  if((n >> 20) != (mycounter_encode >> 20)) {
+    showcounter(mycounter_analyze, n);
   }
+  mycounter_encode = n;
 }
 
 /***************************************************************************/
 /*
-** Compute EDC for a block
+** Long literal runs are copied from the input file to the output without
+** passing through user space (see output_passthrough).  The encoder gets
+** them from the queue if the run is still in it, or from a temporary
+** mapping of the input otherwise, for the EDC.  Returns how many bytes were
+** handled.
 */
-ecc_uint32 edc_computeblock(
-        ecc_uint32 edc,
-        const ecc_uint8 *src,
-        ecc_uint16 size
+#define PASSTHROUGH_MIN   (65536)
+#define PASSTHROUGH_PIECE (67108864)
+
+int passthroughfd = -1;
+
+/* Digests of the input, which goes past in order as the runs are encoded */
+struct digester indigests;
+
+off_t passthrough(
+  struct ecm_encoder *e,
+  off_t count,
+  off_t inpos,
+  const unsigned char *queue,
+  struct output *out
 ) {
-  while(size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-  return edc;
+  off_t done = 0;
+  if((passthroughfd < 0) || (count < PASSTHROUGH_MIN)) return 0;
+  while(done < count) {
+    struct view v;
+    const unsigned char *src;
+    off_t piece = count - done;
+    off_t r;
+    if(piece > PASSTHROUGH_PIECE) piece = PASSTHROUGH_PIECE;
+    v.base = NULL;
+    if(queue) {
+      src = queue + done;
+    } else {
+      if(view_map(&v, passthroughfd, inpos + done, (size_t)piece)) break;
+      src = v.data;
+    }
+    r = output_passthrough(out, passthroughfd, inpos + done, piece, src);
+    ecm_encode_data(e, 0, src, (size_t)r, NULL);
+    digester_update(&indigests, src, (size_t)r);
+    view_unmap(&v);
+    done += r;
+    setcounter_encode(inpos + done);
+    if(r < piece) break;
+  }
+  return done;
 }
 
 /***************************************************************************/
 /*
-** Compute ECC for a block (can do either P or Q)
+** Holes in sparse input files
+**
+** A hole reads as zeros, and 2336 zero bytes always check out as a mode 2
+** form 1 sector, so the analysis can take a hole in whole sectors of type 2
+** without looking at it, and the encoder can write them out without reading
+** them.  Each "struct holes" follows one cursor through the file (the
+** analysis and the encoder each have their own) and only asks the system
+** again once the cursor leaves the hole it knows about.
 */
-static int ecc_computeblock(
-  ecc_uint8 *src,
-  ecc_uint32 major_count,
-  ecc_uint32 minor_count,
-  ecc_uint32 major_mult,
-  ecc_uint32 minor_inc,
-  ecc_uint8 *dest
-) {
-  ecc_uint32 size = major_count * minor_count;
-  ecc_uint32 major, minor;
-  for(major = 0; major < major_count; major++) {
-    ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-    ecc_uint8 ecc_a = 0;
-    ecc_uint8 ecc_b = 0;
-    for(minor = 0; minor < minor_count; minor++) {
-      ecc_uint8 temp = src[index];
-      index += minor_inc;
-      if(index >= size) index -= size;
-      ecc_a ^= temp;
-      ecc_b ^= temp;
-      ecc_a = ecc_f_lut[ecc_a];
-    }
-    ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-    if(dest[major              ] != (ecc_a        )) return 0;
-    if(dest[major + major_count] != (ecc_a ^ ecc_b)) return 0;
-  }
-  return 1;
+#ifdef SEEK_HOLE
+#define USE_HOLES
+
+struct holes {
+  int fd;
+  off_t total;
+  off_t start;
+  off_t end;
+};
+
+struct holes analyzeholes;
+struct holes encodeholes;
+
+void holes_init(struct holes *h, int fd, off_t total) {
+  h->fd = fd;
+  h->total = total;
+  h->start = 0;
+  h->end = 0;
+}
+
+/*
+** Number of whole type 2 sectors that fit in a hole starting at "pos"
+*/
+off_t hole_sectors(struct holes *h, off_t pos) {
+  if(h->fd < 0) return 0;
+  if(pos >= h->end) {
+    /* Don't disturb the file position stdio thinks it's at */
+    off_t cur = lseek(h->fd, 0, SEEK_CUR);
+    off_t start = lseek(h->fd, pos, SEEK_HOLE);
+    off_t end = h->total;
+    if((start < 0) || (start >= h->total)) {
+      /* No more holes */
+      start = h->total;
+      h->fd = -1;
+    } else {
+      end = lseek(h->fd, start, SEEK_DATA);
+      if(end < 0) end = h->total;
+    }
+    lseek(h->fd, cur, SEEK_SET);
+    h->start = start;
+    h->end = end;
+  }
+  if(pos < h->start) return 0;
+  return (h->end - pos) / 2336;
 }
+#endif
+
 
+/***************************************************************************/
 /*
-** Generate ECC P and Q codes for a block
+** Write out a run that's done, as a record
+**
+** Its data is taken from "queue" when that's non-NULL (the run is still in
+** the analysis queue), otherwise it's read back from "in", which must
+** already be positioned at the start of the run.
 */
-static int ecc_generate(
-  ecc_uint8 *sector,
-  int        zeroaddress,
-  ecc_uint8 *dest
+void in_flush(
+  struct ecm_encoder *e,
+  const struct ecm_run *run,
+  struct input *in,
+  const unsigned char *queue,
+  struct output *out
 ) {
-  int r;
-  ecc_uint8 address[4], i;
-  /* Save the address and zero it out */
-  if(zeroaddress) for(i = 0; i < 4; i++) {
-    address[i] = sector[12 + i];
-    sector[12 + i] = 0;
-  }
-  /* Compute ECC P code */
-  if(!(ecc_computeblock(sector + 0xC, 86, 24,  2, 86, dest + 0x81C - 0x81C))) {
-    if(zeroaddress) for(i = 0; i < 4; i++) sector[12 + i] = address[i];
-    return 0;
+  unsigned char buf[2352];
+  unsigned char header[ECM_HEADER_MAX];
+  const unsigned char *sector;
+  int type = run->type;
+  off_t count = (off_t)run->count;
+  off_t inpos = (off_t)run->start;
+  output_put(out, header, ecm_encode_header(run, header));
+  if(!type) {
+    off_t done = passthrough(e, count, inpos, queue, out);
+    if(done) {
+      count -= done;
+      inpos += done;
+      if(queue) {
+        queue += done;
+      } else {
+        input_skip(in, done);
+      }
+    }
+    while(count) {
+      ecc_uint16 b = (count > 2352 ? 2352 : (ecc_uint16)count);
+      if(queue) {
+        sector = queue;
+        queue += b;
+      } else {
+        input_read(in, buf, b);
+        sector = buf;
+      }
+      ecm_encode_data(e, 0, sector, b, NULL);
+      digester_update(&indigests, sector, b);
+      output_put(out, sector, b);
+      count -= b;
+      inpos += b;
+      setcounter_encode(inpos);
+    }
+    return;
+  }
+  while(count) {
+    ecc_uint16 b = (ecc_uint16)ecm_unit_image[type];
+    size_t n = ecm_unit_file[type];
+#ifdef USE_HOLES
+    if(type == 2) {
+      off_t z = hole_sectors(&encodeholes, inpos);
+      if(z) {
+        if(z > count) z = count;
+        ecm_encode_zeros(e, (uint64_t)z);
+        digester_zeros(&indigests, (uint64_t)(z * 2336));
+        output_zeros(out, z * (off_t)n);
+        count -= z;
+        inpos += z * 2336;
+        if(queue) {
+          queue += z * 2336;
+        } else {
+          input_skip(in, z * 2336);
+        }
+        setcounter_encode(inpos);
+        continue;
+      }
+    }
+#endif
+    count--;
+    if(queue) {
+      sector = queue;
+      queue += b;
+    } else {
+      input_read(in, buf, b);
+      sector = buf;
+    }
+    digester_update(&indigests, sector, b);
+    ecm_encode_data(e, type, sector, b, output_reserve(out, n));
+    output_commit(out, n);
+    inpos += b;
+    setcounter_encode(inpos);
   }
-  /* Compute ECC Q code */
-  r = ecc_computeblock(sector + 0xC, 52, 43, 86, 88, dest + 0x8C8 - 0x81C);
-  /* Restore the address */
-  if(zeroaddress) for(i = 0; i < 4; i++) sector[12 + i] = address[i];
-  return r;
 }
 
 /***************************************************************************/
 
 /*
-** sector types:
-** 00 - literal bytes
-** 01 - 2352 mode 1         predict sync, mode, reserved, edc, ecc
-** 02 - 2336 mode 2 form 1  predict redundant flags, edc, ecc
-** 03 - 2336 mode 2 form 2  predict redundant flags, edc
+** Analysis queue
+**
+** The queue holds the input from inputqueuebase up to the read position.
+** Where possible it's a ring buffer mapped twice back to back, so that
+** queue_at() can return a contiguous pointer for any position even when
+** the data wraps around the end of the buffer; refilling it is then just a
+** read at the write position.  Elsewhere it's a plain buffer, and the
+** unconsumed tail is moved back to the start before each refill.
 */
+#define DEFAULT_WINDOW (1048576 * 5)
 
-int check_type(unsigned char *sector, int canbetype1) {
-  int canbetype2 = 1;
-  int canbetype3 = 1;
-  ecc_uint32 myedc;
-  /* Check for mode 1 */
-  if(canbetype1) {
-    if(
-      (sector[0x00] != 0x00) ||
-      (sector[0x01] != 0xFF) ||
-      (sector[0x02] != 0xFF) ||
-      (sector[0x03] != 0xFF) ||
-      (sector[0x04] != 0xFF) ||
-      (sector[0x05] != 0xFF) ||
-      (sector[0x06] != 0xFF) ||
-      (sector[0x07] != 0xFF) ||
-      (sector[0x08] != 0xFF) ||
-      (sector[0x09] != 0xFF) ||
-      (sector[0x0A] != 0xFF) ||
-      (sector[0x0B] != 0x00) ||
-      (sector[0x0F] != 0x01) ||
-      (sector[0x814] != 0x00) ||
-      (sector[0x815] != 0x00) ||
-      (sector[0x816] != 0x00) ||
-      (sector[0x817] != 0x00) ||
-      (sector[0x818] != 0x00) ||
-      (sector[0x819] != 0x00) ||
-      (sector[0x81A] != 0x00) ||
-      (sector[0x81B] != 0x00)
-    ) {
-      canbetype1 = 0;
-    }
-  }
-  /* Check for mode 2 */
-  if(
-    (sector[0x0] != sector[0x4]) ||
-    (sector[0x1] != sector[0x5]) ||
-    (sector[0x2] != sector[0x6]) ||
-    (sector[0x3] != sector[0x7])
-  ) {
-    canbetype2 = 0;
-    canbetype3 = 0;
-    if(!canbetype1) return 0;
-  }
-
-  /* Check EDC */
-  myedc = edc_computeblock(0, sector, 0x808);
-  if(canbetype2) if(
-    (sector[0x808] != ((myedc >>  0) & 0xFF)) ||
-    (sector[0x809] != ((myedc >>  8) & 0xFF)) ||
-    (sector[0x80A] != ((myedc >> 16) & 0xFF)) ||
-    (sector[0x80B] != ((myedc >> 24) & 0xFF))
-  ) {
-    canbetype2 = 0;
-  }
-  myedc = edc_computeblock(myedc, sector + 0x808, 8);
-  if(canbetype1) if(
-    (sector[0x810] != ((myedc >>  0) & 0xFF)) ||
-    (sector[0x811] != ((myedc >>  8) & 0xFF)) ||
-    (sector[0x812] != ((myedc >> 16) & 0xFF)) ||
-    (sector[0x813] != ((myedc >> 24) & 0xFF))
-  ) {
-    canbetype1 = 0;
-  }
-  myedc = edc_computeblock(myedc, sector + 0x810, 0x10C);
-  if(canbetype3) if(
-    (sector[0x91C] != ((myedc >>  0) & 0xFF)) ||
-    (sector[0x91D] != ((myedc >>  8) & 0xFF)) ||
-    (sector[0x91E] != ((myedc >> 16) & 0xFF)) ||
-    (sector[0x91F] != ((myedc >> 24) & 0xFF))
-  ) {
-    canbetype3 = 0;
-  }
-  /* Check ECC */
-  if(canbetype1) { if(!(ecc_generate(sector       , 0, sector + 0x81C))) { canbetype1 = 0; } }
-  if(canbetype2) { if(!(ecc_generate(sector - 0x10, 1, sector + 0x80C))) { canbetype2 = 0; } }
-  if(canbetype1) return 1;
-  if(canbetype2) return 2;
-  if(canbetype3) return 3;
+unsigned char *inputqueue;
+size_t inputqueuesize;
+off_t inputqueuebase;
+int inputqueuering;
+
+int queue_init(size_t size) {
+#ifdef __linux__
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t ringsize = (size + pagesize - 1) / pagesize * pagesize;
+  int fd = memfd_create("ecm-queue", MFD_CLOEXEC);
+  if(fd >= 0) {
+    unsigned char *base = MAP_FAILED;
+    if(!ftruncate(fd, (off_t)ringsize)) {
+      base = mmap(NULL, ringsize * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(base != MAP_FAILED) {
+      if(
+        (mmap(base, ringsize, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_FIXED, fd, 0) == base) &&
+        (mmap(base + ringsize, ringsize, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_FIXED, fd, 0) == base + ringsize)
+      ) {
+        close(fd);
+        inputqueue = base;
+        inputqueuesize = ringsize;
+        inputqueuebase = 0;
+        inputqueuering = 1;
+        return 0;
+      }
+      munmap(base, ringsize * 2);
+    }
+    close(fd);
+  }
+#endif
+  inputqueue = malloc(size);
+  if(!inputqueue) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  inputqueuesize = size;
+  inputqueuebase = 0;
+  inputqueuering = 0;
   return 0;
 }
 
-/***************************************************************************/
+void queue_free(void) {
+#ifdef __linux__
+  if(inputqueuering) {
+    munmap(inputqueue, inputqueuesize * 2);
+    inputqueue = NULL;
+    return;
+  }
+#endif
+  free(inputqueue);
+  inputqueue = NULL;
+}
+
 /*
-** Encode a type/count combo
+** Where the byte at input position "pos" lives in the queue
 */
-void write_type_count(
-  FILE *out,
-  int type,
-  off_t count
-) {
-  /*Workaround to replace the side effect of calling this function with count=0,
-  when it was of type uint32.*/
-  if (count == 0)
-    count = 0xFFFFFFFF;
-  else
-    count--;
-  int charToWrite = (int)(((count >= 32 ? 1 : 0) << 7) | ((count & 31) << 2));
-  fputc(charToWrite | type, out);
-  count >>= 5;
-  while(count) {
-    charToWrite = (int)(((count >= 128 ? 1 : 0) << 7) | (count & 127));
-    fputc(charToWrite, out);
-    count >>= 7;
+static unsigned char *queue_at(off_t pos) {
+  if(inputqueuering) return inputqueue + (size_t)(pos % (off_t)inputqueuesize);
+  return inputqueue + (size_t)(pos - inputqueuebase);
+}
+
+/*
+** Oldest input position still held in the queue
+*/
+static off_t queue_oldest(off_t readpos) {
+  if(inputqueuering) {
+    return readpos > (off_t)inputqueuesize ? readpos - (off_t)inputqueuesize : 0;
   }
+  return inputqueuebase;
 }
 
-/***************************************************************************/
+#ifdef USE_MMAP
+/*
+** Map a regular file for reading, or return NULL if that's not possible
+*/
+static const unsigned char *map_input(FILE *in, off_t length) {
+  struct stat st;
+  void *map;
+  if(length <= 0 || (off_t)(size_t)length != length) return NULL;
+  if(fstat(fileno(in), &st) || !S_ISREG(st.st_mode)) return NULL;
+  map = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if(map == MAP_FAILED) return NULL;
+  madvise(map, (size_t)length, MADV_SEQUENTIAL);
+  return map;
+}
+#endif
 
-off_t mycounter_analyze;
-off_t mycounter_encode;
-off_t mycounter_total;
+int inputdirect;
+int inputnocache;
 
-void resetcounter(off_t total) {
-  mycounter_analyze = 0;
-  mycounter_encode = 0;
-  mycounter_total = total;
+/*
+** O_DIRECT reads into the queue have to be a multiple of DIRECT_ALIGN long.
+** Round "len" down to that, unless it reaches the end of the file: then
+** round it up if there's room, since the read just comes up short.
+*/
+off_t direct_length(off_t len, off_t room, off_t left) {
+  off_t up = (len + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+  if((len == left) && (up <= room)) return up;
+  return len & ~(off_t)(DIRECT_ALIGN - 1);
 }
 
-void setcounter_analyze(off_t n) {
-  if((n >> 20) != (mycounter_analyze >> 20)) {
-    off_t a = (n+64)/128;
-    off_t e = (mycounter_encode+64)/128;
-    off_t d = (mycounter_total+64)/128;
-    if(!d) d = 1;
-    fprintf(stderr,
-#ifdef ORIGINAL_MODE
-      "Analyzing (%02d%%) Encoding (%02d%%)\r",
-#else
-      "Analyzing (%02lld%%) Encoding (%02lld%%)\r",
-#endif
-      (100*a) / d, (100*e) / d
-    );
+#ifdef USE_MMAP
+/*
+** Read up to "len" bytes at "pos" with O_DIRECT.  Returns how many bytes
+** were read, or -1 on error.
+*/
+off_t read_direct(int fd, unsigned char *dest, off_t len, off_t room, off_t pos, off_t total) {
+  off_t got = 0;
+  len = direct_length(len, room, total - pos);
+  while(got < len) {
+    ssize_t r = pread(fd, dest + got, (size_t)(len - got), pos + got);
+    if(r < 0 && errno == EINTR) continue;
+    if(r < 0) return -1;
+    if(!r) break;
+    got += r;
   }
-  mycounter_analyze = n;
+  return got;
 }
-
-void setcounter_encode(off_t n) {
-  if((n >> 20) != (mycounter_encode >> 20)) {
-    off_t a = (mycounter_analyze+64)/128;
-    off_t e = (n+64)/128;
-    off_t d = (mycounter_total+64)/128;
-    if(!d) d = 1;
-    fprintf(stderr,
-#ifdef ORIGINAL_MODE
-      "Analyzing (%02d%%) Encoding (%02d%%)\r",
-#else
-      "Analyzing (%02lld%%) Encoding (%02lld%%)\r",
 #endif
-      (100*a) / d, (100*e) / d
-    );
+
+#ifdef HAVE_IO_URING
+/*
+** Keep the free part of the queue covered by reads in flight
+*/
+#define URING_CHUNK (262144)
+
+static void uring_topup(struct readahead *ra, off_t keepfrom, off_t total) {
+  while((ra->submitpos < total) && (ra->count < READAHEAD_MAXDEPTH)) {
+    off_t len = URING_CHUNK;
+    off_t room = (off_t)inputqueuesize - (ra->submitpos - keepfrom);
+    if(len > total - ra->submitpos) len = total - ra->submitpos;
+    if(len > room) len = room;
+    if(inputdirect) len = direct_length(len, room, total - ra->submitpos);
+    if(len <= 0) break;
+    readahead_submit(ra, queue_at(ra->submitpos), (size_t)len);
   }
-  mycounter_encode = n;
 }
+#endif
 
-/***************************************************************************/
 /*
-** Encode a run of sectors/literals of the same type
+** Flush a run, from the queue if it's still in there, otherwise reading it
+** back from the input
 */
-ecc_uint32 in_flush(
-  ecc_uint32 edc,
-  int type,
-  off_t count,
+void flush_run(
+  struct ecm_encoder *e,
+  const struct ecm_run *run,
+  off_t queuefront,
   FILE *in,
-  FILE *out
+  struct output *out
 ) {
-  unsigned char buf[2352];
-  write_type_count(out, type, count);
-  if(!type) {
-    while(count) {
-      ecc_uint16 b = (count > 2352 ? 2352 : (ecc_uint16)count);
-      fread(buf, 1, b, in);
-      edc = edc_computeblock(edc, buf, b);
-      fwrite(buf, 1, b, out);
-      count -= b;
-      setcounter_encode(ftell(in));
-    }
-    return edc;
-  }
-  while(count--) {
-    switch(type) {
-    case 1:
-      fread(buf, 1, 2352, in);
-      edc = edc_computeblock(edc, buf, 2352);
-      fwrite(buf + 0x00C, 1, 0x003, out);
-      fwrite(buf + 0x010, 1, 0x800, out);
-      setcounter_encode(ftell(in));
-      break;
-    case 2:
-      fread(buf, 1, 2336, in);
-      edc = edc_computeblock(edc, buf, 2336);
-      fwrite(buf + 0x004, 1, 0x804, out);
-      setcounter_encode(ftell(in));
-      break;
-    case 3:
-      fread(buf, 1, 2336, in);
-      edc = edc_computeblock(edc, buf, 2336);
-      fwrite(buf + 0x004, 1, 0x918, out);
-      setcounter_encode(ftell(in));
-      break;
-    }
-  }
-  return edc;
+  struct input i;
+  off_t start = (off_t)run->start;
+  if(start >= queue_oldest(queuefront)) {
+    in_flush(e, run, NULL, queue_at(start), out);
+    return;
+  }
+  fseek(in, start, SEEK_SET);
+  input_open(&i, in, (inputdirect ? ECMIO_DIRECT : 0) | inputnocache);
+  in_flush(e, run, &i, NULL, out);
+  input_close(&i);
 }
 
-/***************************************************************************/
-
-unsigned char inputqueue[1048576 * 5 + 4];
-
-int ecmify(FILE *in, FILE *out) {
-  ecc_uint32 inedc = 0;
-  int curtype = -1;
-  off_t curtypecount = 0;
-  off_t curtype_in_start = 0;
-  int detecttype;
+/*
+** Encode.  There are three ways of getting at the input:
+**
+** - If it's a regular file that can be mapped, the mapping itself serves as
+**   the analysis queue.  Sectors are classified in place and runs are
+**   written straight from the mapping, with no copying at all.
+** - Otherwise, if it can be seeked, it's read through the analysis queue.
+**   Runs are encoded from the queue if they're still in it, or read back
+**   from the input otherwise, exactly like the original encoder.  With
+**   "ECMIO_URING" (and a ring queue), the free part of the queue is kept
+**   covered by io_uring reads in flight ahead of the analysis cursor.
+** - If it can't be seeked (pipe, socket, terminal), runs are always encoded
+**   from the queue.  A run that doesn't fit in the queue is then flushed
+**   early and continued in a new record of the same type, which keeps
+**   memory bounded at the cost of an extra type/count header every few MiB.
+**
+** "digests" is the set of digests to compute of the input, which also go to
+** "digestfile" (if not NULL) in machine-readable form.
+*/
+int ecmify(FILE *in, FILE *out, int digests, FILE *digestfile, int ioflags) {
+  struct ecm_encoder e;
+  struct ecm_run done;
+  unsigned char trailer[ECM_TRAILER_MAX];
   off_t incheckpos = 0;
   off_t inbufferpos = 0;
-  off_t intotallength;
-  ecc_uint32 inqueuestart = 0;
-  ecc_int32 dataavail = 0;
+  off_t intotallength = -1;
+  off_t dataavail;
+  off_t queuefront = 0;
   off_t typetally[4];
-  fseek(in, 0, SEEK_END);
-  intotallength = ftell(in);
+  int streaming;
+  int infd;
+  int ineof = 0;
+  struct output o;
+#ifdef USE_MMAP
+  const unsigned char *map = NULL;
+#endif
+  struct cacheadvice advice;
+  off_t nextadvise = 0;
+  int useuring = 0;
+#ifdef HAVE_IO_URING
+  struct readahead ra;
+  off_t nexttopup = 0;
+#endif
+  if(output_open(&o, out, ioflags | ECMIO_SPARSE)) return 1;
+  digester_start(&indigests, digests);
+  streaming = (fseek(in, 0, SEEK_END) != 0);
+  if(!streaming) {
+    intotallength = ftell(in);
+    if(intotallength < 0) {
+      streaming = 1;
+    }
+  }
+  /*
+  ** Input that can be seeked but has no descriptor of its own (the files of
+  ** a cue sheet) only goes through stdio
+  */
+  infd = streaming ? -1 : fileno(in);
+  /*
+  ** O_DIRECT reads go into the ring queue at aligned positions (it's page
+  ** aligned, and so is every read but the last)
+  */
+  inputdirect = (infd >= 0) && (ioflags & ECMIO_DIRECT) && inputqueuering &&
+    !set_direct(infd, 1);
+  inputnocache = ioflags & ECMIO_NOCACHE;
+  cacheadvice_init(&advice, infd, 0,
+    (ioflags & ~ECMIO_DIRECT) | (inputdirect ? ECMIO_DIRECT : 0));
+#ifdef USE_MMAP
+  if((infd >= 0) && !(ioflags & (ECMIO_URING | ECMIO_DIRECT))) {
+    map = map_input(in, intotallength);
+    if(map) {
+      /* The whole file is in the queue from the start */
+      queue_free();
+      inputqueue = (unsigned char*)map;
+      inputqueuesize = (size_t)intotallength;
+      inputqueuebase = 0;
+      inputqueuering = 0;
+      inbufferpos = intotallength;
+      ineof = 1;
+      advice.map = map;
+    }
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if((infd >= 0) && (ioflags & ECMIO_URING) && inputqueuering) {
+    useuring = !readahead_init(&ra, infd, intotallength,
+      inputqueue, inputqueuesize * 2);
+  }
+#endif
+  passthroughfd = inputdirect ? -1 : infd;
+#ifdef USE_HOLES
+  /* Reads in flight can't be redirected around holes */
+  holes_init(&analyzeholes, useuring ? -1 : infd, intotallength);
+  holes_init(&encodeholes, useuring ? -1 : infd, intotallength);
+#endif
   resetcounter(intotallength);
   typetally[0] = 0;
   typetally[1] = 0;
   typetally[2] = 0;
   typetally[3] = 0;
-  /* Magic identifier */
-  fputc('E', out);
-  fputc('C', out);
-  fputc('M', out);
-  fputc(0x00, out);
+  ecm_encoder_init_runs(&e);
+  output_put(&o, ecm_magic, 4);
   for(;;) {
-    if((dataavail < 2352) && (intotallength - inbufferpos > dataavail)) {
-      const off_t diffLenPos = intotallength - inbufferpos;
-      ecc_int32 willread;
-      if (diffLenPos > sizeof(inputqueue) - 4 - dataavail) {
-#ifdef ENABLE_EXTRA_CHECKS
-        if (INT_MAX < sizeof(inputqueue) - 4 - dataavail) {
-          printf("Sorry, \"sizeof(inputqueue) - 4 - dataavail\" is too big to be casted to int32 (%ld)\n", sizeof(inputqueue) - 4 - dataavail);
-          exit(0);
+#ifdef USE_HOLES
+    /*
+    ** Take whole sectors of a hole as they are; they'd come out as type 2
+    ** anyway.  Skipping past the end of what's been read is fine, since
+    ** nothing in a hole is ever taken from the queue.
+    */
+    if(!ineof || (incheckpos < inbufferpos)) {
+      off_t n = hole_sectors(&analyzeholes, incheckpos);
+      if(n) {
+        ecm_encode_units(&e, 2, (uint64_t)n, &done);
+        if(done.count) {
+          typetally[done.type] += (off_t)done.count;
+          flush_run(&e, &done, queuefront, in, &o);
         }
+        incheckpos += n * 2336;
+        if(incheckpos > inbufferpos) {
+          /* O_DIRECT reads back the little bit up to here instead */
+          inbufferpos = incheckpos;
+          if(inputdirect) inbufferpos &= ~(off_t)(DIRECT_ALIGN - 1);
+          if(inbufferpos >= intotallength) ineof = 1;
+        }
+        setcounter_analyze(incheckpos);
+        continue;
+      }
+    }
 #endif
-        willread = (ecc_int32)(sizeof(inputqueue) - 4 - dataavail);
-	  }
-      else {
-        willread = (ecc_int32)diffLenPos;
-	  }
-
-      if(inqueuestart) {
-        memmove(inputqueue + 4, inputqueue + 4 + inqueuestart, dataavail);
-        inqueuestart = 0;
+    if(incheckpos >= nextadvise) {
+      /*
+      ** Read ahead of whatever is read next (of the analysis itself once
+      ** it's all there, as with a mapping).  The pending run may still be
+      ** read back from the input.
+      */
+      cacheadvice_update(&advice,
+        (ineof || incheckpos > inbufferpos) ? incheckpos : inbufferpos,
+        e.count ? (off_t)e.start : incheckpos);
+      nextadvise = incheckpos + CACHEADVICE_STEP / 4;
+#ifdef USE_MMAP
+      if(map) setcounter_analyze(incheckpos);
+#endif
+    }
+#ifdef HAVE_IO_URING
+    if(useuring) {
+      if(incheckpos >= nexttopup) {
+        uring_topup(&ra, incheckpos, intotallength);
+        nexttopup = incheckpos + URING_CHUNK;
       }
-      if(willread) {
+      if((inbufferpos - incheckpos < 2352) && !ineof) {
+        off_t want = incheckpos + 2352;
+        if(want > intotallength) want = intotallength;
         setcounter_analyze(inbufferpos);
-        fseek(in, inbufferpos, SEEK_SET);
-        fread(inputqueue + 4 + dataavail, 1, willread, in);
-        inbufferpos += willread;
-#ifdef ENABLE_EXTRA_CHECKS
-        if (LLONG_MAX - dataavail < willread) {
-          printf("Sorry, I can't increase dataavail by willread: intmax-dataavail=%d, willread=%d", LLONG_MAX - dataavail, willread);
-          exit(0);
+        uring_topup(&ra, incheckpos, intotallength);
+        inbufferpos = readahead_complete(&ra, want);
+        if(ra.error) {
+          perror("read");
+          readahead_exit(&ra);
+          output_close(&o);
+          digester_finish(&indigests);
+          return 1;
         }
-#endif
-        dataavail += willread;
+        if(inbufferpos >= intotallength) ineof = 1;
       }
     }
-    if(dataavail == 0) break;
-    if(dataavail < 2336) {
-      detecttype = 0;
-    }
-    else {
-      detecttype = check_type(inputqueue + 4 + inqueuestart, dataavail >= 2352);
-    }
-    if(detecttype != curtype) {
-      if(curtypecount) {
-        fseek(in, curtype_in_start, SEEK_SET);
-        typetally[curtype] += curtypecount;
-        inedc = in_flush(inedc, curtype, curtypecount, in, out);
+#endif
+    if((inbufferpos - incheckpos < 2352) && !ineof && !useuring) {
+      /*
+      ** In streaming mode the pending run has to stay in the queue, so
+      ** keep everything from the start of the run rather than from the
+      ** check position.  Flush the run first if it's hogging the queue.
+      */
+      off_t keepfrom = incheckpos;
+      off_t willread;
+      if(streaming && e.count) {
+        keepfrom = (off_t)e.start;
+        if(incheckpos - keepfrom > (off_t)inputqueuesize / 2) {
+          ecm_encode_cut(&e, &done);
+          typetally[done.type] += (off_t)done.count;
+          in_flush(&e, &done, NULL, queue_at(keepfrom), &o);
+          keepfrom = incheckpos;
+        }
+      }
+      if(keepfrom > inbufferpos) keepfrom = inbufferpos;
+      if(!inputqueuering && (keepfrom > inputqueuebase)) {
+        memmove(inputqueue, queue_at(keepfrom), (size_t)(inbufferpos - keepfrom));
+        inputqueuebase = keepfrom;
       }
-      curtype = detecttype;
-      curtype_in_start = incheckpos;
-      curtypecount = 1;
-    }
-    else {
-#ifdef ENABLE_EXTRA_CHECKS
-      if (curtypecount == LLONG_MAX) {
-        printf("Sorry, I can't increase curtypecount by one, it got to LLONG_MAX!\n");
-		exit(0);
+      willread = (off_t)inputqueuesize - (inbufferpos - keepfrom);
+      if(!streaming && (intotallength - inbufferpos < willread)) {
+        willread = intotallength - inbufferpos;
       }
+      if(willread) {
+        off_t got;
+        setcounter_analyze(inbufferpos);
+#ifdef USE_MMAP
+        if(inputdirect) {
+          got = read_direct(infd, queue_at(inbufferpos), willread,
+            (off_t)inputqueuesize - (inbufferpos - keepfrom), inbufferpos,
+            intotallength);
+          /* Short is fine, as long as it keeps going */
+          if(got > 0) willread = got;
+        } else
 #endif
-      curtypecount++;
+        {
+          if(!streaming) fseek(in, inbufferpos, SEEK_SET);
+          got = (off_t)fread(queue_at(inbufferpos), 1, (size_t)willread, in);
+        }
+        if(got < willread) {
+          if(!streaming || inputdirect || ferror(in)) {
+            perror("read");
+            output_close(&o);
+            digester_finish(&indigests);
+            return 1;
+          }
+          ineof = 1;
+        }
+        inbufferpos += got;
+      }
+      if(!streaming && (inbufferpos >= intotallength)) ineof = 1;
     }
-    switch(curtype) {
-    case 0: incheckpos +=    1; inqueuestart +=    1; dataavail -=    1; break;
-    case 1: incheckpos += 2352; inqueuestart += 2352; dataavail -= 2352; break;
-    case 2: incheckpos += 2336; inqueuestart += 2336; dataavail -= 2336; break;
-    case 3: incheckpos += 2336; inqueuestart += 2336; dataavail -= 2336; break;
+    dataavail = inbufferpos - incheckpos;
+    if(dataavail == 0) break;
+    /* Anything before this may be overwritten by reads in flight */
+    queuefront = inbufferpos;
+#ifdef HAVE_IO_URING
+    if(useuring) queuefront = ra.submitpos;
+#endif
+    /* Only whether there's a whole sector matters */
+    if(dataavail > 2352) dataavail = 2352;
+    incheckpos += ecm_encode_unit(&e, queue_at(incheckpos), (size_t)dataavail, &done);
+    if(done.count) {
+      typetally[done.type] += (off_t)done.count;
+      flush_run(&e, &done, queuefront, in, &o);
     }
   }
-  if(curtypecount) {
-    fseek(in, curtype_in_start, SEEK_SET);
-    typetally[curtype] += curtypecount;
-    inedc = in_flush(inedc, curtype, curtypecount, in, out);
+  ecm_encode_cut(&e, &done);
+  if(done.count) {
+    typetally[done.type] += (off_t)done.count;
+    flush_run(&e, &done, queuefront, in, &o);
+  }
+#ifdef USE_MMAP
+  if(map) {
+    munmap((void*)map, (size_t)intotallength);
+    inputqueue = NULL;
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if(useuring) readahead_exit(&ra);
+#endif
+  cacheadvice_done(&advice, incheckpos);
+  digester_finish(&indigests);
+  output_put(&o, trailer, ecm_encode_trailer(&e, trailer));
+  if(output_close(&o)) {
+    perror("write");
+    return 1;
   }
-  /* End-of-records indicator */
-  write_type_count(out, 0, 0);
-  /* Input file EDC */
-  fputc((int)((inedc >>  0) & 0xFF), out);
-  fputc((int)((inedc >>  8) & 0xFF), out);
-  fputc((int)((inedc >> 16) & 0xFF), out);
-  fputc((int)((inedc >> 24) & 0xFF), out);
   /* Show report */
+  intotallength = incheckpos;
   char strbuff1[64];
   char strbuff2[64];
 #ifdef ORIGINAL_MODE
@@ -508,71 +799,672 @@ int ecmify(FILE *in, FILE *out) {
   fprintf(stderr, "Mode 2 form 1 sectors... %10d\n", typetally[2]);
   fprintf(stderr, "Mode 2 form 2 sectors... %10d\n", typetally[3]);
 #else
-  fprintf(stderr, "Literal bytes........... %10lld\n", typetally[0]);
-  fprintf(stderr, "Mode 1 sectors.......... %10lld\n", typetally[1]);
-  fprintf(stderr, "Mode 2 form 1 sectors... %10lld\n", typetally[2]);
-  fprintf(stderr, "Mode 2 form 2 sectors... %10lld\n", typetally[3]);
+  fprintf(stderr, "Literal bytes........... %10lld\n", (long long)typetally[0]);
+  fprintf(stderr, "Mode 1 sectors.......... %10lld\n", (long long)typetally[1]);
+  fprintf(stderr, "Mode 2 form 1 sectors... %10lld\n", (long long)typetally[2]);
+  fprintf(stderr, "Mode 2 form 2 sectors... %10lld\n", (long long)typetally[3]);
 #endif
-  const off_t finalsize = ftell(out);
+  const off_t finalsize = o.total;
   fprintf(stderr, "Encoded %s -> %s\n", GetByteSize(intotallength, strbuff1), GetByteSize(finalsize, strbuff2));
   if (finalsize <= intotallength)
     fprintf(stderr, "Stripped file is %s smaller (%d%%)\n", GetByteSize(intotallength - finalsize, strbuff1), (int)(100 * (intotallength - finalsize) / intotallength));
+  digests_print(&indigests.d, stderr, 1);
+  if(digestfile) digests_print(&indigests.d, digestfile, 0);
   fprintf(stderr, "Done.\n");
   return 0;
 }
 
 /***************************************************************************/
+/*
+** Encode "in" to "out" as ECM v2 (see ecm2.h), in chunks of "sectors"
+** sectors.  The input is read a batch of chunks at a time, the chunks of a
+** batch are encoded on every CPU at once, and they're written out in order.
+** The size of the image goes in the header, so the input can't be a pipe.
+*/
+struct chunkjob {
+  unsigned char *image;
+  size_t len;
+  unsigned char *out;
+  size_t outlen;
+};
+
+static int encode_job(void *arg, size_t k) {
+  struct chunkjob *j = (struct chunkjob *)arg + k;
+  return ecm2_encode_chunk(j->image, j->len, &j->out, &j->outlen);
+}
+
+/*
+** Count the units of each type in the records of a chunk, for the report
+*/
+static void tally_chunk(const unsigned char *p, size_t len, off_t *typetally) {
+  size_t at = 0;
+  while(at < len) {
+    unsigned bits = 5;
+    int c = p[at++];
+    int type = c & 3;
+    off_t num = (c >> 2) & 0x1F;
+    while((c & 0x80) && (at < len)) {
+      c = p[at++];
+      num |= ((off_t)(c & 0x7F)) << bits;
+      bits += 7;
+    }
+    if(num == 0xFFFFFFFF) break;
+    typetally[type] += num + 1;
+    at += (size_t)(num + 1) * ecm_unit_file[type];
+  }
+}
+
+int ecmify2(FILE *in, FILE *out, unsigned sectors, int digests, FILE *digestfile) {
+  struct ecm2 v;
+  struct chunkjob *jobs;
+  unsigned threads = ecm2_threads();
+  size_t batch = (size_t)threads * 4;
+  off_t typetally[4] = { 0, 0, 0, 0 };
+  off_t total;
+  off_t done = 0;
+  off_t encoded = 0;
+  size_t k, n;
+  int ret = 1;
+  if(fseeko(in, 0, SEEK_END) || ((total = ftello(in)) < 0) || fseeko(in, 0, SEEK_SET)) {
+    fprintf(stderr, "--v2 needs to know the size of the input; it can't be a pipe\n");
+    return 1;
+  }
+  resetcounter(total);
+  if(ecm2_start(&v, out, total, sectors)) {
+    perror("write");
+    ecm2_free(&v);
+    return 1;
+  }
+  jobs = calloc(batch, sizeof(*jobs));
+  if(!jobs) abort();
+  for(k = 0; k < batch; k++) {
+    jobs[k].image = malloc(v.chunksize);
+    if(!jobs[k].image) abort();
+  }
+  digester_start(&indigests, digests);
+  while(done < total) {
+    for(n = 0; (n < batch) && (done < total); n++) {
+      struct chunkjob *j = jobs + n;
+      j->len = ecm2_image(&v, v.written + (off_t)n);
+      if(fread(j->image, 1, j->len, in) != j->len) {
+        fprintf(stderr, "Unexpected EOF!\n");
+        goto fail;
+      }
+      digester_update(&indigests, j->image, j->len);
+      done += j->len;
+      setcounter_analyze(done);
+    }
+    if(ecm2_run(encode_job, jobs, n, threads)) {
+      fprintf(stderr, "Out of memory\n");
+      goto fail;
+    }
+    for(k = 0; k < n; k++) {
+      tally_chunk(jobs[k].out, jobs[k].outlen, typetally);
+      if(ecm2_put(&v, out, jobs[k].out, jobs[k].outlen)) {
+        perror("write");
+        goto fail;
+      }
+      free(jobs[k].out);
+      jobs[k].out = NULL;
+      encoded += jobs[k].len;
+      setcounter_encode(encoded);
+    }
+  }
+  if(ecm2_finish(&v, out)) {
+    perror("write");
+    goto fail;
+  }
+  ret = 0;
+fail:
+  digester_finish(&indigests);
+  for(k = 0; k < batch; k++) {
+    free(jobs[k].image);
+    free(jobs[k].out);
+  }
+  free(jobs);
+  if(!ret) {
+    char strbuff1[64];
+    char strbuff2[64];
+#ifdef ORIGINAL_MODE
+    fprintf(stderr, "Literal bytes........... %10d\n", typetally[0]);
+    fprintf(stderr, "Mode 1 sectors.......... %10d\n", typetally[1]);
+    fprintf(stderr, "Mode 2 form 1 sectors... %10d\n", typetally[2]);
+    fprintf(stderr, "Mode 2 form 2 sectors... %10d\n", typetally[3]);
+    fprintf(stderr, "Chunks.................. %10d\n", v.count);
+#else
+    fprintf(stderr, "Literal bytes........... %10lld\n", (long long)typetally[0]);
+    fprintf(stderr, "Mode 1 sectors.......... %10lld\n", (long long)typetally[1]);
+    fprintf(stderr, "Mode 2 form 1 sectors... %10lld\n", (long long)typetally[2]);
+    fprintf(stderr, "Mode 2 form 2 sectors... %10lld\n", (long long)typetally[3]);
+    fprintf(stderr, "Chunks.................. %10lld\n", (long long)v.count);
+#endif
+    fprintf(stderr, "Encoded %s -> %s\n", GetByteSize(total, strbuff1), GetByteSize(v.pos, strbuff2));
+    if(v.pos <= total)
+      fprintf(stderr, "Stripped file is %s smaller (%d%%)\n", GetByteSize(total - v.pos, strbuff1), (int)(100 * (total - v.pos) / total));
+    digests_print(&indigests.d, stderr, 1);
+    if(digestfile) digests_print(&indigests.d, digestfile, 0);
+    fprintf(stderr, "Done.\n");
+  }
+  ecm2_free(&v);
+  return ret;
+}
+
+/*
+** Rewrite the v1 ECM file "in" as a v2 file in chunks of "sectors" sectors,
+** straight from its records (see ecm2_transcode_chunk), a batch of chunks
+** on every CPU at once.  Only the record headers are read to find where
+** the chunks start, nothing is analyzed again, and the EDC of the whole
+** image, from those of the chunks, is checked against the v1 file's.
+*/
+struct transcodejob {
+  off_t k;
+  off_t base;
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  unsigned char *out;
+  size_t outlen;
+};
+
+struct transcodebatch {
+  const struct ecmidx *x;
+  const struct ecm2 *v;
+  struct transcodejob *job;
+};
+
+static int transcode_job(void *arg, size_t k) {
+  struct transcodebatch *b = arg;
+  struct transcodejob *j = b->job + k;
+  return ecm2_transcode_chunk(b->x, b->v, j->k, j->data, j->base, j->len, &j->out, &j->outlen);
+}
+
+int transcode(FILE *in, FILE *out, unsigned sectors) {
+  struct ecmidx x;
+  struct ecm2 v;
+  struct transcodebatch b;
+  unsigned threads = ecm2_threads();
+  size_t batch = (size_t)threads * 4;
+  ecc_uint32 edc = 0;
+  ecc_uint32 v1edc;
+  off_t k;
+  size_t n, j;
+  int ret = 1;
+  if(ecmidx_build(&x, in, sectors)) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  v1edc = x.edc[0] | (x.edc[1] << 8) | (x.edc[2] << 16) | ((ecc_uint32)x.edc[3] << 24);
+  resetcounter(x.imagesize);
+  if(ecm2_start(&v, out, x.imagesize, sectors)) {
+    perror("write");
+    ecm2_free(&v);
+    ecmidx_free(&x);
+    return 1;
+  }
+  b.x = &x;
+  b.v = &v;
+  b.job = calloc(batch, sizeof(*b.job));
+  if(!b.job) abort();
+  for(k = 0; k < v.count; k += (off_t)n) {
+    n = (v.count - k < (off_t)batch) ? (size_t)(v.count - k) : batch;
+    for(j = 0; j < n; j++) {
+      struct transcodejob *t = b.job + j;
+      off_t last;
+      t->k = k + (off_t)j;
+      t->base = x.entry[t->k].file;
+      /* Up to the end of the unit the next chunk starts in */
+      last = x.ecmsize - 4;
+      if(t->k + 1 < x.count) {
+        const struct ecmpos *e = x.entry + t->k + 1;
+        if(e->file + (off_t)ecm_unit_file[e->type] < last) last = e->file + ecm_unit_file[e->type];
+      }
+      t->len = (size_t)(last - t->base);
+      if(t->size < t->len) {
+        free(t->data);
+        t->data = malloc(t->len);
+        t->size = t->data ? t->len : 0;
+        if(!t->data) {
+          fprintf(stderr, "Out of memory\n");
+          goto fail;
+        }
+      }
+      if(fseeko(in, t->base, SEEK_SET) || (fread(t->data, 1, t->len, in) != t->len)) {
+        fprintf(stderr, "Unexpected EOF!\n");
+        goto fail;
+      }
+    }
+    setcounter_analyze((k + (off_t)n - 1) * v.chunksize + (off_t)ecm2_image(&v, k + (off_t)n - 1));
+    if(ecm2_run(transcode_job, &b, n, threads)) {
+      fprintf(stderr, "Corrupt ECM file!\n");
+      goto fail;
+    }
+    for(j = 0; j < n; j++) {
+      struct transcodejob *t = b.job + j;
+      off_t len = (off_t)ecm2_image(&v, t->k);
+      if(ecm2_put(&v, out, t->out, t->outlen)) {
+        perror("write");
+        goto fail;
+      }
+      edc = ecm2_edc_join(edc, v.chunk[t->k].edc, len);
+      free(t->out);
+      t->out = NULL;
+      setcounter_encode(t->k * v.chunksize + len);
+    }
+  }
+  if(edc != v1edc) {
+    fprintf(stderr, "EDC error (%08X, should be %08X)\n", edc, v1edc);
+    fprintf(stderr, "Corrupt ECM file!\n");
+    goto fail;
+  }
+  if(ecm2_finish(&v, out)) {
+    perror("write");
+    goto fail;
+  }
+  ret = 0;
+fail:
+  for(j = 0; j < batch; j++) {
+    free(b.job[j].data);
+    free(b.job[j].out);
+  }
+  free(b.job);
+  if(!ret) {
+    char strbuff1[64];
+    char strbuff2[64];
+#ifdef ORIGINAL_MODE
+    fprintf(stderr, "Chunks.................. %10d\n", v.count);
+#else
+    fprintf(stderr, "Chunks.................. %10lld\n", (long long)v.count);
+#endif
+    fprintf(stderr, "Transcoded %s -> %s\n", GetByteSize(x.ecmsize, strbuff1), GetByteSize(v.pos, strbuff2));
+    fprintf(stderr, "Done; EDC of the image is OK\n");
+  }
+  ecm2_free(&v);
+  ecmidx_free(&x);
+  return ret;
+}
+
+/***************************************************************************/
+
+/*
+** Parse a size such as 8388608, 8192k or 8m.  Returns -1 if it isn't one,
+** or doesn't fit in an off_t.
+*/
+static off_t parse_size(const char *str) {
+  unsigned long long most = ((unsigned long long)1 << (8 * sizeof(off_t) - 1)) - 1;
+  unsigned long long n;
+  int shift = 0;
+  char *end;
+  errno = 0;
+  n = strtoull(str, &end, 10);
+  switch(*end) {
+  case 'g': case 'G': shift += 10;
+    /* fall through */
+  case 'm': case 'M': shift += 10;
+    /* fall through */
+  case 'k': case 'K': shift += 10; end++;
+  }
+  if(*end || end == str || (errno == ERANGE) || (n > (most >> shift))) return -1;
+  return (off_t)(n << shift);
+}
+
+/*
+** The cue sheet for the image in "ecmname" (image.bin.cue for image.bin.ecm),
+** allocated with malloc()
+*/
+static char *merged_cue_name(const char *ecmname) {
+  size_t len = strlen(ecmname);
+  char *name;
+  if((len > 4) && !strcasecmp(ecmname + len - 4, ".ecm")) len -= 4;
+  name = malloc(len + 5);
+  if(!name) abort();
+  memcpy(name, ecmname, len);
+  strcpy(name + len, ".cue");
+  return name;
+}
+
+/*
+** Whether "a" and "b" name the same file, by another path or a link.  A "b"
+** that doesn't exist yet isn't "a".
+*/
+static int same_file(const char *a, const char *b) {
+#ifdef USE_MMAP
+  struct stat sa, sb;
+  if(stat(b, &sb)) {
+    if(errno == ENOENT) return 0;
+  } else if(!stat(a, &sa)) {
+    return (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+  }
+#endif
+  return !strcmp(a, b);
+}
+
+/*
+** After encoding the files of a cue sheet, write a cue sheet for the image
+** they make together (see merged_cue_name, describing image.bin), so the
+** tracks can be told apart again after decoding
+*/
+static int write_merged_cue(struct cuesheet *c, const off_t *starts, const char *ecmname) {
+  char *name = merged_cue_name(ecmname);
+  size_t len = strlen(name) - 4;
+  const char *base;
+  FILE *f;
+  name[len] = 0;
+  for(base = name + len; (base > name) && (base[-1] != '/') && (base[-1] != '\\'); base--);
+  if(cue_merge(c, starts, base)) {
+    fprintf(stderr, "Not all files are whole sectors; no cue sheet for the image\n");
+    free(name);
+    return 0;
+  }
+  strcpy(name + len, ".cue");
+  f = fopen(name, "wb");
+  if(!f) {
+    perror(name);
+    free(name);
+    return 1;
+  }
+  cue_write(c, f);
+  if(fclose(f)) {
+    perror(name);
+    free(name);
+    return 1;
+  }
+  fprintf(stderr, "Cue sheet............... %s\n", name);
+  free(name);
+  return 0;
+}
+
+/*
+** Index the ECM file just written (image.bin.ecmidx for image.bin.ecm), so
+** UNECM can go straight to any sector of it
+*/
+static int write_index(const char *ecmname, unsigned step) {
+  struct ecmidx x;
+  FILE *f = fopen(ecmname, "rb");
+  char *path;
+  int r;
+  if(!f) {
+    perror(ecmname);
+    return 1;
+  }
+  r = ecmidx_save(&x, f, ecmname, step);
+  fclose(f);
+  if(r) return 1;
+  path = ecmidx_path(ecmname);
+  fprintf(stderr, "Index................... %s\n", path);
+  free(path);
+  ecmidx_free(&x);
+  return 0;
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options] cdimagefile [ecmfile]\n"
+    "       Use - for standard input/output.  When reading standard input,\n"
+    "       ecmfile defaults to standard output.  A cdimagefile ending in\n"
+    "       .cue is a cue sheet, whose files are encoded as one image.\n"
+    "\n"
+    "options:\n"
+    "  --window size   Size of the analysis window (default 5m)\n"
+    "  --index         Also write an index of ecmfile for random access\n"
+    "                  (image.bin.ecmidx for image.bin.ecm)\n"
+    "  --index-step n  Index every n sectors (default 16)\n"
+    "  --v2            Write an ECM v2 file: the image in chunks that decode and\n"
+    "                  check on their own, encoded on every CPU at once, with\n"
+    "                  the index built in; the input can't be a pipe\n"
+    "  --chunk n       Put n sectors in each chunk of a v2 file (default %d)\n"
+    "  --transcode     cdimagefile is a v1 ECM file: rewrite it as the v2 file\n"
+    "                  ecmfile, straight from its records\n"
+    "  --digest list   Compute digests of the input: any of crc32, md5, sha1\n"
+    "                  and sha256, separated by commas, or all\n"
+    "  --digest-file file\n"
+    "                  Also write the digests to file (- for standard output)\n"
+    "                  as \"name hex\" lines; implies --digest all by default\n"
+#ifdef HAVE_IO_URING
+    "  --uring         Use io_uring for file input and output\n"
+#endif
+#ifdef __linux__
+    "  --direct        Bypass the page cache (O_DIRECT)\n"
+    "  --nocache       Drop input and output from the page cache behind us\n"
+#endif
+    , name, ECM2_CHUNK
+  );
+}
 
 int main(int argc, char **argv) {
   FILE *fin, *fout;
-  char *infilename;
-  char *outfilename;
+  char *infilename = NULL;
+  char *outfilename = NULL;
+  char *digestfilename = NULL;
+  FILE *fdigest = NULL;
+  int fromcue = 0;
+  struct cuesheet cue;
+  off_t cuestarts[CUE_MAXTRACKS + 1];
+  off_t windowsize = DEFAULT_WINDOW;
+  int digests = 0;
+  int index = 0;
+  unsigned indexstep = ECMIDX_STEP;
+  int v2 = 0;
+  int transcoding = 0;
+  unsigned chunk = ECM2_CHUNK;
+  int ioflags = 0;
+  int ret;
+  int i;
   banner();
   /*
   ** Initialize the ECC/EDC tables
   */
-  eccedc_init();
+  ecm_init();
   /*
   ** Check command line
   */
-  if((argc != 2) && (argc != 3)) {
-    fprintf(stderr, "usage: %s cdimagefile [ecmfile]\n", argv[0]);
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--window") && (i + 1 < argc)) {
+      windowsize = parse_size(argv[++i]);
+      if(windowsize < 2 * 2352 || (off_t)(size_t)windowsize != windowsize) {
+        fprintf(stderr, "invalid window size '%s'\n", argv[i]);
+        return 1;
+      }
+    } else if(!strcmp(argv[i], "--index")) {
+      index = 1;
+    } else if(!strcmp(argv[i], "--index-step") && (i + 1 < argc)) {
+      char *end;
+      unsigned long n = strtoul(argv[++i], &end, 10);
+      if(*end || !n || (n > 0xFFFFFFFFUL)) {
+        fprintf(stderr, "bad index step '%s'\n", argv[i]);
+        return 1;
+      }
+      indexstep = (unsigned)n;
+    } else if(!strcmp(argv[i], "--v2")) {
+      v2 = 1;
+    } else if(!strcmp(argv[i], "--transcode")) {
+      transcoding = 1;
+    } else if(!strcmp(argv[i], "--chunk") && (i + 1 < argc)) {
+      char *end;
+      unsigned long n = strtoul(argv[++i], &end, 10);
+      if(*end || !n || (n > 0xFFFFFFFFUL / 2352)) {
+        fprintf(stderr, "bad chunk size '%s'\n", argv[i]);
+        return 1;
+      }
+      chunk = (unsigned)n;
+    } else if(!strcmp(argv[i], "--digest") && (i + 1 < argc)) {
+      digests = digests_parse(argv[++i]);
+      if(digests < 0) {
+        fprintf(stderr, "unknown digest in '%s'\n", argv[i]);
+        return 1;
+      }
+    } else if(!strcmp(argv[i], "--digest-file") && (i + 1 < argc)) {
+      digestfilename = argv[++i];
+#ifdef HAVE_IO_URING
+    } else if(!strcmp(argv[i], "--uring")) {
+      ioflags |= ECMIO_URING;
+#endif
+#ifdef __linux__
+    } else if(!strcmp(argv[i], "--direct")) {
+      ioflags |= ECMIO_DIRECT;
+    } else if(!strcmp(argv[i], "--nocache")) {
+      ioflags |= ECMIO_NOCACHE;
+#endif
+    } else if(argv[i][0] == '-' && argv[i][1]) {
+      usage(argv[0]);
+      return 1;
+    } else if(!infilename) {
+      infilename = argv[i];
+    } else if(!outfilename) {
+      outfilename = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(!infilename) {
+    usage(argv[0]);
+    return 1;
+  }
+  if(digestfilename && !digests) digests = DIGEST_ALL;
+  if(transcoding) {
+    if(index || digests || ioflags) {
+      fprintf(stderr, "--transcode can't be used with --index, --digest or I/O options\n");
+      return 1;
+    }
+    if(!outfilename || !strcmp(infilename, "-")) {
+      fprintf(stderr, "--transcode needs an ECM file, not a pipe, and the v2 file to write\n");
+      return 1;
+    }
+    v2 = 1;
+  }
+  if(v2 && index) {
+    fprintf(stderr, "--index isn't needed with --v2; the index is in the file\n");
+    return 1;
+  }
+  if(v2 && ioflags) {
+    fprintf(stderr, "--v2 can't be used with --uring, --direct or --nocache\n");
     return 1;
   }
-  infilename = argv[1];
+  if(
+    !transcoding &&
+    (strlen(infilename) > 4) &&
+    !strcasecmp(infilename + strlen(infilename) - 4, ".cue")
+  ) {
+    if(cue_read(&cue, infilename)) return 1;
+    for(i = 0; i < cue.ntracks; i++) {
+      if(cue.track[i].sectorsize != 2352) {
+        fprintf(stderr, "%s: track %02d isn't raw 2352-byte sectors\n",
+          infilename, cue.track[i].number);
+        return 1;
+      }
+    }
+    fromcue = 1;
+  }
   /*
   ** Figure out what the output filename should be
   */
-  if(argc == 3) {
-    outfilename = argv[2];
-  } else {
-    outfilename = malloc(strlen(infilename) + 5);
-    if(!outfilename) abort();
-    sprintf(outfilename, "%s.ecm", infilename);
+  if(!outfilename) {
+    if(!strcmp(infilename, "-")) {
+      outfilename = "-";
+    } else if(fromcue) {
+      /* image.cue -> image.bin.ecm */
+      outfilename = malloc(strlen(infilename) + 5);
+      if(!outfilename) abort();
+      memcpy(outfilename, infilename, strlen(infilename) - 4);
+      strcpy(outfilename + strlen(infilename) - 4, ".bin.ecm");
+    } else {
+      outfilename = malloc(strlen(infilename) + 5);
+      if(!outfilename) abort();
+      sprintf(outfilename, "%s.ecm", infilename);
+    }
   }
-  fprintf(stderr, "Encoding %s to %s.\n", infilename, outfilename);
+  if(fromcue && strcmp(outfilename, "-")) {
+    char *cuename = merged_cue_name(outfilename);
+    if(same_file(infilename, cuename)) {
+      fprintf(stderr, "the cue sheet to write would replace %s\n", infilename);
+      free(cuename);
+      cue_free(&cue);
+      return 1;
+    }
+    free(cuename);
+  }
+  fprintf(stderr, transcoding ? "Transcoding %s to %s.\n" : "Encoding %s to %s.\n",
+    strcmp(infilename, "-") ? infilename : "(stdin)",
+    strcmp(outfilename, "-") ? outfilename : "(stdout)"
+  );
   /*
   ** Open both files
   */
-  fin = fopen(infilename, "rb");
-  if(!fin) {
-    perror(infilename);
-    return 1;
+  if(!strcmp(infilename, "-")) {
+    fin = stdin;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  } else if(fromcue) {
+    fin = cue_open(&cue, infilename, cuestarts);
+    if(!fin) return 1;
+  } else {
+    fin = fopen(infilename, "rb");
+    if(!fin) {
+      perror(infilename);
+      return 1;
+    }
   }
-  fout = fopen(outfilename, "wb");
-  if(!fout) {
-    perror(outfilename);
-    fclose(fin);
-    return 1;
+  if(!strcmp(outfilename, "-")) {
+    fout = stdout;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  } else {
+    fout = fopen(outfilename, "wb");
+    if(!fout) {
+      perror(outfilename);
+      fclose(fin);
+      return 1;
+    }
+  }
+  if(digestfilename) {
+    if(!strcmp(digestfilename, "-")) {
+      if(fout == stdout) {
+        fprintf(stderr, "standard output is already the output file\n");
+        fclose(fin);
+        return 1;
+      }
+      fdigest = stdout;
+    } else {
+      fdigest = fopen(digestfilename, "w");
+      if(!fdigest) {
+        perror(digestfilename);
+        fclose(fout);
+        fclose(fin);
+        return 1;
+      }
+    }
   }
   /*
   ** Encode
   */
-  ecmify(fin, fout);
+  if(transcoding) {
+    ret = transcode(fin, fout, chunk);
+  } else if(v2) {
+    ret = ecmify2(fin, fout, chunk, digests, fdigest);
+  } else {
+    if(queue_init((size_t)windowsize)) return 1;
+    ret = ecmify(fin, fout, digests, fdigest, ioflags);
+    queue_free();
+  }
+  if(fromcue && !ret && strcmp(outfilename, "-")) {
+    ret = write_merged_cue(&cue, cuestarts, outfilename);
+  }
+  if(fromcue) cue_free(&cue);
+  if(index && !ret) {
+    if(!strcmp(outfilename, "-")) {
+      fprintf(stderr, "Not indexing standard output\n");
+    } else {
+      fflush(fout);
+      ret = write_index(outfilename, indexstep);
+    }
+  }
   /*
   ** Close everything
   */
+  if(fdigest && (fdigest != stdout)) fclose(fdigest);
   fclose(fout);
   fclose(fin);
-  return 0;
+  return ret;
 }
@@ -0,0 +1,492 @@
+/***************************************************************************/
+/*
+** ECM2 - Chunked ECM files with an index of their own
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "ecm2.h"
+
+/***************************************************************************/
+
+static const unsigned char ecm2_magic[4] = { 'E', 'C', 'M', '2' };
+
+static void put32(unsigned char *b, uint32_t v) {
+  int i;
+  for(i = 0; i < 4; i++) b[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get32(const unsigned char *b) {
+  return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void put64(unsigned char *b, uint64_t v) {
+  put32(b, (uint32_t)v);
+  put32(b + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get64(const unsigned char *b) {
+  return get32(b) | ((uint64_t)get32(b + 4) << 32);
+}
+
+/***************************************************************************/
+
+int ecm2_probe(FILE *f) {
+  unsigned char b[4];
+  int is = (fread(b, 1, 4, f) == 4) && !memcmp(b, ecm2_magic, 4);
+  fseeko(f, 0, SEEK_SET);
+  return is;
+}
+
+int ecm2_load(struct ecm2 *v, FILE *f) {
+  unsigned char b[ECM2_HEADERSIZE];
+  unsigned char *index = NULL;
+  off_t total, at, span, k;
+  size_t size;
+  memset(v, 0, sizeof(*v));
+  if(
+    fseeko(f, 0, SEEK_SET) ||
+    (fread(b, 1, ECM2_HEADERSIZE, f) != ECM2_HEADERSIZE) ||
+    memcmp(b, ecm2_magic, 4) || (get32(b + 4) != 1)
+  ) return 1;
+  v->chunksize = get32(b + 8);
+  v->imagesize = (off_t)get64(b + 16);
+  if(!v->chunksize || (v->chunksize % 2352) || (v->imagesize < 0)) return 1;
+  span = v->chunksize;
+  v->count = (v->imagesize + span - 1) / span;
+  /* The footer says where the index is, which must fit in front of it */
+  if(fseeko(f, 0, SEEK_END) || ((total = ftello(f)) < ECM2_HEADERSIZE + ECM2_FOOTERSIZE)) return 1;
+  if(
+    fseeko(f, total - ECM2_FOOTERSIZE, SEEK_SET) ||
+    (fread(b, 1, ECM2_FOOTERSIZE, f) != ECM2_FOOTERSIZE) ||
+    memcmp(b + 12, ecm2_magic, 4)
+  ) return 1;
+  at = (off_t)get64(b);
+  if(
+    (at < ECM2_HEADERSIZE) || (v->count > (total - ECM2_FOOTERSIZE) / ECM2_ENTRYSIZE) ||
+    (at + v->count * ECM2_ENTRYSIZE != total - ECM2_FOOTERSIZE)
+  ) return 1;
+  size = (size_t)v->count * ECM2_ENTRYSIZE;
+  index = malloc(size ? size : 1);
+  v->chunk = malloc((size_t)(v->count ? v->count : 1) * sizeof(*v->chunk));
+  if(!index || !v->chunk) goto fail;
+  if(
+    fseeko(f, at, SEEK_SET) ||
+    (fread(index, 1, size, f) != size) ||
+    (ecm_edc(0, index, size) != get32(b + 8))
+  ) goto fail;
+  for(k = 0; k < v->count; k++) {
+    struct ecm2_chunk *c = v->chunk + k;
+    const unsigned char *e = index + k * ECM2_ENTRYSIZE;
+    c->file = (off_t)get64(e);
+    c->len = get32(e + 8);
+    c->edc = get32(e + 12);
+    /* The chunks are in order, between the header and the index */
+    if(
+      (c->file < (k ? v->chunk[k - 1].file + v->chunk[k - 1].len : ECM2_HEADERSIZE)) ||
+      (c->len < 5) || (c->file + c->len > at)
+    ) goto fail;
+  }
+  free(index);
+  v->written = v->count;
+  return 0;
+fail:
+  free(index);
+  ecm2_free(v);
+  return 1;
+}
+
+void ecm2_free(struct ecm2 *v) {
+  free(v->chunk);
+  v->chunk = NULL;
+  v->count = 0;
+}
+
+size_t ecm2_image(const struct ecm2 *v, off_t k) {
+  off_t left = v->imagesize - k * v->chunksize;
+  return (left < (off_t)v->chunksize) ? (size_t)left : v->chunksize;
+}
+
+/***************************************************************************/
+
+int ecm2_encode_chunk(const unsigned char *image, size_t len, unsigned char **out, size_t *outlen) {
+  if(ecm_encode_buffer(image, len, out, outlen)) return 1;
+  /* Everything but the "ECM\0" */
+  *outlen -= 4;
+  memmove(*out, *out + 4, *outlen);
+  return 0;
+}
+
+int ecm2_decode_chunk(const struct ecm2 *v, off_t k, const unsigned char *data, unsigned char *image) {
+  const struct ecm2_chunk *c = v->chunk + k;
+  struct ecm_decoder d;
+  const unsigned char *in = ecm_magic;
+  size_t inlen = 4;
+  unsigned char *out = image;
+  size_t outlen = ecm2_image(v, k);
+  if(get32(data + c->len - 4) != c->edc) return 1;
+  ecm_decoder_init(&d);
+  if(ecm_decode(&d, &in, &inlen, &out, &outlen) != ECM_OK) return 1;
+  in = data;
+  inlen = c->len;
+  /* All of it has to decode to exactly the chunk, with the EDC matching */
+  return (ecm_decode(&d, &in, &inlen, &out, &outlen) != ECM_END) || inlen || outlen;
+}
+
+/***************************************************************************/
+/*
+** Records going into a chunk.  Literal bytes are held back until something
+** else comes along, so that literal records next to each other, and the
+** parts of sectors cut by the edges, go in one record.
+*/
+struct records {
+  unsigned char *buf;
+  size_t len;
+  size_t size;
+  unsigned char *lit;
+  size_t litlen;
+  uint32_t edc;
+};
+
+static int records_room(struct records *w, size_t n) {
+  size_t size = w->size ? w->size : 65536;
+  unsigned char *grown;
+  if(w->len + n <= w->size) return 0;
+  while(size < w->len + n) size *= 2;
+  grown = realloc(w->buf, size);
+  if(!grown) return 1;
+  w->buf = grown;
+  w->size = size;
+  return 0;
+}
+
+/* A record header, for "num" + 1 units (or the end marker) */
+static int records_header(struct records *w, int type, uint64_t num) {
+  if(records_room(w, 10)) return 1;
+  w->buf[w->len++] = (unsigned char)(((num >= 32) << 7) | ((num & 31) << 2) | type);
+  num >>= 5;
+  while(num) {
+    w->buf[w->len++] = (unsigned char)(((num >= 128) << 7) | (num & 127));
+    num >>= 7;
+  }
+  return 0;
+}
+
+static int records_flush(struct records *w) {
+  if(!w->litlen) return 0;
+  if(records_header(w, 0, w->litlen - 1) || records_room(w, w->litlen)) return 1;
+  memcpy(w->buf + w->len, w->lit, w->litlen);
+  w->len += w->litlen;
+  w->litlen = 0;
+  return 0;
+}
+
+static void records_literal(struct records *w, const unsigned char *data, size_t n) {
+  memcpy(w->lit + w->litlen, data, n);
+  w->litlen += n;
+  w->edc = ecm_edc(w->edc, data, n);
+}
+
+/*
+** The image of the sector unit at "payload", put together in "sector"
+*/
+static const unsigned char *unit_image(unsigned char *sector, const unsigned char *payload, int type) {
+  if(type == 1) {
+    memcpy(sector + 0x00C, payload, 0x003);
+    memcpy(sector + 0x010, payload + 0x003, 0x800);
+    ecm_sector_rebuild(sector, 1);
+    return sector;
+  }
+  memcpy(sector + 0x014, payload, ecm_unit_file[type]);
+  ecm_sector_rebuild(sector, type);
+  return sector + 0x10;
+}
+
+int ecm2_transcode_chunk(
+  const struct ecmidx *x,
+  const struct ecm2 *v,
+  off_t k,
+  const unsigned char *data,
+  off_t base,
+  size_t len,
+  unsigned char **out,
+  size_t *outlen
+) {
+  struct records w;
+  struct ecmpos p = x->entry[k];
+  unsigned char sector[2352];
+  off_t start = k * v->chunksize;
+  off_t end = start + (off_t)ecm2_image(v, k);
+  size_t at = (size_t)(p.file - base);
+  memset(&w, 0, sizeof(w));
+  w.lit = malloc(v->chunksize);
+  if(!w.lit) return 1;
+  while(p.image < end) {
+    size_t usz, fsz;
+    off_t n;
+    if(!p.left) {
+      unsigned bits = 5;
+      off_t num;
+      int c;
+      if(at >= len) goto fail;
+      c = data[at++];
+      p.type = c & 3;
+      num = (c >> 2) & 0x1F;
+      while(c & 0x80) {
+        if((at >= len) || (bits > 56)) goto fail;
+        c = data[at++];
+        num |= ((off_t)(c & 0x7F)) << bits;
+        bits += 7;
+      }
+      /* The records can't end before the image does */
+      if(num == 0xFFFFFFFF) goto fail;
+      p.left = num + 1;
+    }
+    usz = ecm_unit_image[p.type];
+    fsz = ecm_unit_file[p.type];
+    if(!p.type) {
+      n = end - p.image;
+      if(n > p.left) n = p.left;
+      if(at + (size_t)n > len) goto fail;
+      records_literal(&w, data + at, (size_t)n);
+    } else if((p.image < start) || (p.image + (off_t)usz > end)) {
+      off_t from = (p.image < start) ? start : p.image;
+      off_t to = (p.image + (off_t)usz > end) ? end : p.image + (off_t)usz;
+      if(at + fsz > len) goto fail;
+      records_literal(&w, unit_image(sector, data + at, p.type) + (from - p.image), (size_t)(to - from));
+      n = 1;
+    } else {
+      off_t u;
+      n = (end - p.image) / (off_t)usz;
+      if(n > p.left) n = p.left;
+      if(
+        (at + (size_t)n * fsz > len) ||
+        records_flush(&w) ||
+        records_header(&w, p.type, (uint64_t)(n - 1)) ||
+        records_room(&w, (size_t)n * fsz)
+      ) goto fail;
+      memcpy(w.buf + w.len, data + at, (size_t)n * fsz);
+      w.len += (size_t)n * fsz;
+      for(u = 0; u < n; u++) {
+        w.edc = ecm_edc(w.edc, unit_image(sector, data + at + (size_t)u * fsz, p.type), usz);
+      }
+    }
+    at += (size_t)n * fsz;
+    p.left -= n;
+    p.image += n * (off_t)usz;
+  }
+  if(records_flush(&w) || records_header(&w, 0, 0xFFFFFFFF) || records_room(&w, 4)) goto fail;
+  put32(w.buf + w.len, w.edc);
+  w.len += 4;
+  free(w.lit);
+  *out = w.buf;
+  *outlen = w.len;
+  return 0;
+fail:
+  free(w.lit);
+  free(w.buf);
+  return 1;
+}
+
+uint32_t ecm2_edc_join(uint32_t first, uint32_t second, off_t len) {
+  static const unsigned char zeros[2336];
+  first = ecm_edc_zero_sectors(first, (uint64_t)(len / 2336));
+  return ecm_edc(first, zeros, (size_t)(len % 2336)) ^ second;
+}
+
+/***************************************************************************/
+
+int ecm2_start(struct ecm2 *v, FILE *out, off_t imagesize, unsigned sectors) {
+  unsigned char b[ECM2_HEADERSIZE];
+  memset(v, 0, sizeof(*v));
+  if(!sectors || (sectors > 0xFFFFFFFFUL / 2352) || (imagesize < 0)) return 1;
+  v->chunksize = (uint32_t)sectors * 2352;
+  v->imagesize = imagesize;
+  v->count = (imagesize + v->chunksize - 1) / v->chunksize;
+  v->chunk = malloc((size_t)(v->count ? v->count : 1) * sizeof(*v->chunk));
+  if(!v->chunk) return 1;
+  memcpy(b, ecm2_magic, 4);
+  put32(b + 4, 1);
+  put32(b + 8, v->chunksize);
+  put32(b + 12, 0);
+  put64(b + 16, (uint64_t)imagesize);
+  v->pos = ECM2_HEADERSIZE;
+  return fwrite(b, 1, ECM2_HEADERSIZE, out) != ECM2_HEADERSIZE;
+}
+
+int ecm2_put(struct ecm2 *v, FILE *out, const unsigned char *chunk, size_t len) {
+  struct ecm2_chunk *c;
+  if((v->written == v->count) || (len < 5) || (len > 0xFFFFFFFFUL)) return 1;
+  c = v->chunk + v->written++;
+  c->file = v->pos;
+  c->len = (uint32_t)len;
+  c->edc = get32(chunk + len - 4);
+  v->pos += len;
+  return fwrite(chunk, 1, len, out) != len;
+}
+
+int ecm2_finish(struct ecm2 *v, FILE *out) {
+  unsigned char b[ECM2_ENTRYSIZE];
+  uint32_t edc = 0;
+  off_t k;
+  if(v->written != v->count) return 1;
+  for(k = 0; k < v->count; k++) {
+    const struct ecm2_chunk *c = v->chunk + k;
+    put64(b, (uint64_t)c->file);
+    put32(b + 8, c->len);
+    put32(b + 12, c->edc);
+    edc = ecm_edc(edc, b, ECM2_ENTRYSIZE);
+    fwrite(b, 1, ECM2_ENTRYSIZE, out);
+  }
+  put64(b, (uint64_t)v->pos);
+  put32(b + 8, edc);
+  memcpy(b + 12, ecm2_magic, 4);
+  fwrite(b, 1, ECM2_FOOTERSIZE, out);
+  v->pos += v->count * ECM2_ENTRYSIZE + ECM2_FOOTERSIZE;
+  return fflush(out) || ferror(out);
+}
+
+/***************************************************************************/
+/*
+** Jobs on threads
+*/
+struct run {
+  int (*job)(void *arg, size_t k);
+  void *arg;
+  size_t n;
+  size_t next;
+  int failed;
+#if defined(_WIN32)
+  CRITICAL_SECTION lock;
+#elif defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_t lock;
+#endif
+};
+
+#if defined(_WIN32)
+#define run_take(w)    EnterCriticalSection(&(w)->lock)
+#define run_release(w) LeaveCriticalSection(&(w)->lock)
+#elif defined(__unix__) || defined(__APPLE__)
+#define run_take(w)    pthread_mutex_lock(&(w)->lock)
+#define run_release(w) pthread_mutex_unlock(&(w)->lock)
+#else
+#define run_take(w)    ((void)(w))
+#define run_release(w) ((void)(w))
+#endif
+
+static void run_jobs(struct run *w) {
+  for(;;) {
+    size_t k;
+    int failed;
+    run_take(w);
+    k = w->next++;
+    run_release(w);
+    if(k >= w->n) break;
+    failed = w->job(w->arg, k);
+    if(failed) {
+      run_take(w);
+      w->failed = 1;
+      run_release(w);
+    }
+  }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI run_thread(LPVOID arg) {
+  run_jobs(arg);
+  return 0;
+}
+#elif defined(__unix__) || defined(__APPLE__)
+static void *run_thread(void *arg) {
+  run_jobs(arg);
+  return NULL;
+}
+#endif
+
+unsigned ecm2_threads(void) {
+  long n = 1;
+#if defined(_WIN32)
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  n = (long)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(n < 1) n = 1;
+  if(n > ECM2_MAXTHREADS) n = ECM2_MAXTHREADS;
+  return (unsigned)n;
+}
+
+int ecm2_run(int (*job)(void *arg, size_t k), void *arg, size_t n, unsigned threads) {
+  struct run w;
+  unsigned started = 0;
+#if defined(_WIN32)
+  HANDLE thread[ECM2_MAXTHREADS];
+#elif defined(__unix__) || defined(__APPLE__)
+  pthread_t thread[ECM2_MAXTHREADS];
+#endif
+  w.job = job;
+  w.arg = arg;
+  w.n = n;
+  w.next = 0;
+  w.failed = 0;
+  if(threads > n) threads = (unsigned)n;
+  if(threads > ECM2_MAXTHREADS) threads = ECM2_MAXTHREADS;
+#if defined(_WIN32)
+  InitializeCriticalSection(&w.lock);
+  /* If a thread won't start, the ones that did (and this one) do it all */
+  while(started + 1 < threads) {
+    thread[started] = CreateThread(NULL, 0, run_thread, &w, 0, NULL);
+    if(!thread[started]) break;
+    started++;
+  }
+  run_jobs(&w);
+  while(started--) {
+    WaitForSingleObject(thread[started], INFINITE);
+    CloseHandle(thread[started]);
+  }
+  DeleteCriticalSection(&w.lock);
+#elif defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_init(&w.lock, NULL);
+  while(started + 1 < threads) {
+    if(pthread_create(&thread[started], NULL, run_thread, &w)) break;
+    started++;
+  }
+  run_jobs(&w);
+  while(started--) pthread_join(thread[started], NULL);
+  pthread_mutex_destroy(&w.lock);
+#else
+  (void)started;
+  run_jobs(&w);
+#endif
+  return w.failed;
+}
+
+/***************************************************************************/
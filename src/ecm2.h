@@ -0,0 +1,142 @@
+/***************************************************************************/
+/*
+** ECM2 - Chunked ECM files with an index of their own
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __ECM2_H__
+#define __ECM2_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libecm.h"
+#include "ecmidx.h"
+
+/*
+** A v1 ECM file is one stream of records, with one EDC at the end, so it
+** has to be decoded from the start, by one thread, and checked as a whole.
+** A v2 file cuts the image into chunks of the same number of sectors (the
+** last one may be short), each encoded on its own as the records of that
+** part of the image, the end marker, and the EDC of that part: a v1 file
+** without the "ECM\0".  An index at the end says where every chunk is, so
+** any chunk can be decoded and checked without the others.
+**
+**    0  "ECM2"
+**    4  version (1), 32-bit
+**    8  image bytes per chunk (whole sectors), 32-bit
+**   12  reserved (0), 32-bit
+**   16  size of the image, 64-bit
+**   24  the chunks, one after another
+**       the index: for each chunk, where it is in the file (64-bit), how
+**       long it is (32-bit), and the EDC of its part of the image (32-bit)
+**       where the index is, 64-bit
+**       EDC of the index, 32-bit
+**       "ECM2"
+**
+** All numbers are little endian.
+*/
+#define ECM2_HEADERSIZE (24)
+#define ECM2_ENTRYSIZE  (16)
+#define ECM2_FOOTERSIZE (16)
+
+/* Default sectors per chunk, and the most threads worth starting */
+#define ECM2_CHUNK      (256)
+#define ECM2_MAXTHREADS (64)
+
+struct ecm2_chunk {
+  off_t file;
+  uint32_t len;
+  uint32_t edc;
+};
+
+struct ecm2 {
+  uint32_t chunksize;
+  off_t imagesize;
+  off_t count;
+  struct ecm2_chunk *chunk;
+  off_t written;
+  off_t pos;
+};
+
+/*
+** ecm2_probe() says whether "f" starts like a v2 file, and rewinds it.
+** ecm2_load() reads the header and the index, and checks they agree with
+** each other and with the size of the file.  Returns nonzero if they don't.
+** ecm2_image() is how much of the image chunk "k" holds.
+*/
+int ecm2_probe(FILE *f);
+int ecm2_load(struct ecm2 *v, FILE *f);
+void ecm2_free(struct ecm2 *v);
+size_t ecm2_image(const struct ecm2 *v, off_t k);
+
+/*
+** A chunk on its own.  ecm2_encode_chunk() encodes "len" bytes of image
+** into a chunk allocated with malloc(), which the caller frees.
+** ecm2_decode_chunk() decodes chunk "k", read from the file into "data",
+** to ecm2_image() bytes at "image", and checks it against its EDC and the
+** index.  Both return nonzero on error, and run on any thread.
+*/
+int ecm2_encode_chunk(const unsigned char *image, size_t len, unsigned char **out, size_t *outlen);
+int ecm2_decode_chunk(const struct ecm2 *v, off_t k, const unsigned char *data, unsigned char *image);
+
+/*
+** Chunk "k" straight from the records of a v1 file, without encoding the
+** image again: "x" is its index with an entry for every chunk (a step of
+** v->chunksize / 2352 sectors), and "data" holds the file from "base" on
+** for "len" bytes, up to the first unit of the next chunk or the end of
+** the records.  The records are copied, split at the edges of the chunk;
+** a sector cut by an edge goes in as the literal bytes of its part.  Only
+** the EDC of the chunk needs the sectors put together.  The chunk is
+** allocated with malloc(), and the caller frees it.  Returns nonzero if
+** the records aren't right.
+**
+** ecm2_edc_join() is the EDC of two pieces one after the other, from the
+** EDC of each and the length of the second, so the EDC of a whole image
+** comes from those of its chunks.
+*/
+int ecm2_transcode_chunk(
+  const struct ecmidx *x,
+  const struct ecm2 *v,
+  off_t k,
+  const unsigned char *data,
+  off_t base,
+  size_t len,
+  unsigned char **out,
+  size_t *outlen
+);
+uint32_t ecm2_edc_join(uint32_t first, uint32_t second, off_t len);
+
+/*
+** Writing a v2 file, which needs the size of the image up front: the
+** header with ecm2_start(), then every chunk in order with ecm2_put(), and
+** the index with ecm2_finish().  Each returns nonzero on error.
+*/
+int ecm2_start(struct ecm2 *v, FILE *out, off_t imagesize, unsigned sectors);
+int ecm2_put(struct ecm2 *v, FILE *out, const unsigned char *chunk, size_t len);
+int ecm2_finish(struct ecm2 *v, FILE *out);
+
+/*
+** Run job(arg, k) for every k below "n", on up to "threads" threads (the
+** caller's among them) taking the next k as they're free.  Returns nonzero
+** if any job did.  ecm2_threads() is how many CPUs there are to use.
+*/
+unsigned ecm2_threads(void);
+int ecm2_run(int (*job)(void *arg, size_t k), void *arg, size_t n, unsigned threads);
+
+#endif
@@ -0,0 +1,476 @@
+/***************************************************************************/
+/*
+** ECMFS - Mount a directory of ECM files as the images they hold
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** A read-only FUSE file system (libfuse 3) mirroring a directory, where
+** every foo.bin.ecm shows up as foo.bin, the size of the decoded image.
+** Reads go through the random-access reader (see ecmread.h), so only the
+** sectors asked for are reconstructed.  Requests are handled on several
+** threads at once, which the reader allows.  Listing a directory only
+** needs the size of each image, which comes from its index (see ecm_open)
+** and is remembered until the ECM file changes.  An image is only opened
+** for reading, with its own sector cache and prefetcher, while something
+** has it open, and the ECM file shouldn't change then.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "libecm.h"
+#include "ecmread.h"
+
+/***************************************************************************/
+
+void banner(void) {
+  fprintf(stderr,
+    "ECMFS - Mount ECM files as the images they hold\n"
+    "Copyright (C) 2002 Neill Corlett\n\n"
+  );
+}
+
+/***************************************************************************/
+
+/* Default sector cache per image, and how far to read ahead of streams */
+#define ECMFS_CACHE    (32)
+#define ECMFS_PREFETCH (256)
+
+struct image {
+  struct image *next;
+  char *path;
+  off_t ecmsize;
+  time_t mtime;
+  off_t size;
+  unsigned users;
+  struct ecm_reader *r;
+};
+
+static const char *ecmdir;
+static size_t cachesize = (size_t)ECMFS_CACHE * 1048576;
+static off_t prefetch = ECMFS_PREFETCH;
+
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct image *images;
+
+/*
+** Where "path" in the mount is in the directory, with "suffix" on the end
+*/
+static char *source(const char *path, const char *suffix) {
+  char *s = malloc(strlen(ecmdir) + strlen(path) + strlen(suffix) + 1);
+  if(!s) abort();
+  strcpy(s, ecmdir);
+  strcat(s, path);
+  strcat(s, suffix);
+  return s;
+}
+
+/*
+** What's known about the image at "path" in the mount, which starts out as
+** nothing.  Call with images_lock held.
+*/
+static struct image *image_lookup(const char *path) {
+  struct image *im;
+  for(im = images; im; im = im->next) {
+    if(!strcmp(im->path, path)) return im;
+  }
+  im = calloc(1, sizeof(*im));
+  if(!im) abort();
+  im->path = malloc(strlen(path) + 1);
+  if(!im->path) abort();
+  strcpy(im->path, path);
+  im->size = -1;
+  im->next = images;
+  images = im;
+  return im;
+}
+
+/*
+** Whether what's known about "im" is out of date for its ECM file "st".
+** Call with images_lock held.
+*/
+static int image_stale(const struct image *im, const struct stat *st) {
+  return (im->size < 0) || (im->ecmsize != st->st_size) || (im->mtime != st->st_mtime);
+}
+
+/*
+** Note that the image of "im" is "size" bytes, as read from the ECM file
+** "st", or -1 if that's corrupt.  Call with images_lock held.
+*/
+static void image_note(struct image *im, const struct stat *st, off_t size) {
+  im->size = size;
+  if(size < 0) return;
+  im->ecmsize = st->st_size;
+  im->mtime = st->st_mtime;
+}
+
+/*
+** The size of the image at "path", whose ECM file is "st".  Only the index
+** is read for it, once, and again if the ECM file has changed since (unless
+** the image is open).  Returns -1 if the ECM file is corrupt.
+**
+** Without a .ecmidx, reading the index is a scan of the whole file, so it's
+** done without images_lock, and the rest of the mount carries on meanwhile.
+*/
+static off_t image_size(const char *path, const struct stat *st) {
+  struct image *im;
+  struct ecm_reader r;
+  char *ecmfile;
+  off_t size;
+  pthread_mutex_lock(&images_lock);
+  im = image_lookup(path);
+  size = im->size;
+  if(im->users || !image_stale(im, st)) {
+    pthread_mutex_unlock(&images_lock);
+    return size;
+  }
+  pthread_mutex_unlock(&images_lock);
+  ecmfile = source(path, ".ecm");
+  size = -1;
+  if(!ecm_open(&r, ecmfile)) {
+    size = r.idx.imagesize;
+    ecm_close(&r);
+  }
+  free(ecmfile);
+  pthread_mutex_lock(&images_lock);
+  /* Unless it's been opened, or a newer ECM file read, in the meantime */
+  if(im->users || ((im->size >= 0) && (im->mtime > st->st_mtime))) {
+    size = im->size;
+  } else {
+    image_note(im, st, size);
+  }
+  pthread_mutex_unlock(&images_lock);
+  return size;
+}
+
+/*
+** Open the image at "path" for reading, or take another reference to it if
+** it's open already.  image_put() lets it go, and the last one closes it.
+** As for image_size(), the reader is opened without images_lock, and if
+** someone else opens the image first, theirs is used instead.
+*/
+static struct image *image_get(const char *path) {
+  struct image *im;
+  struct ecm_reader *r;
+  char *ecmfile = source(path, ".ecm");
+  struct stat st;
+  int err;
+  int ours = 0;
+  if(stat(ecmfile, &st) || !S_ISREG(st.st_mode)) {
+    free(ecmfile);
+    return NULL;
+  }
+  pthread_mutex_lock(&images_lock);
+  im = image_lookup(path);
+  if(im->users) {
+    im->users++;
+    pthread_mutex_unlock(&images_lock);
+    free(ecmfile);
+    return im;
+  }
+  pthread_mutex_unlock(&images_lock);
+  /* The reader stays where it is, for the prefetcher */
+  r = malloc(sizeof(*r));
+  if(!r) abort();
+  err = ecm_open(r, ecmfile);
+  free(ecmfile);
+  if(!err) {
+    /* Without the cache, reads are just slower */
+    ecm_cache(r, cachesize);
+    ecm_prefetch(r, prefetch);
+  }
+  pthread_mutex_lock(&images_lock);
+  if(im->users) {
+    im->users++;
+  } else if(err) {
+    image_note(im, &st, -1);
+    im = NULL;
+  } else {
+    im->r = r;
+    image_note(im, &st, r->idx.imagesize);
+    im->users = 1;
+    ours = 1;
+  }
+  pthread_mutex_unlock(&images_lock);
+  if(!ours) {
+    if(!err) ecm_close(r);
+    free(r);
+  }
+  return im;
+}
+
+/*
+** The last one to let go takes the reader off the image, and closes it
+** without images_lock, since that waits for the prefetcher.
+*/
+static void image_put(struct image *im) {
+  struct ecm_reader *r = NULL;
+  pthread_mutex_lock(&images_lock);
+  if(!--im->users) {
+    r = im->r;
+    im->r = NULL;
+  }
+  pthread_mutex_unlock(&images_lock);
+  if(r) {
+    ecm_close(r);
+    free(r);
+  }
+}
+
+/***************************************************************************/
+
+static void *ecmfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  (void)conn;
+  /* The images never change, so the kernel can keep what it's read */
+  cfg->kernel_cache = 1;
+  return NULL;
+}
+
+static void ecmfs_destroy(void *data) {
+  (void)data;
+  while(images) {
+    struct image *im = images;
+    images = im->next;
+    if(im->r) {
+      ecm_close(im->r);
+      free(im->r);
+    }
+    free(im->path);
+    free(im);
+  }
+}
+
+static int ecmfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+  off_t size;
+  char *s = source(path, "");
+  (void)fi;
+  if(!stat(s, st) && S_ISDIR(st->st_mode)) {
+    free(s);
+    st->st_mode = S_IFDIR | 0555;
+    return 0;
+  }
+  free(s);
+  s = source(path, ".ecm");
+  if(stat(s, st) || !S_ISREG(st->st_mode)) {
+    free(s);
+    return -ENOENT;
+  }
+  free(s);
+  size = image_size(path, st);
+  if(size < 0) return -EIO;
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = size;
+  st->st_blocks = (st->st_size + 511) / 512;
+  return 0;
+}
+
+static int ecmfs_readdir(
+  const char *path,
+  void *buf,
+  fuse_fill_dir_t filler,
+  off_t offset,
+  struct fuse_file_info *fi,
+  enum fuse_readdir_flags flags
+) {
+  char *s = source(path, "");
+  struct dirent *e;
+  DIR *d;
+  (void)offset;
+  (void)fi;
+  (void)flags;
+  d = opendir(s);
+  free(s);
+  if(!d) return -errno;
+  filler(buf, ".", NULL, 0, 0);
+  filler(buf, "..", NULL, 0, 0);
+  while((e = readdir(d)) != NULL) {
+    char name[NAME_MAX + 1];
+    size_t len = strlen(e->d_name);
+    char *full;
+    struct stat st;
+    if(e->d_name[0] == '.') continue;
+    full = malloc(strlen(path) + len + 2);
+    if(!full) abort();
+    sprintf(full, "%s/%s", strcmp(path, "/") ? path : "", e->d_name);
+    s = source(full, "");
+    free(full);
+    if(stat(s, &st)) {
+      free(s);
+      continue;
+    }
+    free(s);
+    if(S_ISDIR(st.st_mode)) {
+      filler(buf, e->d_name, NULL, 0, 0);
+    } else if(
+      S_ISREG(st.st_mode) && (len > 4) &&
+      !strcasecmp(e->d_name + len - 4, ".ecm")
+    ) {
+      memcpy(name, e->d_name, len - 4);
+      name[len - 4] = 0;
+      filler(buf, name, NULL, 0, 0);
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+static int ecmfs_open(const char *path, struct fuse_file_info *fi) {
+  struct image *im;
+  if((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+  im = image_get(path);
+  if(!im) return -ENOENT;
+  fi->fh = (uint64_t)(uintptr_t)im;
+  fi->keep_cache = 1;
+  return 0;
+}
+
+static int ecmfs_read(
+  const char *path,
+  char *buf,
+  size_t size,
+  off_t offset,
+  struct fuse_file_info *fi
+) {
+  struct image *im = (struct image *)(uintptr_t)fi->fh;
+  off_t got;
+  (void)path;
+  got = ecm_pread_image(im->r, buf, offset, size);
+  if(got < 0) return -EIO;
+  return (int)got;
+}
+
+static int ecmfs_release(const char *path, struct fuse_file_info *fi) {
+  (void)path;
+  image_put((struct image *)(uintptr_t)fi->fh);
+  return 0;
+}
+
+static const struct fuse_operations ecmfs_ops = {
+  .init    = ecmfs_init,
+  .destroy = ecmfs_destroy,
+  .getattr = ecmfs_getattr,
+  .readdir = ecmfs_readdir,
+  .open    = ecmfs_open,
+  .read    = ecmfs_read,
+  .release = ecmfs_release,
+};
+
+/***************************************************************************/
+
+void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options] ecmdir mountpoint\n"
+    "       Every file.ecm under ecmdir shows up as file under mountpoint,\n"
+    "       read-only.  Unmount with fusermount -u mountpoint.\n"
+    "\n"
+    "options:\n"
+    "  --cache n       Cache up to n MiB of sectors per image (default %d)\n"
+    "  --prefetch n    Read n sectors ahead of sequential reads (default %d;\n"
+    "                  0 for none)\n"
+    "  -f              Stay in the foreground\n"
+    "  -s              Handle one request at a time\n"
+    "  -d              Show every request (implies -f)\n"
+    "  -o opt,...      Mount options, as for any FUSE file system\n",
+    name, ECMFS_CACHE, ECMFS_PREFETCH
+  );
+}
+
+int main(int argc, char **argv) {
+  char **fargv;
+  int fargc = 0;
+  char *dir = NULL;
+  char *mountpoint = NULL;
+  int i;
+  int ret;
+  banner();
+  ecm_init();
+  fargv = malloc((argc + 3) * sizeof(*fargv));
+  if(!fargv) abort();
+  fargv[fargc++] = argv[0];
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--cache") && (i + 1 < argc)) {
+      char *end;
+      unsigned long n = strtoul(argv[++i], &end, 10);
+      if(*end || (n > (size_t)-1 / 1048576)) {
+        fprintf(stderr, "bad cache size '%s'\n", argv[i]);
+        return 1;
+      }
+      cachesize = (size_t)n * 1048576;
+      continue;
+    }
+    if(!strcmp(argv[i], "--prefetch") && (i + 1 < argc)) {
+      char *end;
+      prefetch = (off_t)strtoul(argv[++i], &end, 10);
+      if(*end) {
+        fprintf(stderr, "bad prefetch '%s'\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if(!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+      fargv[fargc++] = argv[i++];
+      fargv[fargc++] = argv[i];
+      continue;
+    }
+    if(!strcmp(argv[i], "-f") || !strcmp(argv[i], "-s") || !strcmp(argv[i], "-d")) {
+      fargv[fargc++] = argv[i];
+      continue;
+    }
+    if(argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else if(!dir) {
+      dir = argv[i];
+    } else if(!mountpoint) {
+      mountpoint = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(!mountpoint) {
+    usage(argv[0]);
+    return 1;
+  }
+  /* FUSE changes to / when it goes into the background */
+  ecmdir = realpath(dir, NULL);
+  if(!ecmdir) {
+    perror(dir);
+    return 1;
+  }
+  fargv[fargc++] = mountpoint;
+  fargv[fargc++] = "-oro";
+  fargv[fargc] = NULL;
+  ret = fuse_main(fargc, fargv, &ecmfs_ops, NULL);
+  free(fargv);
+  return ret;
+}
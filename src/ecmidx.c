@@ -0,0 +1,276 @@
+/***************************************************************************/
+/*
+** ECMIDX - Random access index for ECM files
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecmidx.h"
+
+/***************************************************************************/
+
+static const unsigned char ecmidx_magic[8] = { 'E', 'C', 'M', 'I', 'D', 'X', 0, 1 };
+
+static int seekto(FILE *f, off_t pos) {
+  if(ftello(f) == pos) return 0;
+  return fseeko(f, pos, SEEK_SET);
+}
+
+/*
+** Start of the records, right after the "ECM\0" header
+*/
+void ecmpos_start(struct ecmpos *p) {
+  p->file = 4;
+  p->left = 0;
+  p->type = 0;
+  p->image = 0;
+}
+
+/*
+** Read the header of the record at p->file, once nothing is left of the
+** one before.  Returns 1 at the end of the records, or -1 if the file ends
+** or the header makes no sense.
+*/
+int ecmpos_header(struct ecmpos *p, FILE *ecm) {
+  unsigned bits = 5;
+  off_t num;
+  int c;
+  if(seekto(ecm, p->file)) return -1;
+  c = getc(ecm);
+  if(c == EOF) return -1;
+  p->file++;
+  p->type = c & 3;
+  num = (c >> 2) & 0x1F;
+  while(c & 0x80) {
+    c = getc(ecm);
+    if((c == EOF) || (bits > 56)) return -1;
+    p->file++;
+    num |= ((off_t)(c & 0x7F)) << bits;
+    bits += 7;
+  }
+  if(num == 0xFFFFFFFF) return 1;
+  p->left = num + 1;
+  return 0;
+}
+
+/***************************************************************************/
+
+/*
+** Build the index of an ECM file, with an entry every "step" sectors, from a
+** scan of its record headers.  Returns nonzero if the file isn't right.
+*/
+int ecmidx_build(struct ecmidx *x, FILE *ecm, unsigned step) {
+  struct ecmpos p;
+  off_t total;
+  off_t next = 0;
+  off_t room = 0;
+  memset(x, 0, sizeof(*x));
+  if(!step) return 1;
+  x->step = step;
+  if(fseeko(ecm, 0, SEEK_END)) return 1;
+  total = ftello(ecm);
+  if(
+    fseeko(ecm, 0, SEEK_SET) ||
+    (getc(ecm) != 'E') ||
+    (getc(ecm) != 'C') ||
+    (getc(ecm) != 'M') ||
+    (getc(ecm) != 0x00)
+  ) return 1;
+  ecmpos_start(&p);
+  for(;;) {
+    off_t usz, fsz, end;
+    int r = ecmpos_header(&p, ecm);
+    if(r < 0) goto fail;
+    if(r) break;
+    if(p.left > total) goto fail;
+    usz = ecm_unit_image[p.type];
+    fsz = ecm_unit_file[p.type];
+    end = p.image + p.left * usz;
+    while(next < end) {
+      struct ecmpos *e;
+      off_t u = (next - p.image) / usz;
+      if(x->count == room) {
+        room = room ? room * 2 : 1024;
+        e = realloc(x->entry, (size_t)room * sizeof(*e));
+        if(!e) goto fail;
+        x->entry = e;
+      }
+      e = x->entry + x->count++;
+      e->file = p.file + u * fsz;
+      e->left = p.left - u;
+      e->type = p.type;
+      e->image = p.image + u * usz;
+      next += (off_t)step * 2352;
+    }
+    p.file += p.left * fsz;
+    p.image = end;
+    p.left = 0;
+  }
+  if(seekto(ecm, p.file) || (fread(x->edc, 1, 4, ecm) != 4)) goto fail;
+  x->ecmsize = p.file + 4;
+  x->imagesize = p.image;
+  return 0;
+fail:
+  ecmidx_free(x);
+  return 1;
+}
+
+static void put64(unsigned char *b, uint64_t v) {
+  int i;
+  for(i = 0; i < 8; i++) b[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get64(const unsigned char *b) {
+  uint64_t v = 0;
+  int i;
+  for(i = 7; i >= 0; i--) v = (v << 8) | b[i];
+  return v;
+}
+
+/*
+** Write the index out as a .ecmidx.  Returns nonzero on error.
+*/
+int ecmidx_write(const struct ecmidx *x, FILE *f) {
+  unsigned char b[ECMIDX_HEADERSIZE];
+  off_t k;
+  memcpy(b, ecmidx_magic, 8);
+  b[ 8] = (unsigned char)(x->step >>  0);
+  b[ 9] = (unsigned char)(x->step >>  8);
+  b[10] = (unsigned char)(x->step >> 16);
+  b[11] = (unsigned char)(x->step >> 24);
+  memcpy(b + 12, x->edc, 4);
+  put64(b + 16, x->ecmsize);
+  put64(b + 24, x->imagesize);
+  put64(b + 32, x->count);
+  fwrite(b, 1, ECMIDX_HEADERSIZE, f);
+  for(k = 0; k < x->count; k++) {
+    const struct ecmpos *e = x->entry + k;
+    put64(b +  0, e->file);
+    put64(b +  8, (uint64_t)e->left | ((uint64_t)e->type << 62));
+    put64(b + 16, k * x->step * 2352 - e->image);
+    fwrite(b, 1, ECMIDX_ENTRYSIZE, f);
+  }
+  return fflush(f) || ferror(f);
+}
+
+/*
+** Read a .ecmidx back, and check that it's the index of "ecm" as it is now.
+** Returns nonzero if it isn't, or isn't an index at all.
+*/
+int ecmidx_load(struct ecmidx *x, FILE *f, FILE *ecm) {
+  unsigned char b[ECMIDX_HEADERSIZE];
+  off_t span;
+  off_t k;
+  memset(x, 0, sizeof(*x));
+  if(
+    (fread(b, 1, ECMIDX_HEADERSIZE, f) != ECMIDX_HEADERSIZE) ||
+    memcmp(b, ecmidx_magic, 8)
+  ) return 1;
+  x->step = (unsigned)(b[8] | (b[9] << 8) | (b[10] << 16) | ((unsigned)b[11] << 24));
+  memcpy(x->edc, b + 12, 4);
+  x->ecmsize = (off_t)get64(b + 16);
+  x->imagesize = (off_t)get64(b + 24);
+  x->count = (off_t)get64(b + 32);
+  if(!x->step || (x->ecmsize < 9) || (x->imagesize < 0)) return 1;
+  span = (off_t)x->step * 2352;
+  if(x->count != (x->imagesize + span - 1) / span) return 1;
+  /* The end of the ECM file must still be where it was */
+  if(fseeko(ecm, 0, SEEK_END) || (ftello(ecm) < x->ecmsize)) return 1;
+  if(
+    fseeko(ecm, x->ecmsize - 4, SEEK_SET) ||
+    (fread(b, 1, 4, ecm) != 4) ||
+    memcmp(b, x->edc, 4)
+  ) return 1;
+  x->entry = malloc((size_t)(x->count ? x->count : 1) * sizeof(*x->entry));
+  if(!x->entry) return 1;
+  for(k = 0; k < x->count; k++) {
+    struct ecmpos *e = x->entry + k;
+    uint64_t left;
+    off_t skip;
+    if(fread(b, 1, ECMIDX_ENTRYSIZE, f) != ECMIDX_ENTRYSIZE) goto fail;
+    e->file = (off_t)get64(b);
+    left = get64(b + 8);
+    e->type = (int)(left >> 62);
+    e->left = (off_t)(left & ((((uint64_t)1) << 62) - 1));
+    skip = (off_t)get64(b + 16);
+    if(
+      (e->file < 4) || (e->file >= x->ecmsize) || !e->left ||
+      (skip < 0) || (skip >= (off_t)ecm_unit_image[e->type])
+    ) goto fail;
+    e->image = k * span - skip;
+  }
+  return 0;
+fail:
+  ecmidx_free(x);
+  return 1;
+}
+
+void ecmidx_free(struct ecmidx *x) {
+  free(x->entry);
+  x->entry = NULL;
+  x->count = 0;
+}
+
+/*
+** Where the index of an ECM file goes: image.bin.ecm -> image.bin.ecmidx
+*/
+char *ecmidx_path(const char *ecmfile) {
+  size_t len = strlen(ecmfile);
+  char *path = malloc(len + sizeof(".ecmidx"));
+  if(!path) abort();
+  strcpy(path, ecmfile);
+  if((len > 4) && !strcasecmp(path + len - 4, ".ecm")) path[len - 4] = 0;
+  strcat(path, ".ecmidx");
+  return path;
+}
+
+/*
+** Build the index of "ecm" and write it to the .ecmidx for "ecmname".
+** Returns nonzero, after saying what went wrong, on error.
+*/
+int ecmidx_save(struct ecmidx *x, FILE *ecm, const char *ecmname, unsigned step) {
+  char *path;
+  FILE *f;
+  int r;
+  if(ecmidx_build(x, ecm, step)) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  path = ecmidx_path(ecmname);
+  f = fopen(path, "wb");
+  if(!f) {
+    perror(path);
+    ecmidx_free(x);
+    free(path);
+    return 1;
+  }
+  r = ecmidx_write(x, f);
+  if(fclose(f) || r) {
+    perror(path);
+    remove(path);
+    ecmidx_free(x);
+    r = 1;
+  }
+  free(path);
+  return r;
+}
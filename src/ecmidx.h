@@ -0,0 +1,84 @@
+/***************************************************************************/
+/*
+** ECMIDX - Random access index for ECM files
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __ECMIDX_H__
+#define __ECMIDX_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "libecm.h"
+
+/*
+** A place in the records of an ECM file: the unit (literal byte or sector)
+** of a record that decoding is at, how many units of the record are left,
+** this one included, and where the unit starts in the decoded image.  With
+** nothing left, the next record header is at "file".
+*/
+struct ecmpos {
+  off_t file;
+  off_t left;
+  int type;
+  off_t image;
+};
+
+void ecmpos_start(struct ecmpos *p);
+int ecmpos_header(struct ecmpos *p, FILE *ecm);
+
+/*
+** ECM records only say how long they are, so getting to a sector means
+** going through every record header before it.  The index keeps the place
+** in the records of every "step"th sector of the image, so that only a few
+** headers are left to go through.  It's built from a scan of the headers,
+** and kept next to the ECM file as a .ecmidx:
+**
+**    0  "ECMIDX", 0, 1
+**    8  step, 32-bit
+**   12  EDC at the end of the ECM file (to tell if the index is stale)
+**   16  size of the ECM file, 64-bit
+**   24  size of the decoded image, 64-bit
+**   32  number of entries, 64-bit
+**   40  entries of 24 bytes: where the unit is in the ECM file, the units
+**       left in the record with the type in the top two bits, and how far
+**       into the unit the sector starts, each 64-bit
+**
+** All numbers are little endian.
+*/
+#define ECMIDX_STEP       (16)
+#define ECMIDX_HEADERSIZE (40)
+#define ECMIDX_ENTRYSIZE  (24)
+
+struct ecmidx {
+  unsigned step;
+  unsigned char edc[4];
+  off_t ecmsize;
+  off_t imagesize;
+  off_t count;
+  struct ecmpos *entry;
+};
+
+int ecmidx_build(struct ecmidx *x, FILE *ecm, unsigned step);
+int ecmidx_write(const struct ecmidx *x, FILE *f);
+int ecmidx_load(struct ecmidx *x, FILE *f, FILE *ecm);
+void ecmidx_free(struct ecmidx *x);
+char *ecmidx_path(const char *ecmfile);
+int ecmidx_save(struct ecmidx *x, FILE *ecm, const char *ecmname, unsigned step);
+
+#endif
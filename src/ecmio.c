@@ -0,0 +1,1344 @@
+/***************************************************************************/
+/*
+** ECMIO - I/O backends shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "ecmio.h"
+
+/***************************************************************************/
+/*
+** Buffers are page aligned, with some headroom in the page before them (see
+** output_reserve)
+*/
+static unsigned char *alloc_buffer(size_t size) {
+#ifdef __linux__
+  void *p;
+  if(posix_memalign(&p, 4096, 4096 + size)) return NULL;
+  return (unsigned char*)p + 4096;
+#else
+  unsigned char *p = malloc(OUTPUT_HEADROOM + size);
+  return p ? p + OUTPUT_HEADROOM : NULL;
+#endif
+}
+
+static void free_buffer(unsigned char *buf) {
+#ifdef __linux__
+  if(buf) free(buf - 4096);
+#else
+  if(buf) free(buf - OUTPUT_HEADROOM);
+#endif
+}
+
+/***************************************************************************/
+
+#ifdef HAVE_IO_URING
+
+int uring_init(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  unsigned char *sq;
+  unsigned char *cq;
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if(r->fd < 0) return 1;
+  r->entries = p.sq_entries;
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_ring == MAP_FAILED) goto fail;
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if(r->cq_ring == MAP_FAILED) {
+      munmap(r->sq_ring, r->sq_ring_size);
+      goto fail;
+    }
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqes == MAP_FAILED) {
+    if(r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    goto fail;
+  }
+  sq = r->sq_ring;
+  cq = r->cq_ring;
+  r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+  r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 0;
+fail:
+  close(r->fd);
+  r->fd = -1;
+  return 1;
+}
+
+int uring_register_buffers(struct uring *r, const void *iov, unsigned count) {
+  return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+    iov, count) < 0;
+}
+
+/*
+** Get a cleared submission entry; it's queued as soon as this returns and
+** goes to the kernel with the next uring_submit()
+*/
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+  unsigned tail = *r->sq_tail;
+  unsigned index;
+  struct io_uring_sqe *sqe;
+  while(tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+    if(uring_submit(r, 0)) return NULL;
+  }
+  index = tail & *r->sq_mask;
+  sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+  return sqe;
+}
+
+/*
+** Submit everything queued, optionally waiting for "wait" completions
+*/
+int uring_submit(struct uring *r, unsigned wait) {
+  for(;;) {
+    int ret = (int)syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      return 1;
+    }
+    r->pending -= ret;
+    return 0;
+  }
+}
+
+/*
+** Pop one completion, if there is one
+*/
+int uring_peek(struct uring *r, unsigned long long *user_data, int *res) {
+  unsigned head = *r->cq_head;
+  struct io_uring_cqe *cqe;
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+  cqe = &r->cqes[head & *r->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void uring_exit(struct uring *r) {
+  if(r->fd < 0) return;
+  munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+  if(r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->fd);
+  r->fd = -1;
+}
+
+/*
+** Fill in a read or write, using the registered buffer "index" if >= 0
+*/
+static void uring_prep_rw(
+  struct io_uring_sqe *sqe,
+  int write,
+  int fd,
+  const void *buf,
+  size_t len,
+  off_t offset,
+  int index,
+  unsigned long long user_data
+) {
+  if(index >= 0) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = (unsigned short)index;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = (unsigned long long)(size_t)buf;
+  sqe->len = (unsigned)len;
+  sqe->off = (unsigned long long)offset;
+  sqe->user_data = user_data;
+}
+
+#endif
+
+#ifdef __linux__
+static int is_regular(FILE *f) {
+  struct stat st;
+  return !fstat(fileno(f), &st) && S_ISREG(st.st_mode);
+}
+#endif
+
+/***************************************************************************/
+/*
+** Turn O_DIRECT on or off for "fd"; nonzero if that's not possible
+*/
+int set_direct(int fd, int on) {
+#if defined(__linux__) && defined(O_DIRECT)
+  int fl = fcntl(fd, F_GETFL);
+  if(fl < 0) return 1;
+  fl = on ? (fl | O_DIRECT) : (fl & ~O_DIRECT);
+  return fcntl(fd, F_SETFL, fl) != 0;
+#else
+  (void)fd; (void)on;
+  return 1;
+#endif
+}
+
+/***************************************************************************/
+/*
+** Page cache advice
+**
+** Readahead is asked for CACHEADVICE_AHEAD in front of the reader, a step
+** at a time, on top of what the kernel does by itself for sequential
+** reads.  Dropping is done a step at a time too, up to a multiple of the
+** step: the cache may hold large folios, which only go if they're dropped
+** in one piece.
+*/
+#define CACHEADVICE_AHEAD (32 * 1048576)
+
+void cacheadvice_init(struct cacheadvice *a, int fd, off_t pos, int flags) {
+  memset(a, 0, sizeof(*a));
+  a->fd = -1;
+#ifdef __linux__
+  if(fd >= 0 && !(flags & ECMIO_DIRECT)) {
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode)) return;
+    a->fd = fd;
+    a->drop = (flags & ECMIO_NOCACHE) != 0;
+    a->ahead = pos;
+    a->dropped = pos & ~(off_t)(DIRECT_ALIGN - 1);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+#else
+  (void)fd; (void)pos; (void)flags;
+#endif
+}
+
+/*
+** The reader has got up to "readpos", and won't look at anything before
+** "donepos" again
+*/
+void cacheadvice_update(struct cacheadvice *a, off_t readpos, off_t donepos) {
+#ifdef __linux__
+  if(a->fd < 0) return;
+  if(readpos + CACHEADVICE_AHEAD - CACHEADVICE_STEP > a->ahead) {
+    off_t from = a->ahead > readpos ? a->ahead : readpos;
+    a->ahead = readpos + CACHEADVICE_AHEAD;
+    posix_fadvise(a->fd, from, a->ahead - from, POSIX_FADV_WILLNEED);
+  }
+  if(a->drop && (donepos - a->dropped >= CACHEADVICE_STEP)) {
+    off_t end = donepos & ~(off_t)(CACHEADVICE_STEP - 1);
+    if(end <= a->dropped) return;
+    if(a->map) {
+      madvise((void*)(a->map + a->dropped), (size_t)(end - a->dropped),
+        MADV_DONTNEED);
+    }
+    posix_fadvise(a->fd, a->dropped, end - a->dropped, POSIX_FADV_DONTNEED);
+    a->dropped = end;
+  }
+#else
+  (void)a; (void)readpos; (void)donepos;
+#endif
+}
+
+/*
+** The reader is finished, having got up to "end"; drop the rest of that
+*/
+void cacheadvice_done(struct cacheadvice *a, off_t end) {
+#ifdef __linux__
+  if(a->fd >= 0 && a->drop && end > a->dropped) {
+    struct stat st;
+    /* The partial page at the end of the file only goes with "to the end" */
+    off_t len = (!fstat(a->fd, &st) && end >= st.st_size) ? 0 : end - a->dropped;
+    posix_fadvise(a->fd, a->dropped, len, POSIX_FADV_DONTNEED);
+  }
+  a->fd = -1;
+#else
+  (void)a; (void)end;
+#endif
+}
+
+/***************************************************************************/
+/*
+** Sequential input
+**
+** Besides stdio, the input can be read in chunks into a pool of aligned
+** buffers: several reads in flight with io_uring, or one at a time with
+** O_DIRECT alone.  With O_DIRECT, reads start at a multiple of DIRECT_ALIGN
+** before the actual start, and only the one at the end of the file is
+** short.
+*/
+#define INPUT_CHUNKSIZE (262144)
+#define INPUT_CHUNKS    (16)
+
+#ifdef HAVE_IO_URING
+static void input_submit(struct input *in, unsigned i) {
+  struct io_uring_sqe *sqe;
+  size_t len = in->chunksize;
+  size_t ask;
+  in->chunkpos[i] = in->nextread;
+  in->chunklen[i] = 0;
+  if(in->nextread >= in->size) return;
+  if((off_t)len > in->size - in->nextread) len = (size_t)(in->size - in->nextread);
+  ask = len;
+  if(in->direct) ask = (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+  sqe = uring_get_sqe(&in->ring);
+  if(!sqe) {
+    in->error = 1;
+    return;
+  }
+  uring_prep_rw(sqe, 0, fileno(in->f), in->pool + i * in->chunksize, ask,
+    in->nextread, (int)i, i);
+  in->chunkbusy[i] = 1;
+  in->inflight++;
+  in->nextread += len;
+}
+
+/*
+** Wait for the chunk at the head of the ring
+*/
+static void input_wait(struct input *in) {
+  while(in->chunkbusy[in->head]) {
+    unsigned long long i;
+    int res;
+    if(uring_submit(&in->ring, 1)) {
+      in->error = 1;
+      return;
+    }
+    while(uring_peek(&in->ring, &i, &res)) {
+      size_t want = in->chunksize;
+      if((off_t)want > in->size - in->chunkpos[i]) {
+        want = (size_t)(in->size - in->chunkpos[i]);
+      }
+      in->chunkbusy[i] = 0;
+      in->inflight--;
+      if(res < 0) {
+        errno = -res;
+        in->error = 1;
+        res = 0;
+      }
+      /* A short read in the middle of the file; get the rest directly */
+      while((size_t)res < want) {
+        ssize_t r = pread(fileno(in->f), in->pool + i * in->chunksize + res,
+          want - res, in->chunkpos[i] + res);
+        if(r <= 0) {
+          in->error = 1;
+          break;
+        }
+        res += (int)r;
+      }
+      in->chunklen[i] = (size_t)res;
+    }
+  }
+}
+
+/*
+** Let anything still in flight land
+*/
+static void input_drain(struct input *in) {
+  while(in->inflight) {
+    unsigned long long i;
+    int res;
+    if(uring_submit(&in->ring, 1)) break;
+    while(uring_peek(&in->ring, &i, &res)) {
+      in->chunkbusy[i] = 0;
+      in->inflight--;
+    }
+  }
+}
+#endif
+
+#ifdef __linux__
+/*
+** Read the next chunk right away (O_DIRECT without io_uring)
+*/
+static void input_fill(struct input *in) {
+  ssize_t r;
+  in->chunkpos[0] = in->nextread;
+  do {
+    r = pread(fileno(in->f), in->pool, in->chunksize, in->nextread);
+  } while(r < 0 && errno == EINTR);
+  if(r < 0) {
+    in->error = 1;
+    r = 0;
+  }
+  in->chunklen[0] = (size_t)r;
+  in->nextread += r;
+}
+
+/*
+** Start reading chunks at the current position
+*/
+static void input_start(struct input *in) {
+  off_t start = in->pos;
+  if(in->direct) start &= ~(off_t)(DIRECT_ALIGN - 1);
+  in->nextread = start;
+  in->head = 0;
+#ifdef HAVE_IO_URING
+  if(in->useuring) {
+    unsigned i;
+    for(i = 0; i < in->nchunks; i++) input_submit(in, i);
+    input_wait(in);
+  } else
+#endif
+  {
+    input_fill(in);
+  }
+  in->headoff = (size_t)(in->pos - start);
+  if(in->headoff > in->chunklen[0]) in->headoff = in->chunklen[0];
+}
+
+/*
+** Move on to the next chunk, recycling the one we're done with
+*/
+static int input_advance(struct input *in) {
+  if(in->error) return 1;
+  in->headoff = 0;
+#ifdef HAVE_IO_URING
+  if(in->useuring) {
+    input_submit(in, in->head);
+    in->head = (in->head + 1) % in->nchunks;
+    input_wait(in);
+    return in->chunklen[in->head] == 0;
+  }
+#endif
+  input_fill(in);
+  return in->chunklen[0] == 0;
+}
+#endif
+
+/*
+** Keep the page cache advice in step with the read position
+*/
+static void input_advise(struct input *in) {
+  if(in->pos < in->nextadvice) return;
+  cacheadvice_update(&in->advice, in->pos, in->pos);
+  in->nextadvice = in->pos + CACHEADVICE_STEP / 4;
+}
+
+int input_open(struct input *in, FILE *f, int flags) {
+  memset(in, 0, sizeof(*in));
+  in->f = f;
+#ifdef __linux__
+  in->regular = is_regular(f);
+  in->pos = ftello(f);
+  if(in->pos < 0) in->pos = 0;
+  if(in->regular) {
+    struct stat st;
+    in->size = fstat(fileno(f), &st) ? in->pos : st.st_size;
+  }
+  if((flags & ECMIO_DIRECT) && in->regular && !set_direct(fileno(f), 1)) {
+    in->direct = 1;
+  }
+  cacheadvice_init(&in->advice, in->regular ? fileno(f) : -1, in->pos,
+    in->direct ? (flags | ECMIO_DIRECT) : (flags & ~ECMIO_DIRECT));
+#else
+  cacheadvice_init(&in->advice, -1, 0, flags);
+#endif
+#ifdef HAVE_IO_URING
+  if((flags & ECMIO_URING) && in->regular) {
+    struct iovec iov[INPUT_CHUNKS];
+    unsigned i;
+    in->chunksize = INPUT_CHUNKSIZE;
+    in->nchunks = INPUT_CHUNKS;
+    in->pool = alloc_buffer(in->chunksize * in->nchunks);
+    if(in->pool && !uring_init(&in->ring, in->nchunks)) {
+      for(i = 0; i < in->nchunks; i++) {
+        iov[i].iov_base = in->pool + i * in->chunksize;
+        iov[i].iov_len = in->chunksize;
+      }
+      if(!uring_register_buffers(&in->ring, iov, in->nchunks)) {
+        in->useuring = 1;
+        input_start(in);
+        return 0;
+      }
+      uring_exit(&in->ring);
+    }
+    free_buffer(in->pool);
+    in->pool = NULL;
+  }
+#endif
+#ifdef __linux__
+  if(in->direct) {
+    in->chunksize = INPUT_CHUNKSIZE;
+    in->nchunks = 1;
+    in->pool = alloc_buffer(in->chunksize);
+    if(in->pool) {
+      input_start(in);
+      return 0;
+    }
+    set_direct(fileno(f), 0);
+    in->direct = 0;
+  }
+#endif
+  (void)flags;
+  return 0;
+}
+
+int input_getc(struct input *in) {
+  int c;
+#ifdef __linux__
+  if(in->pool) {
+    if(in->headoff >= in->chunklen[in->head]) {
+      if(input_advance(in)) return EOF;
+    }
+    in->pos++;
+    return in->pool[in->head * in->chunksize + in->headoff++];
+  }
+#endif
+  c = fgetc(in->f);
+  if(c != EOF) in->pos++;
+  return c;
+}
+
+size_t input_read(struct input *in, void *dest, size_t size) {
+  size_t r;
+#ifdef __linux__
+  if(in->pool) {
+    unsigned char *d = dest;
+    r = 0;
+    while(r < size) {
+      size_t b = in->chunklen[in->head] - in->headoff;
+      if(!b) {
+        if(input_advance(in)) break;
+        continue;
+      }
+      if(b > size - r) b = size - r;
+      memcpy(d + r, in->pool + in->head * in->chunksize + in->headoff, b);
+      in->headoff += b;
+      r += b;
+    }
+    in->pos += r;
+    input_advise(in);
+    return r;
+  }
+#endif
+  r = fread(dest, 1, size, in->f);
+  in->pos += r;
+  input_advise(in);
+  return r;
+}
+
+/*
+** Skip "len" bytes of a regular file that were consumed some other way
+*/
+void input_skip(struct input *in, off_t len) {
+  in->pos += len;
+  input_advise(in);
+#ifdef __linux__
+  if(in->pool) {
+    /* Throw away what's been read ahead and start over */
+#ifdef HAVE_IO_URING
+    if(in->useuring) input_drain(in);
+#endif
+    input_start(in);
+    return;
+  }
+#endif
+  fseeko(in->f, in->pos, SEEK_SET);
+}
+
+void input_close(struct input *in) {
+  cacheadvice_done(&in->advice, in->pos);
+#ifdef HAVE_IO_URING
+  if(in->useuring) {
+    /* Let anything still in flight land before the buffers go away */
+    input_drain(in);
+    uring_exit(&in->ring);
+    in->useuring = 0;
+  }
+#endif
+#ifdef __linux__
+  free_buffer(in->pool);
+  in->pool = NULL;
+#else
+  (void)in;
+#endif
+}
+
+/***************************************************************************/
+
+#ifdef HAVE_IO_URING
+
+int readahead_init(struct readahead *ra, int fd, off_t total,
+  unsigned char *base, size_t size
+) {
+  struct iovec iov;
+  memset(ra, 0, sizeof(*ra));
+  ra->fd = fd;
+  ra->total = total;
+  if(uring_init(&ra->ring, READAHEAD_MAXDEPTH)) return 1;
+  /* Registration is an optimization; plain reads work too */
+  iov.iov_base = base;
+  iov.iov_len = size;
+  ra->registered = !uring_register_buffers(&ra->ring, &iov, 1);
+  return 0;
+}
+
+/*
+** Queue a read of the next "len" bytes of the file into "dest"
+*/
+void readahead_submit(struct readahead *ra, unsigned char *dest, size_t len) {
+  unsigned i;
+  struct io_uring_sqe *sqe;
+  if(ra->count == READAHEAD_MAXDEPTH) return;
+  i = (ra->head + ra->count) % READAHEAD_MAXDEPTH;
+  sqe = uring_get_sqe(&ra->ring);
+  if(!sqe) {
+    ra->error = 1;
+    return;
+  }
+  uring_prep_rw(sqe, 0, ra->fd, dest, len, ra->submitpos, ra->registered ? 0 : -1, i);
+  ra->slot[i].dest = dest;
+  ra->slot[i].pos = ra->submitpos;
+  ra->slot[i].len = len;
+  ra->slot[i].done = 0;
+  ra->slot[i].busy = 1;
+  ra->count++;
+  ra->submitpos += len;
+}
+
+/*
+** Reap completions and return how far the file has been read contiguously.
+** Blocks until that's at least "want" or nothing is left in flight.
+*/
+off_t readahead_complete(struct readahead *ra, off_t want) {
+  unsigned wait = 0;
+  for(;;) {
+    unsigned long long i;
+    int res;
+    if(uring_submit(&ra->ring, wait)) {
+      ra->error = 1;
+      return ra->readpos;
+    }
+    while(uring_peek(&ra->ring, &i, &res)) {
+      if(res <= 0) {
+        /* Error or unexpected end of file; give up on this read */
+        if(res < 0) errno = -res;
+        ra->error = 1;
+        ra->slot[i].len = ra->slot[i].done;
+        ra->slot[i].busy = 0;
+        continue;
+      }
+      ra->slot[i].done += res;
+      if(ra->slot[i].pos + (off_t)ra->slot[i].done >= ra->total) {
+        /* An O_DIRECT read rounded up past the end of the file */
+        ra->slot[i].len = ra->slot[i].done;
+      }
+      if(ra->slot[i].done < ra->slot[i].len) {
+        /* Short read; queue the rest */
+        struct io_uring_sqe *sqe = uring_get_sqe(&ra->ring);
+        if(sqe) {
+          uring_prep_rw(sqe, 0, ra->fd, ra->slot[i].dest + ra->slot[i].done,
+            ra->slot[i].len - ra->slot[i].done,
+            ra->slot[i].pos + ra->slot[i].done, ra->registered ? 0 : -1, i);
+          continue;
+        }
+        ra->error = 1;
+        ra->slot[i].len = ra->slot[i].done;
+      }
+      ra->slot[i].busy = 0;
+    }
+    while(ra->count && !ra->slot[ra->head].busy) {
+      ra->readpos += ra->slot[ra->head].done;
+      if(ra->slot[ra->head].done < ra->slot[ra->head].len) ra->error = 1;
+      ra->head = (ra->head + 1) % READAHEAD_MAXDEPTH;
+      ra->count--;
+    }
+    if(ra->error || ra->readpos >= want || !ra->count) return ra->readpos;
+    wait = 1;
+  }
+}
+
+void readahead_exit(struct readahead *ra) {
+  unsigned i;
+  /* Let anything still in flight land before the caller frees the memory */
+  for(i = 0; i < READAHEAD_MAXDEPTH; i++) {
+    while(ra->slot[i].busy) {
+      unsigned long long u;
+      int res;
+      if(uring_submit(&ra->ring, 1)) break;
+      while(uring_peek(&ra->ring, &u, &res)) ra->slot[u].busy = 0;
+    }
+  }
+  uring_exit(&ra->ring);
+}
+
+#endif
+
+/***************************************************************************/
+/*
+** Read-only views of part of a file
+*/
+int view_map(struct view *v, int fd, off_t offset, size_t len) {
+#ifdef __linux__
+  off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+  struct stat st;
+  void *p;
+  if(fstat(fd, &st) || (offset < 0) || ((off_t)len > st.st_size - offset)) return 1;
+  v->size = len + (size_t)(offset - start);
+  p = mmap(NULL, v->size, PROT_READ, MAP_SHARED, fd, start);
+  if(p == MAP_FAILED) return 1;
+  madvise(p, v->size, MADV_SEQUENTIAL);
+  v->base = p;
+  v->data = (const unsigned char*)p + (offset - start);
+  return 0;
+#else
+  (void)v; (void)fd; (void)offset; (void)len;
+  return 1;
+#endif
+}
+
+void view_unmap(struct view *v) {
+#ifdef __linux__
+  if(v->base) munmap(v->base, v->size);
+#endif
+  v->base = NULL;
+  v->data = NULL;
+}
+
+/***************************************************************************/
+/*
+** Output stream
+**
+** Sectors can be reconstructed directly inside the staging buffer through
+** output_reserve() and output_commit().  Mode 2 reconstruction temporarily
+** clobbers the 4 bytes in front of the sector, hence the headroom in front
+** of every buffer.
+**
+** vmsplice() only references the pages, so a buffer can't be touched again
+** until the reader has consumed it.  We alternate between two buffers that
+** are each exactly as large as the pipe: once one of them is completely in
+** the pipe, nothing from the other one can still be there.  For that to
+** hold, buffers are always flushed completely full (except at the very end),
+** so a sector that would straddle the end of a buffer is reconstructed in a
+** bounce buffer and copied.
+**
+** With io_uring, full buffers are queued as writes of registered buffers at
+** increasing file offsets and submitted in batches; a buffer is only reused
+** once its writes have completed.
+**
+** Sparse output goes to a regular file with positioned writes.  Buffers are
+** scanned for file blocks that are entirely zero as they're flushed; runs
+** of those that are long enough are skipped, leaving holes, and the rest is
+** written.  Runs that are too short to bother with are written after all,
+** from a static block of zeros.
+*/
+#define OUTMODE_STDIO  (0)
+#define OUTMODE_SPLICE (1)
+#define OUTMODE_URING  (2)
+
+#define OUTPUT_BATCH   (4)
+
+#define SPARSE_BLOCK   (4096)
+#define SPARSE_MIN     (65536)
+
+#define WRITEBEHIND    (16 * 1048576)
+
+#ifdef __GNUC__
+static const unsigned char zeros[SPARSE_MIN] __attribute__((aligned(DIRECT_ALIGN)));
+#else
+static const unsigned char zeros[SPARSE_MIN];
+#endif
+
+#ifdef HAVE_IO_URING
+/*
+** Writes are tagged with their buffer and length
+*/
+static void output_reap(struct output *o, unsigned wait) {
+  unsigned long long u;
+  int res;
+  if(uring_submit(&o->ring, wait)) {
+    o->error = 1;
+    memset(o->busy, 0, sizeof(o->busy));
+    return;
+  }
+  o->queued = 0;
+  while(uring_peek(&o->ring, &u, &res)) {
+    if(res < 0) {
+      errno = -res;
+      o->error = 1;
+    } else if((unsigned long long)res < (u >> 8)) {
+      /* Short write; the disk is full */
+      errno = ENOSPC;
+      o->error = 1;
+    }
+    if(o->busy[u & 0xFF]) o->busy[u & 0xFF]--;
+  }
+}
+#endif
+
+int output_open(struct output *o, FILE *f, int flags) {
+  int i;
+  memset(o, 0, sizeof(*o));
+  o->f = f;
+  o->mode = OUTMODE_STDIO;
+  o->nbufs = 1;
+  o->bufsize = OUTPUT_BUFSIZE;
+#ifdef __linux__
+  o->regular = is_regular(f);
+  if(o->regular) {
+    fflush(f);
+    o->writeoff = lseek(fileno(f), 0, SEEK_CUR);
+    o->sparse = (flags & ECMIO_SPARSE) && (o->writeoff >= 0);
+    o->direct = (flags & ECMIO_DIRECT) && (o->writeoff >= 0) &&
+      !set_direct(fileno(f), 1);
+    o->drop = (flags & ECMIO_NOCACHE) != 0;
+    o->synced = o->writeoff;
+    o->waited = o->writeoff;
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if((flags & ECMIO_URING) && o->regular && !uring_init(&o->ring, OUTPUT_MAXBUFS * 4)) {
+    o->mode = OUTMODE_URING;
+    o->nbufs = OUTPUT_MAXBUFS;
+  }
+#endif
+  (void)flags;
+#ifdef __linux__
+  if(o->mode == OUTMODE_STDIO) {
+    struct stat st;
+    int fd = fileno(f);
+    if(!fstat(fd, &st) && S_ISFIFO(st.st_mode)) {
+      int pipesize;
+      fcntl(fd, F_SETPIPE_SZ, OUTPUT_BUFSIZE);
+      pipesize = fcntl(fd, F_GETPIPE_SZ);
+      if(pipesize > 0) {
+        o->mode = OUTMODE_SPLICE;
+        o->nbufs = 2;
+        o->bufsize = pipesize;
+      }
+    }
+  }
+#endif
+  for(i = 0; i < o->nbufs; i++) {
+    o->mem[i] = alloc_buffer(o->bufsize);
+    if(!o->mem[i]) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+#ifdef HAVE_IO_URING
+  if(o->mode == OUTMODE_URING) {
+    struct iovec iov[OUTPUT_MAXBUFS];
+    for(i = 0; i < o->nbufs; i++) {
+      iov[i].iov_base = o->mem[i];
+      iov[i].iov_len = o->bufsize;
+    }
+    if(uring_register_buffers(&o->ring, iov, o->nbufs)) {
+      /* Can't pin the buffers; plain writes it is */
+      uring_exit(&o->ring);
+      for(i = 1; i < o->nbufs; i++) {
+        free_buffer(o->mem[i]);
+        o->mem[i] = NULL;
+      }
+      o->mode = OUTMODE_STDIO;
+      o->nbufs = 1;
+    }
+  }
+#endif
+  o->buf = o->mem[0];
+#ifdef __linux__
+  /* Only positioned writes know where they're writing */
+  o->writebehind = o->regular && !o->direct && (o->writeoff >= 0) &&
+    (o->sparse || (o->mode == OUTMODE_URING));
+#endif
+  return 0;
+}
+
+static void output_write(struct output *o, const unsigned char *src, size_t size) {
+#ifdef __linux__
+  if(o->mode == OUTMODE_SPLICE) {
+    struct iovec iov;
+    iov.iov_base = (void*)src;
+    iov.iov_len = size;
+    while(iov.iov_len) {
+      ssize_t r = vmsplice(fileno(o->f), &iov, 1, 0);
+      if(r < 0) {
+        if(errno == EINTR) continue;
+        if(errno == EINVAL || errno == ENOSYS) {
+          /* Not supported here after all; fall back to plain writes */
+          o->mode = OUTMODE_STDIO;
+          break;
+        }
+        perror("vmsplice");
+        o->error = 1;
+        return;
+      }
+      iov.iov_base = (unsigned char*)iov.iov_base + r;
+      iov.iov_len -= r;
+    }
+    if(!iov.iov_len) return;
+    src = iov.iov_base;
+    size = iov.iov_len;
+  }
+#endif
+  if(fwrite(src, 1, size, o->f) != size) o->error = 1;
+}
+
+#ifdef __linux__
+/*
+** Positioned write.  With O_DIRECT, anything that isn't aligned (the very
+** end of the output, mostly) goes through the page cache instead.
+*/
+static void output_pwrite(struct output *o, const unsigned char *src, size_t len, off_t offset) {
+  int buffered = o->direct &&
+    (((size_t)src | len | (size_t)offset) & (DIRECT_ALIGN - 1));
+  if(buffered) set_direct(fileno(o->f), 0);
+  while(len) {
+    ssize_t r = pwrite(fileno(o->f), src, len, offset);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) {
+      if(!r) errno = ENOSPC;
+      o->error = 1;
+      break;
+    }
+    src += r;
+    len -= r;
+    offset += r;
+  }
+  if(buffered) set_direct(fileno(o->f), 1);
+}
+#endif
+
+/*
+** Write "len" bytes at the current output position
+*/
+static void output_data(struct output *o, const unsigned char *src, size_t len) {
+#ifdef HAVE_IO_URING
+  if((o->mode == OUTMODE_URING) &&
+    !(o->direct && (((size_t)src | len | (size_t)o->writeoff) & (DIRECT_ALIGN - 1)))
+  ) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&o->ring);
+    if(!sqe) {
+      output_reap(o, 1);
+      sqe = uring_get_sqe(&o->ring);
+    }
+    if(!sqe) {
+      o->error = 1;
+      return;
+    }
+    uring_prep_rw(sqe, 1, fileno(o->f), src, len, o->writeoff, o->cur,
+      ((unsigned long long)len << 8) | (unsigned)o->cur);
+    o->busy[o->cur]++;
+    o->writeoff += len;
+    return;
+  }
+#endif
+#ifdef __linux__
+  if(o->sparse || o->direct || (o->mode == OUTMODE_URING)) {
+    output_pwrite(o, src, len, o->writeoff);
+    o->writeoff += len;
+    return;
+  }
+#endif
+  output_write(o, src, len);
+}
+
+#ifdef __linux__
+/*
+** Deal with the run of zeros ending at the current output position
+*/
+static void output_endzeros(struct output *o) {
+  off_t start = o->writeoff - o->zerolen;
+  if(!o->zerolen) return;
+  if(o->zerolen < SPARSE_MIN) {
+    output_pwrite(o, zeros, (size_t)o->zerolen, start);
+  } else if(start < o->prealloc) {
+    /* Give back the space preallocated for it */
+    off_t end = o->writeoff < o->prealloc ? o->writeoff : o->prealloc;
+    fallocate(fileno(o->f), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+      start, end - start);
+  }
+  o->zerolen = 0;
+}
+
+/*
+** Write out a buffer, skipping whole blocks of zeros
+*/
+static void output_scan(struct output *o, const unsigned char *src, size_t len) {
+  size_t start = 0;
+  size_t i = 0;
+  while(i < len) {
+    size_t b = SPARSE_BLOCK - (size_t)((o->writeoff + (i - start)) % SPARSE_BLOCK);
+    if(b > len - i) b = len - i;
+    if((b == SPARSE_BLOCK) && !memcmp(src + i, zeros, SPARSE_BLOCK)) {
+      if(i > start) {
+        output_endzeros(o);
+        output_data(o, src + start, i - start);
+      }
+      o->zerolen += b;
+      o->writeoff += b;
+      start = i + b;
+    }
+    i += b;
+  }
+  if(len > start) {
+    output_endzeros(o);
+    output_data(o, src + start, len - start);
+  }
+}
+#endif
+
+#ifdef __linux__
+/*
+** Start writeback of what's been written since last time, once there's
+** enough of it, and wait for the batch before that.  That keeps the amount
+** of dirty data bounded however large the output gets, without waiting for
+** anything that was just written.  With "ECMIO_NOCACHE", batches that have
+** been written back are dropped from the cache; they end on a multiple of
+** WRITEBEHIND so large folios aren't split between them.  At the end
+** ("all"), only the dropping needs doing.
+*/
+static void output_writebehind(struct output *o, int all) {
+  int fd = fileno(o->f);
+  off_t upto = o->writeoff & ~(off_t)(WRITEBEHIND - 1);
+  if(!o->writebehind) return;
+  if(all) {
+    if(o->drop) {
+      sync_file_range(fd, o->waited, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, o->waited, 0, POSIX_FADV_DONTNEED);
+    }
+    return;
+  }
+  if(upto <= o->synced) return;
+  sync_file_range(fd, o->synced, upto - o->synced, SYNC_FILE_RANGE_WRITE);
+  if(o->synced > o->waited) {
+    sync_file_range(fd, o->waited, o->synced - o->waited,
+      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+      SYNC_FILE_RANGE_WAIT_AFTER);
+    if(o->drop) {
+      posix_fadvise(fd, o->waited, o->synced - o->waited, POSIX_FADV_DONTNEED);
+    }
+  }
+  o->waited = o->synced;
+  o->synced = upto;
+}
+#endif
+
+/*
+** Hand the staged data to the output.  Unless "all" is set, sparse and
+** O_DIRECT output hold back the part of the last file block that's in the
+** buffer and carry it over to the next one, so runs of zeros don't get
+** split where buffers meet and writes stay aligned.
+*/
+static void output_flushbuf(struct output *o, int all) {
+  const unsigned char *tail = NULL;
+  size_t keep = 0;
+  if(!o->fill) return;
+#ifdef __linux__
+  if(o->sparse || o->direct) {
+    if(!all) {
+      keep = (size_t)((o->writeoff + o->fill) % SPARSE_BLOCK);
+      if(keep >= o->fill) keep = 0;
+    }
+    tail = o->buf + o->fill - keep;
+  }
+  if(o->sparse) {
+    output_scan(o, o->buf, o->fill - keep);
+  } else
+#endif
+  {
+    output_data(o, o->buf, o->fill - keep);
+  }
+  o->fill = keep;
+  (void)all;
+#ifdef __linux__
+  output_writebehind(o, 0);
+#endif
+#ifdef HAVE_IO_URING
+  if(o->mode == OUTMODE_URING) {
+    if(++o->queued >= OUTPUT_BATCH) output_reap(o, 0);
+    o->cur = (o->cur + 1) % o->nbufs;
+    o->buf = o->mem[o->cur];
+    while(o->busy[o->cur]) output_reap(o, 1);
+    if(keep) memcpy(o->buf, tail, keep);
+    return;
+  }
+#endif
+  if(keep) memmove(o->buf, tail, keep);
+  if(o->nbufs > 1) {
+    o->cur = (o->cur + 1) % o->nbufs;
+    o->buf = o->mem[o->cur];
+  }
+}
+
+/*
+** Get room for "size" (<= 2352) contiguous bytes of output
+*/
+unsigned char *output_reserve(struct output *o, size_t size) {
+  if(o->bufsize - o->fill >= size) {
+    o->inbounce = 0;
+    return o->buf + o->fill;
+  }
+  o->inbounce = 1;
+  return o->bounce + OUTPUT_HEADROOM;
+}
+
+/*
+** Append "size" bytes to the output
+*/
+void output_put(struct output *o, const void *src, size_t size) {
+  const unsigned char *s = src;
+  o->total += size;
+  while(size) {
+    size_t b = o->bufsize - o->fill;
+    if(b > size) b = size;
+    memcpy(o->buf + o->fill, s, b);
+    o->fill += b;
+    s += b;
+    size -= b;
+    if(o->fill == o->bufsize) output_flushbuf(o, 0);
+  }
+}
+
+/*
+** Append "n" zero bytes; sparse output just leaves a hole for them
+*/
+void output_zeros(struct output *o, off_t n) {
+#ifdef __linux__
+  if(o->sparse && (n >= SPARSE_MIN)) {
+    /* Pad up to a block boundary, so what follows the hole stays aligned */
+    size_t head = (size_t)((SPARSE_BLOCK - (o->writeoff + o->fill) % SPARSE_BLOCK) % SPARSE_BLOCK);
+    off_t whole;
+    output_put(o, zeros, head);
+    n -= head;
+    output_flushbuf(o, 1);
+    whole = n - n % SPARSE_BLOCK;
+    o->zerolen += whole;
+    o->writeoff += whole;
+    o->total += whole;
+    n -= whole;
+  }
+#endif
+  while(n) {
+    size_t b = (n > SPARSE_MIN) ? SPARSE_MIN : (size_t)n;
+    output_put(o, zeros, b);
+    n -= b;
+  }
+}
+
+/*
+** Commit "size" bytes previously obtained from output_reserve
+*/
+void output_commit(struct output *o, size_t size) {
+  if(o->inbounce) {
+    o->inbounce = 0;
+    output_put(o, o->bounce + OUTPUT_HEADROOM, size);
+    return;
+  }
+  o->total += size;
+  o->fill += size;
+  if(o->fill == o->bufsize) output_flushbuf(o, 0);
+}
+
+#ifdef __linux__
+/*
+** Copy "len" bytes at "offset" in "fd" to the current output position in
+** the kernel.  Returns how many bytes were copied.
+*/
+static off_t output_copy(struct output *o, int fd, off_t offset, off_t len) {
+  int outfd = fileno(o->f);
+  off_t done = 0;
+  while(done < len && !o->error) {
+    loff_t inoff = offset + done;
+    size_t size = (len - done > 0x40000000) ? 0x40000000 : (size_t)(len - done);
+    ssize_t r;
+    if(o->mode == OUTMODE_SPLICE) {
+      r = splice(fd, &inoff, outfd, NULL, size, SPLICE_F_MOVE);
+    } else if(o->mode == OUTMODE_URING || o->sparse) {
+      loff_t outoff = o->writeoff;
+      r = copy_file_range(fd, &inoff, outfd, &outoff, size, 0);
+      if(r > 0) o->writeoff += r;
+    } else {
+      r = copy_file_range(fd, &inoff, outfd, NULL, size, 0);
+    }
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) {
+      /* Not supported between these two files; don't try again */
+      if(r < 0 && !done) o->nopassthrough = 1;
+      break;
+    }
+    done += r;
+  }
+  return done;
+}
+#endif
+
+/*
+** Copy "len" bytes at "offset" in the regular file "fd" straight to the
+** output, without them passing through user space: copy_file_range() into a
+** regular file (which may even share the blocks), splice() into a pipe.
+** "data" is a view of the same bytes, which sparse output scans for zeros.
+** Returns how many bytes were handled; the caller deals with the rest.
+**
+** Whatever is staged has to go out first.  For a pipe, that happens with a
+** plain copying write so the vmsplice rule above still holds: the spliced
+** data fills the whole pipe, so neither buffer is referenced afterwards.
+*/
+off_t output_passthrough(
+  struct output *o,
+  int fd,
+  off_t offset,
+  off_t len,
+  const unsigned char *data
+) {
+#ifdef __linux__
+  off_t done = 0;
+  if(o->error || o->nopassthrough || o->direct) return 0;
+  if(o->mode == OUTMODE_SPLICE) {
+    if(len < (off_t)o->bufsize) return 0;
+    if(o->fill) {
+      int mode = o->mode;
+      o->mode = OUTMODE_STDIO;
+      output_write(o, o->buf, o->fill);
+      o->mode = mode;
+      o->fill = 0;
+    }
+  } else {
+    output_flushbuf(o, 1);
+  }
+#ifdef HAVE_IO_URING
+  if(o->mode == OUTMODE_URING) {
+    int i;
+    for(i = 0; i < o->nbufs; i++) {
+      while(o->busy[i]) output_reap(o, 1);
+    }
+  }
+#endif
+  if(fflush(o->f)) o->error = 1;
+  if(o->sparse && data) {
+    /* Same as output_scan, but copying the data in between */
+    off_t start = 0;
+    off_t i = 0;
+    while(i < len) {
+      off_t b = SPARSE_BLOCK - (o->writeoff + (i - start)) % SPARSE_BLOCK;
+      if(b > len - i) b = len - i;
+      if((b == SPARSE_BLOCK) && !memcmp(data + i, zeros, SPARSE_BLOCK)) {
+        if(i > start) {
+          output_endzeros(o);
+          if(output_copy(o, fd, offset + start, i - start) < i - start) break;
+        }
+        o->zerolen += b;
+        o->writeoff += b;
+        start = i + b;
+      }
+      i += b;
+    }
+    done = start;
+    if(i >= len && len > start) {
+      output_endzeros(o);
+      done += output_copy(o, fd, offset + start, len - start);
+    }
+  } else {
+    done = output_copy(o, fd, offset, len);
+  }
+  if(o->mode == OUTMODE_SPLICE && done < (off_t)o->bufsize) {
+    /* The pipe may still hold pages of either buffer; stop using vmsplice */
+    o->mode = OUTMODE_STDIO;
+  }
+  o->total += done;
+  output_writebehind(o, 0);
+  return done;
+#else
+  (void)o; (void)fd; (void)offset; (void)len; (void)data;
+  return 0;
+#endif
+}
+
+/*
+** Reserve the space for the whole output of "size" bytes up front, so it
+** can be allocated in one piece (sparse output only, which writes at known
+** offsets and sets the final size itself)
+*/
+void output_preallocate(struct output *o, off_t size) {
+#ifdef __linux__
+  if(!o->sparse || size <= o->writeoff) return;
+  if(!fallocate(fileno(o->f), 0, o->writeoff, size - o->writeoff)) {
+    o->prealloc = size;
+  }
+#else
+  (void)o; (void)size;
+#endif
+}
+
+int output_close(struct output *o) {
+  int i;
+  output_flushbuf(o, 1);
+#ifdef __linux__
+  if(o->sparse) output_endzeros(o);
+#endif
+#ifdef HAVE_IO_URING
+  if(o->mode == OUTMODE_URING) {
+    for(i = 0; i < o->nbufs; i++) {
+      while(o->busy[i]) output_reap(o, 1);
+    }
+    uring_exit(&o->ring);
+    o->mode = OUTMODE_STDIO;
+  }
+#endif
+  if(fflush(o->f)) o->error = 1;
+#ifdef __linux__
+  /* Trailing holes, or less data than was preallocated */
+  if(o->sparse) {
+    if(ftruncate(fileno(o->f), o->writeoff)) o->error = 1;
+  }
+  output_writebehind(o, 1);
+#endif
+  for(i = 0; i < o->nbufs; i++) {
+    free_buffer(o->mem[i]);
+    o->mem[i] = NULL;
+  }
+  return o->error;
+}
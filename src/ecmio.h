@@ -0,0 +1,249 @@
+/***************************************************************************/
+/*
+** ECMIO - I/O backends shared by ECM and UNECM
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __ECMIO_H__
+#define __ECMIO_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+/***************************************************************************/
+/*
+** Minimal io_uring wrapper, talking to the kernel directly so there's
+** nothing extra to link against
+*/
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned pending;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+int uring_register_buffers(struct uring *r, const void *iov, unsigned count);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait);
+int uring_peek(struct uring *r, unsigned long long *user_data, int *res);
+void uring_exit(struct uring *r);
+#endif
+
+/***************************************************************************/
+
+#define ECMIO_URING   (1)
+#define ECMIO_SPARSE  (2)
+#define ECMIO_DIRECT  (4)
+#define ECMIO_NOCACHE (8)
+
+/* What O_DIRECT needs offsets, lengths and buffers aligned to */
+#define DIRECT_ALIGN (4096)
+
+/***************************************************************************/
+/*
+** Page cache advice for a file that's read from front to back: readahead
+** well in front of the reader, and with "ECMIO_NOCACHE", dropping whatever
+** the reader is done with.  "map" is an optional mapping of the whole file,
+** whose pages have to be let go of before they can be dropped.
+*/
+#define CACHEADVICE_STEP (4 * 1048576)
+
+struct cacheadvice {
+  int fd;
+  int drop;
+  const unsigned char *map;
+  off_t ahead;
+  off_t dropped;
+};
+
+void cacheadvice_init(struct cacheadvice *a, int fd, off_t pos, int flags);
+void cacheadvice_update(struct cacheadvice *a, off_t readpos, off_t donepos);
+void cacheadvice_done(struct cacheadvice *a, off_t end);
+
+/***************************************************************************/
+/*
+** Sequential input
+**
+** Plain stdio, or with "ECMIO_URING", a ring of registered buffers with
+** several reads in flight ahead of the consumer.  "ECMIO_DIRECT" reads with
+** O_DIRECT, bypassing the page cache.
+*/
+
+#define INPUT_MAXCHUNKS (32)
+
+struct input {
+  FILE *f;
+  off_t pos;
+  int regular;
+  off_t size;
+  int direct;
+  unsigned char *pool;
+  size_t chunksize;
+  unsigned nchunks;
+  off_t chunkpos[INPUT_MAXCHUNKS];
+  size_t chunklen[INPUT_MAXCHUNKS];
+  unsigned head;
+  size_t headoff;
+  off_t nextread;
+  int error;
+  struct cacheadvice advice;
+  off_t nextadvice;
+#ifdef HAVE_IO_URING
+  int useuring;
+  struct uring ring;
+  int chunkbusy[INPUT_MAXCHUNKS];
+  unsigned inflight;
+#endif
+};
+
+int set_direct(int fd, int on);
+int input_open(struct input *in, FILE *f, int flags);
+int input_getc(struct input *in);
+size_t input_read(struct input *in, void *dest, size_t size);
+void input_skip(struct input *in, off_t len);
+void input_close(struct input *in);
+
+/***************************************************************************/
+/*
+** Asynchronous reads into caller-supplied memory (the encoder's analysis
+** window), completed in file order
+*/
+#ifdef HAVE_IO_URING
+#define READAHEAD_MAXDEPTH (64)
+
+struct readahead {
+  struct uring ring;
+  int fd;
+  int registered;
+  off_t total;
+  off_t submitpos;
+  off_t readpos;
+  unsigned head;
+  unsigned count;
+  struct {
+    unsigned char *dest;
+    off_t pos;
+    size_t len;
+    size_t done;
+    int busy;
+  } slot[READAHEAD_MAXDEPTH];
+  int error;
+};
+
+int readahead_init(struct readahead *ra, int fd, off_t total,
+  unsigned char *base, size_t size);
+void readahead_submit(struct readahead *ra, unsigned char *dest, size_t len);
+off_t readahead_complete(struct readahead *ra, off_t want);
+void readahead_exit(struct readahead *ra);
+#endif
+
+/***************************************************************************/
+/*
+** Read-only mapping of part of a file.  view_map() fails if the part runs
+** past the end of the file, where touching the mapping would fault.
+*/
+struct view {
+  void *base;
+  size_t size;
+  const unsigned char *data;
+};
+
+int view_map(struct view *v, int fd, off_t offset, size_t len);
+void view_unmap(struct view *v);
+
+/***************************************************************************/
+/*
+** Output stream
+**
+** Data is staged in large buffers that are handed to the output in one go:
+** with fwrite(), with vmsplice() when the output is a pipe on Linux, or as
+** batched io_uring writes from registered buffers with "ECMIO_URING".
+**
+** With "ECMIO_SPARSE", long runs of zeros aren't written to a regular file
+** at all but left as holes.  "ECMIO_DIRECT" writes a regular file with
+** O_DIRECT, from aligned buffers at aligned offsets.  Otherwise, writeback
+** of a regular file is started as the output grows, and with
+** "ECMIO_NOCACHE" what's been written back is dropped from the cache.
+*/
+#define OUTPUT_HEADROOM (16)
+#define OUTPUT_BUFSIZE  (1048576)
+#define OUTPUT_MAXBUFS  (8)
+
+struct output {
+  FILE *f;
+  int mode;
+  unsigned char *mem[OUTPUT_MAXBUFS];
+  int nbufs;
+  unsigned char *buf;
+  size_t bufsize;
+  size_t fill;
+  int cur;
+  unsigned char bounce[OUTPUT_HEADROOM + 2352];
+  int inbounce;
+  off_t total;
+  int error;
+  int nopassthrough;
+  int regular;
+  int sparse;
+  int direct;
+  off_t writeoff;
+  off_t zerolen;
+  off_t prealloc;
+  int writebehind;
+  int drop;
+  off_t synced;
+  off_t waited;
+#ifdef HAVE_IO_URING
+  struct uring ring;
+  int busy[OUTPUT_MAXBUFS];
+  unsigned queued;
+#endif
+};
+
+int output_open(struct output *o, FILE *f, int flags);
+unsigned char *output_reserve(struct output *o, size_t size);
+void output_commit(struct output *o, size_t size);
+void output_put(struct output *o, const void *src, size_t size);
+void output_zeros(struct output *o, off_t n);
+off_t output_passthrough(struct output *o, int fd, off_t offset, off_t len,
+  const unsigned char *data);
+void output_preallocate(struct output *o, off_t size);
+int output_close(struct output *o);
+
+#endif
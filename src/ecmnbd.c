@@ -0,0 +1,442 @@
+/***************************************************************************/
+/*
+** ECMNBD - Serve the image in an ECM file over the NBD protocol
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecmnbd.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/***************************************************************************/
+/*
+** The protocol, as far as a read-only server needs it; all numbers on the
+** wire are big endian
+*/
+#define NBD_MAGIC        (0x4E42444D41474943ULL) /* "NBDMAGIC" */
+#define NBD_IHAVEOPT     (0x49484156454F5054ULL) /* "IHAVEOPT" */
+#define NBD_REPLY_MAGIC  (0x0003E889045565A9ULL)
+#define NBD_REQUEST      (0x25609513)
+#define NBD_SIMPLE_REPLY (0x67446698)
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_READ_ONLY      (1 << 1)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+#define NBD_OPT_EXPORT_NAME (1)
+#define NBD_OPT_ABORT       (2)
+#define NBD_OPT_LIST        (3)
+#define NBD_OPT_INFO        (6)
+#define NBD_OPT_GO          (7)
+
+#define NBD_REP_ACK       (1)
+#define NBD_REP_SERVER    (2)
+#define NBD_REP_INFO      (3)
+#define NBD_REP_ERR_UNSUP (0x80000001)
+#define NBD_REP_ERR_INVALID (0x80000003)
+
+#define NBD_INFO_EXPORT (0)
+
+#define NBD_CMD_READ  (0)
+#define NBD_CMD_WRITE (1)
+#define NBD_CMD_DISC  (2)
+#define NBD_CMD_FLUSH (3)
+
+#define NBD_EPERM  (1)
+#define NBD_EIO    (5)
+#define NBD_ENOMEM (12)
+#define NBD_EINVAL (22)
+
+/* Longest option and read this server takes */
+#define NBD_MAX_OPTION (4096)
+#define NBD_MAX_READ   (33554432)
+
+#define NBD_FLAGS (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN)
+
+static void put16(unsigned char *b, unsigned v) {
+  b[0] = (unsigned char)(v >> 8);
+  b[1] = (unsigned char)v;
+}
+
+static void put32(unsigned char *b, uint32_t v) {
+  put16(b, (unsigned)(v >> 16));
+  put16(b + 2, (unsigned)v);
+}
+
+static void put64(unsigned char *b, uint64_t v) {
+  put32(b, (uint32_t)(v >> 32));
+  put32(b + 4, (uint32_t)v);
+}
+
+static unsigned get16(const unsigned char *b) {
+  return ((unsigned)b[0] << 8) | b[1];
+}
+
+static uint32_t get32(const unsigned char *b) {
+  return ((uint32_t)get16(b) << 16) | get16(b + 2);
+}
+
+static uint64_t get64(const unsigned char *b) {
+  return ((uint64_t)get32(b) << 32) | get32(b + 4);
+}
+
+static int recv_all(int fd, void *buf, size_t n) {
+  unsigned char *b = buf;
+  while(n) {
+    ssize_t got = read(fd, b, n);
+    if(got < 0 && errno == EINTR) continue;
+    if(got <= 0) return 1;
+    b += got;
+    n -= (size_t)got;
+  }
+  return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t n) {
+  const unsigned char *b = buf;
+  while(n) {
+    ssize_t put = write(fd, b, n);
+    if(put < 0 && errno == EINTR) continue;
+    if(put <= 0) return 1;
+    b += put;
+    n -= (size_t)put;
+  }
+  return 0;
+}
+
+static int option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t len) {
+  unsigned char b[20];
+  put64(b, NBD_REPLY_MAGIC);
+  put32(b + 8, option);
+  put32(b + 12, type);
+  put32(b + 16, len);
+  return send_all(fd, b, 20) || (len && send_all(fd, data, len));
+}
+
+/*
+** The handshake, up to where the client has picked the export.  Returns
+** nonzero if it hasn't, and the connection should be closed.
+*/
+static int handshake(int fd, const struct ecm_reader *r) {
+  unsigned char b[NBD_MAX_OPTION];
+  uint64_t size = (uint64_t)r->idx.imagesize;
+  uint32_t flags;
+  put64(b, NBD_MAGIC);
+  put64(b + 8, NBD_IHAVEOPT);
+  put16(b + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  if(send_all(fd, b, 18) || recv_all(fd, b, 4)) return 1;
+  flags = get32(b);
+  if(!(flags & NBD_FLAG_FIXED_NEWSTYLE)) return 1;
+  for(;;) {
+    uint32_t option, len;
+    if(recv_all(fd, b, 16) || (get64(b) != NBD_IHAVEOPT)) return 1;
+    option = get32(b + 8);
+    len = get32(b + 12);
+    if(len > sizeof(b)) return 1;
+    if(recv_all(fd, b, len)) return 1;
+    switch(option) {
+    case NBD_OPT_EXPORT_NAME:
+      put64(b, size);
+      put16(b + 8, NBD_FLAGS);
+      memset(b + 10, 0, 124);
+      return send_all(fd, b, (flags & NBD_FLAG_NO_ZEROES) ? 10 : 134);
+    case NBD_OPT_ABORT:
+      option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+      return 1;
+    case NBD_OPT_LIST:
+      /* The one export, with an empty name */
+      memset(b, 0, 4);
+      if(
+        option_reply(fd, option, NBD_REP_SERVER, b, 4) ||
+        option_reply(fd, option, NBD_REP_ACK, NULL, 0)
+      ) return 1;
+      break;
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO:
+      /* The export name and the list of information asked for */
+      if(
+        (len < 6) || (get32(b) > len - 6) ||
+        (len != 6 + get32(b) + 2 * get16(b + 4 + get32(b)))
+      ) {
+        if(option_reply(fd, option, NBD_REP_ERR_INVALID, NULL, 0)) return 1;
+        break;
+      }
+      put16(b, NBD_INFO_EXPORT);
+      put64(b + 2, size);
+      put16(b + 10, NBD_FLAGS);
+      if(
+        option_reply(fd, option, NBD_REP_INFO, b, 12) ||
+        option_reply(fd, option, NBD_REP_ACK, NULL, 0)
+      ) return 1;
+      if(option == NBD_OPT_GO) return 0;
+      break;
+    default:
+      if(option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0)) return 1;
+      break;
+    }
+  }
+}
+
+/***************************************************************************/
+/*
+** A connection, once it's past the handshake.  Its thread reads requests
+** and queues the reads, and the workers take them off the queue, so a
+** client with several requests in flight has them reconstructed at the
+** same time, and each answered as soon as it's done.  Replies are sent
+** whole under "sendlock", in whatever order they're ready; the handles
+** tell the client which is which.
+*/
+struct request {
+  struct request *next;
+  unsigned char handle[8];
+  uint64_t offset;
+  uint32_t len;
+};
+
+struct connection {
+  const struct ecm_reader *r;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct request *first;
+  struct request **last;
+  int done;
+  pthread_mutex_t sendlock;
+};
+
+static int simple_reply(struct connection *c, const unsigned char *handle, uint32_t error, const void *data, size_t len) {
+  unsigned char b[16];
+  int r;
+  put32(b, NBD_SIMPLE_REPLY);
+  put32(b + 4, error);
+  memcpy(b + 8, handle, 8);
+  pthread_mutex_lock(&c->sendlock);
+  r = send_all(c->fd, b, 16) || (len && send_all(c->fd, data, len));
+  pthread_mutex_unlock(&c->sendlock);
+  return r;
+}
+
+static void *worker(void *arg) {
+  struct connection *c = arg;
+  for(;;) {
+    struct request *q;
+    unsigned char *buf;
+    pthread_mutex_lock(&c->lock);
+    while(!c->first && !c->done) pthread_cond_wait(&c->wake, &c->lock);
+    q = c->first;
+    if(!q) {
+      pthread_mutex_unlock(&c->lock);
+      return NULL;
+    }
+    c->first = q->next;
+    if(!c->first) c->last = &c->first;
+    pthread_mutex_unlock(&c->lock);
+    buf = malloc(q->len ? q->len : 1);
+    if(!buf) {
+      simple_reply(c, q->handle, NBD_ENOMEM, NULL, 0);
+    } else if(ecm_pread_image(c->r, buf, (off_t)q->offset, q->len) != (off_t)q->len) {
+      simple_reply(c, q->handle, NBD_EIO, NULL, 0);
+    } else {
+      simple_reply(c, q->handle, 0, buf, q->len);
+    }
+    free(buf);
+    free(q);
+  }
+}
+
+/*
+** Read requests until the client disconnects.  Anything that would change
+** the image is refused with EPERM (after taking in what was sent with it).
+*/
+static void transmission(struct connection *c) {
+  unsigned char b[28];
+  uint64_t size = (uint64_t)c->r->idx.imagesize;
+  for(;;) {
+    struct request *q;
+    unsigned type;
+    uint64_t offset;
+    uint32_t len;
+    if(recv_all(c->fd, b, 28) || (get32(b) != NBD_REQUEST)) return;
+    type = get16(b + 6);
+    offset = get64(b + 16);
+    len = get32(b + 24);
+    switch(type) {
+    case NBD_CMD_READ:
+      if((offset > size) || (len > size - offset) || (len > NBD_MAX_READ)) {
+        if(simple_reply(c, b + 8, NBD_EINVAL, NULL, 0)) return;
+        break;
+      }
+      q = malloc(sizeof(*q));
+      if(!q) {
+        if(simple_reply(c, b + 8, NBD_ENOMEM, NULL, 0)) return;
+        break;
+      }
+      q->next = NULL;
+      memcpy(q->handle, b + 8, 8);
+      q->offset = offset;
+      q->len = len;
+      pthread_mutex_lock(&c->lock);
+      *c->last = q;
+      c->last = &q->next;
+      pthread_cond_signal(&c->wake);
+      pthread_mutex_unlock(&c->lock);
+      break;
+    case NBD_CMD_DISC:
+      return;
+    case NBD_CMD_FLUSH:
+      /* Nothing is ever written */
+      if(simple_reply(c, b + 8, 0, NULL, 0)) return;
+      break;
+    case NBD_CMD_WRITE:
+      while(len) {
+        unsigned char skip[4096];
+        uint32_t n = (len < sizeof(skip)) ? len : (uint32_t)sizeof(skip);
+        if(recv_all(c->fd, skip, n)) return;
+        len -= n;
+      }
+      if(simple_reply(c, b + 8, NBD_EPERM, NULL, 0)) return;
+      break;
+    default:
+      if(simple_reply(c, b + 8, NBD_EINVAL, NULL, 0)) return;
+      break;
+    }
+  }
+}
+
+static void *connection_thread(void *arg) {
+  struct connection *c = arg;
+  pthread_t workers[ECMNBD_WORKERS];
+  int n = 0;
+  if(!handshake(c->fd, c->r)) {
+    for(n = 0; n < ECMNBD_WORKERS; n++) {
+      if(pthread_create(workers + n, NULL, worker, c)) break;
+    }
+    if(n) transmission(c);
+    /* Let the reads already asked for finish, then stop */
+    pthread_mutex_lock(&c->lock);
+    c->done = 1;
+    pthread_cond_broadcast(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    while(n) pthread_join(workers[--n], NULL);
+  }
+  close(c->fd);
+  pthread_cond_destroy(&c->wake);
+  pthread_mutex_destroy(&c->lock);
+  pthread_mutex_destroy(&c->sendlock);
+  free(c);
+  return NULL;
+}
+
+/***************************************************************************/
+
+int ecmnbd_serve(const struct ecm_reader *r, const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int s;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  /* A client going away mid-reply is only the end of that connection */
+  signal(SIGPIPE, SIG_IGN);
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s < 0) {
+    perror("socket");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  /* Only a socket left over from before is ours to replace */
+  if(!lstat(path, &st)) {
+    if(!S_ISSOCK(st.st_mode)) {
+      errno = EADDRINUSE;
+      perror(path);
+      close(s);
+      return 1;
+    }
+    unlink(path);
+  }
+  if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 16)) {
+    perror(path);
+    close(s);
+    return 1;
+  }
+  for(;;) {
+    struct connection *c;
+    pthread_t t;
+    int fd = accept(s, NULL, NULL);
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    c = calloc(1, sizeof(*c));
+    if(!c) {
+      close(fd);
+      continue;
+    }
+    c->r = r;
+    c->fd = fd;
+    c->last = &c->first;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    pthread_mutex_init(&c->sendlock, NULL);
+    if(pthread_create(&t, NULL, connection_thread, c)) {
+      close(fd);
+      pthread_cond_destroy(&c->wake);
+      pthread_mutex_destroy(&c->lock);
+      pthread_mutex_destroy(&c->sendlock);
+      free(c);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  close(s);
+  unlink(path);
+  return 1;
+}
+
+#else
+
+int ecmnbd_serve(const struct ecm_reader *r, const char *path) {
+  (void)r;
+  (void)path;
+  fprintf(stderr, "NBD serving needs Unix sockets and threads\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/***************************************************************************/
+/*
+** ECMNBD - Serve the image in an ECM file over the NBD protocol
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __ECMNBD_H__
+#define __ECMNBD_H__
+
+#include "ecmread.h"
+
+/*
+** Serve the image of "r", read-only, to NBD clients (nbd-client, qemu,
+** nbdkit's tools) connecting to the Unix socket at "path", until the
+** process is stopped.  Only the fixed newstyle handshake is spoken, and
+** any export name gives the image.  Each connection has ECMNBD_WORKERS
+** threads, so a client's requests in flight are reconstructed at once and
+** answered as each is done.  Returns nonzero, after saying what went
+** wrong, if the socket can't be set up, or threads aren't there.
+*/
+#define ECMNBD_WORKERS (4)
+
+int ecmnbd_serve(const struct ecm_reader *r, const char *path);
+
+#endif
@@ -0,0 +1,1092 @@
+/***************************************************************************/
+/*
+** ECMREAD - Random access to the image in an ECM file
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#if defined(SYS_userfaultfd) && defined(UFFDIO_COPY)
+#define READER_MAP
+#endif
+#endif
+
+#include "ecmread.h"
+
+#ifndef O_BINARY
+#define O_BINARY (0)
+#endif
+
+/***************************************************************************/
+/*
+** Read "n" bytes at "pos" without touching the file offset, so readers on
+** other threads don't get in each other's way.  Returns how many bytes were
+** read (fewer at the end of the file), or -1 on error.
+*/
+static long read_at(int fd, unsigned char *buf, size_t n, off_t pos) {
+  size_t done = 0;
+  while(done < n) {
+#ifdef _WIN32
+    OVERLAPPED o;
+    DWORD got;
+    memset(&o, 0, sizeof(o));
+    o.Offset = (DWORD)(pos + done);
+    o.OffsetHigh = (DWORD)((unsigned long long)(pos + done) >> 32);
+    if(!ReadFile((HANDLE)_get_osfhandle(fd), buf + done, (DWORD)(n - done), &got, &o)) {
+      if(GetLastError() == ERROR_HANDLE_EOF) break;
+      return -1;
+    }
+#else
+    ssize_t got = pread(fd, buf + done, n - done, pos + (off_t)done);
+    if(got < 0) return -1;
+#endif
+    if(!got) break;
+    done += (size_t)got;
+  }
+  return (long)done;
+}
+
+/*
+** The part of the ECM file being worked on.  Reads go forward, so one read
+** usually covers a whole request; if not, the next piece replaces it.
+*/
+#define SPAN_MIN (16384)
+#define SPAN_MAX (4194304)
+
+struct span {
+  int fd;
+  off_t base;
+  size_t len;
+  size_t size;
+  unsigned char *buf;
+};
+
+static const unsigned char *span_get(struct span *s, off_t pos, size_t n) {
+  long got;
+  if((pos >= s->base) && (pos + (off_t)n <= s->base + (off_t)s->len)) {
+    return s->buf + (pos - s->base);
+  }
+  got = read_at(s->fd, s->buf, s->size, pos);
+  if(got < (long)n) return NULL;
+  s->base = pos;
+  s->len = (size_t)got;
+  return s->buf;
+}
+
+/*
+** Read the record header at p->file (see ecmpos_header).  Returns 1 at the
+** end of the records, or -1 if the file ends or the header makes no sense.
+*/
+static int span_header(struct span *s, struct ecmpos *p) {
+  const unsigned char *b;
+  unsigned bits = 5;
+  off_t num;
+  if(!(b = span_get(s, p->file++, 1))) return -1;
+  p->type = *b & 3;
+  num = (*b >> 2) & 0x1F;
+  while(*b & 0x80) {
+    if((bits > 56) || !(b = span_get(s, p->file++, 1))) return -1;
+    num |= ((off_t)(*b & 0x7F)) << bits;
+    bits += 7;
+  }
+  if(num == 0xFFFFFFFF) return 1;
+  p->left = num + 1;
+  return 0;
+}
+
+/*
+** Move on to the unit that "offset" in the image is in; only the record
+** headers on the way are read.  Returns nonzero if the file isn't right.
+*/
+static int span_find(struct span *s, struct ecmpos *p, off_t offset) {
+  for(;;) {
+    off_t usz = ecm_unit_image[p->type];
+    off_t u;
+    if(offset < p->image) return 1;
+    u = (offset - p->image) / usz;
+    if(u < p->left) {
+      p->file += u * ecm_unit_file[p->type];
+      p->image += u * usz;
+      p->left -= u;
+      return 0;
+    }
+    p->file += p->left * ecm_unit_file[p->type];
+    p->image += p->left * usz;
+    p->left = 0;
+    if(span_header(s, p)) return 1;
+  }
+}
+
+/*
+** Put the image from "start" to "end" in "dest", going on from the unit at
+** "p", which "start" must be in.  "p" is left where "end" is, so the next
+** call can go on from there.  Sectors are only fully reconstructed if
+** "full"; otherwise just their sync and header are, for cooking.  Returns
+** nonzero if the file isn't right.
+*/
+static int span_image(
+  struct span *s,
+  struct ecmpos *p,
+  off_t start,
+  off_t end,
+  unsigned char *dest,
+  int full
+) {
+  unsigned char sector[2352];
+  off_t pos = start;
+  while(pos < end) {
+    const unsigned char *b;
+    if(!p->left) {
+      if(span_header(s, p)) return 1;
+      continue;
+    }
+    if(!p->type) {
+      size_t n = s->size;
+      if((off_t)n > p->left) n = (size_t)p->left;
+      if((off_t)n > end - pos) n = (size_t)(end - pos);
+      if(!(b = span_get(s, p->file, n))) return 1;
+      memcpy(dest + (pos - start), b, n);
+      p->file += n;
+      p->image += n;
+      p->left -= n;
+      pos += n;
+    } else {
+      const unsigned char *data = sector;
+      off_t usz = ecm_unit_image[p->type];
+      off_t to = end - p->image;
+      if(!(b = span_get(s, p->file, ecm_unit_file[p->type]))) return 1;
+      if(p->type == 1) {
+        memcpy(sector + 0x00C, b, 0x003);
+        memcpy(sector + 0x010, b + 0x003, 0x800);
+      } else {
+        memcpy(sector + 0x014, b, ecm_unit_file[p->type]);
+        data += 0x10;
+      }
+      if(full) {
+        ecm_sector_rebuild(sector, p->type);
+      } else if(p->type == 1) {
+        sector[0x00] = 0x00;
+        memset(sector + 1, 0xFF, 10);
+        sector[0x0B] = 0x00;
+        sector[0x0F] = 0x01;
+      }
+      if(to > usz) to = usz;
+      memcpy(dest + (pos - start), data + (pos - p->image), (size_t)(to - (pos - p->image)));
+      pos = p->image + to;
+      /* A sector cut short by "end" stays where it is, for the next call */
+      if(to < usz) break;
+      p->file += ecm_unit_file[p->type];
+      p->image += usz;
+      p->left--;
+    }
+  }
+  return 0;
+}
+
+static const unsigned char sync_pattern[12] = {
+  0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+
+/*
+** The user data of a raw sector, as UNECM --iso has it: after the header of
+** a mode 1 sector, or after the subheader of a mode 2 one
+*/
+static void cook(const unsigned char *raw, unsigned char *dest) {
+  if(!memcmp(raw, sync_pattern, sizeof(sync_pattern))) {
+    if(raw[0x0F] == 1) {
+      memcpy(dest, raw + 0x010, 2048);
+      return;
+    }
+    if(raw[0x0F] == 2) {
+      memcpy(dest, raw + 0x018, 2048);
+      return;
+    }
+  }
+  memset(dest, 0, 2048);
+}
+
+/***************************************************************************/
+/*
+** Locks, wake-ups and threads, for the cache and the prefetcher
+*/
+#if defined(_WIN32)
+#define READER_THREADS
+typedef CRITICAL_SECTION reader_lock;
+typedef CONDITION_VARIABLE reader_cond;
+typedef HANDLE reader_thread;
+#define lock_init(l)    InitializeCriticalSection(l)
+#define lock_free(l)    DeleteCriticalSection(l)
+#define lock_take(l)    EnterCriticalSection(l)
+#define lock_release(l) LeaveCriticalSection(l)
+#define cond_init(c)    InitializeConditionVariable(c)
+#define cond_free(c)    ((void)(c))
+#define cond_wait(c, l) SleepConditionVariableCS(c, l, INFINITE)
+#define cond_signal(c)  WakeConditionVariable(c)
+#elif defined(__unix__) || defined(__APPLE__)
+#define READER_THREADS
+typedef pthread_mutex_t reader_lock;
+typedef pthread_cond_t reader_cond;
+typedef pthread_t reader_thread;
+#define lock_init(l)    pthread_mutex_init(l, NULL)
+#define lock_free(l)    pthread_mutex_destroy(l)
+#define lock_take(l)    pthread_mutex_lock(l)
+#define lock_release(l) pthread_mutex_unlock(l)
+#define cond_init(c)    pthread_cond_init(c, NULL)
+#define cond_free(c)    pthread_cond_destroy(c)
+#define cond_wait(c, l) pthread_cond_wait(c, l)
+#define cond_signal(c)  pthread_cond_signal(c)
+#else
+/* Without threads, there's nothing to lock, and no prefetcher */
+typedef int reader_lock;
+typedef int reader_cond;
+typedef int reader_thread;
+#define lock_init(l)    ((void)(l))
+#define lock_free(l)    ((void)(l))
+#define lock_take(l)    ((void)(l))
+#define lock_release(l) ((void)(l))
+#define cond_init(c)    ((void)(c))
+#define cond_free(c)    ((void)(c))
+#define cond_wait(c, l) ((void)(c))
+#define cond_signal(c)  ((void)(c))
+#endif
+
+/***************************************************************************/
+/*
+** The sector cache.  Sectors are spread over the shards by LBA, so readers
+** going through neighbouring sectors don't wait on the same lock.  Each
+** shard is a fixed number of slots, found by LBA through a hash table, and
+** replaced with the CLOCK algorithm: the hand passes over slots that were
+** hit since it last came by (clearing their mark), and takes the first one
+** that wasn't.
+**
+** A cooked read only needs the sync and header of a sector, so sectors put
+** together for one are cached without their EDC and ECC; a raw read takes
+** those as a miss, and fills them in.
+*/
+#define CACHE_SHARDS (16)
+
+struct cache_slot {
+  off_t lba;
+  int next;
+  unsigned char hit;
+  unsigned char complete;
+};
+
+struct cache_shard {
+  reader_lock lock;
+  int size;
+  int used;
+  int hand;
+  unsigned mask;
+  int *bucket;
+  struct cache_slot *slot;
+  unsigned char *data;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct ecm_cache {
+  unsigned shards;
+  struct cache_shard shard[CACHE_SHARDS];
+};
+
+/* What a cached sector costs: the sector, its slot, and about two buckets */
+#define CACHE_SECTOR_BYTES (2352 + sizeof(struct cache_slot) + 2 * sizeof(int))
+
+static void cache_free(struct ecm_cache *c) {
+  unsigned k;
+  if(!c) return;
+  for(k = 0; k < c->shards; k++) {
+    struct cache_shard *sh = c->shard + k;
+    lock_free(&sh->lock);
+    free(sh->bucket);
+    free(sh->slot);
+    free(sh->data);
+  }
+  free(c);
+}
+
+static struct ecm_cache *cache_new(size_t sectors) {
+  struct ecm_cache *c;
+  unsigned k;
+  c = calloc(1, sizeof(*c));
+  if(!c) return NULL;
+  c->shards = (sectors < CACHE_SHARDS) ? (unsigned)sectors : CACHE_SHARDS;
+  for(k = 0; k < c->shards; k++) {
+    struct cache_shard *sh = c->shard + k;
+    unsigned b = 1;
+    int i;
+    sh->size = (int)(sectors / c->shards + (k < sectors % c->shards));
+    while(b < (unsigned)sh->size) b <<= 1;
+    sh->mask = b - 1;
+    lock_init(&sh->lock);
+    sh->bucket = malloc(b * sizeof(*sh->bucket));
+    sh->slot = malloc(sh->size * sizeof(*sh->slot));
+    sh->data = malloc((size_t)sh->size * 2352);
+    if(!sh->bucket || !sh->slot || !sh->data) {
+      c->shards = k + 1;
+      cache_free(c);
+      return NULL;
+    }
+    for(i = 0; i <= (int)sh->mask; i++) sh->bucket[i] = -1;
+  }
+  return c;
+}
+
+static struct cache_shard *cache_shard(struct ecm_cache *c, off_t lba, int **head) {
+  struct cache_shard *sh = c->shard + lba % c->shards;
+  *head = sh->bucket + ((uint64_t)(lba / c->shards) & sh->mask);
+  return sh;
+}
+
+/*
+** Give sector "lba" from the cache, raw or cooked, if it's there (and, for
+** a raw one, complete).  Returns nonzero on a hit.
+*/
+static int cache_get(struct ecm_cache *c, off_t lba, unsigned char *dest, int mode) {
+  int *head;
+  struct cache_shard *sh = cache_shard(c, lba, &head);
+  int i;
+  lock_take(&sh->lock);
+  for(i = *head; i >= 0; i = sh->slot[i].next) {
+    if(sh->slot[i].lba == lba) break;
+  }
+  if((i >= 0) && ((mode != ECM_RAW) || sh->slot[i].complete)) {
+    const unsigned char *raw = sh->data + (size_t)i * 2352;
+    sh->slot[i].hit = 1;
+    if(mode == ECM_RAW) memcpy(dest, raw, 2352);
+    else cook(raw, dest);
+    sh->hits++;
+    lock_release(&sh->lock);
+    return 1;
+  }
+  sh->misses++;
+  lock_release(&sh->lock);
+  return 0;
+}
+
+/*
+** Whether sector "lba" is in the cache (complete, for raw), without it
+** counting as a hit or a miss
+*/
+static int cache_has(struct ecm_cache *c, off_t lba, int mode) {
+  int *head;
+  struct cache_shard *sh = cache_shard(c, lba, &head);
+  int i;
+  lock_take(&sh->lock);
+  for(i = *head; i >= 0; i = sh->slot[i].next) {
+    if(sh->slot[i].lba == lba) break;
+  }
+  i = (i >= 0) && ((mode != ECM_RAW) || sh->slot[i].complete);
+  lock_release(&sh->lock);
+  return i;
+}
+
+/*
+** Keep raw sector "lba" in the cache, in place of the one the CLOCK hand
+** stops at if it's full
+*/
+static void cache_put(struct ecm_cache *c, off_t lba, const unsigned char *raw, int complete) {
+  int *head;
+  struct cache_shard *sh = cache_shard(c, lba, &head);
+  struct cache_slot *e;
+  int i;
+  lock_take(&sh->lock);
+  for(i = *head; i >= 0; i = sh->slot[i].next) {
+    if(sh->slot[i].lba == lba) break;
+  }
+  if(i >= 0) {
+    e = sh->slot + i;
+    if(complete && !e->complete) {
+      memcpy(sh->data + (size_t)i * 2352, raw, 2352);
+      e->complete = 1;
+    }
+    lock_release(&sh->lock);
+    return;
+  }
+  if(sh->used < sh->size) {
+    i = sh->used++;
+  } else {
+    int *p;
+    for(;;) {
+      i = sh->hand;
+      if(++sh->hand == sh->size) sh->hand = 0;
+      if(!sh->slot[i].hit) break;
+      sh->slot[i].hit = 0;
+    }
+    /* Take it out of its bucket */
+    cache_shard(c, sh->slot[i].lba, &p);
+    while(*p != i) p = &sh->slot[*p].next;
+    *p = sh->slot[i].next;
+  }
+  e = sh->slot + i;
+  e->lba = lba;
+  e->hit = 0;
+  e->complete = (unsigned char)complete;
+  e->next = *head;
+  *head = i;
+  memcpy(sh->data + (size_t)i * 2352, raw, 2352);
+  lock_release(&sh->lock);
+}
+
+/***************************************************************************/
+
+int ecm_open(struct ecm_reader *r, const char *ecmfile) {
+  char *path = ecmidx_path(ecmfile);
+  FILE *ecm = fopen(ecmfile, "rb");
+  FILE *f;
+  int bad = 1;
+  ecm_init();
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  if(!ecm) {
+    free(path);
+    return 1;
+  }
+  if(ecm2_probe(ecm)) {
+    r->v2 = malloc(sizeof(*r->v2));
+    if(!r->v2 || ecm2_load(r->v2, ecm)) {
+      free(r->v2);
+      r->v2 = NULL;
+      free(path);
+      fclose(ecm);
+      return 1;
+    }
+    r->idx.imagesize = r->v2->imagesize;
+    bad = 0;
+  } else {
+    f = fopen(path, "rb");
+    if(f) {
+      bad = ecmidx_load(&r->idx, f, ecm);
+      fclose(f);
+    }
+  }
+  free(path);
+  if(bad && ecmidx_build(&r->idx, ecm, ECMIDX_STEP)) {
+    fclose(ecm);
+    return 1;
+  }
+  fclose(ecm);
+  r->fd = open(ecmfile, O_RDONLY | O_BINARY);
+  if(r->fd < 0) {
+    ecmidx_free(&r->idx);
+    if(r->v2) ecm2_free(r->v2);
+    free(r->v2);
+    r->v2 = NULL;
+    return 1;
+  }
+  r->sectors = (r->idx.imagesize + 2351) / 2352;
+  return 0;
+}
+
+/*
+** The same for a v2 file, a chunk at a time.  Decoding a chunk puts all of
+** its sectors together, so they all go in the cache, not just those asked
+** for.
+*/
+static int reconstruct_chunks(const struct ecm_reader *r, unsigned char *dest, off_t lba, off_t count, int mode) {
+  const struct ecm2 *v = r->v2;
+  off_t per = v->chunksize / 2352;
+  unsigned char *image = malloc(v->chunksize);
+  unsigned char *data = NULL;
+  size_t size = 0;
+  off_t k;
+  if(!image) return 1;
+  for(k = lba / per; (k < v->count) && (k * per < lba + count); k++) {
+    const struct ecm2_chunk *c = v->chunk + k;
+    size_t len = ecm2_image(v, k);
+    off_t s;
+    if(size < c->len) {
+      free(data);
+      data = malloc(c->len);
+      size = data ? c->len : 0;
+      if(!data) goto fail;
+    }
+    if(
+      (read_at(r->fd, data, c->len, c->file) != (long)c->len) ||
+      ecm2_decode_chunk(v, k, data, image)
+    ) goto fail;
+    for(s = 0; s * 2352 < (off_t)len; s++) {
+      const unsigned char *raw = image + s * 2352;
+      off_t at = k * per + s;
+      size_t have = len - (size_t)s * 2352;
+      if(have > 2352) have = 2352;
+      if(r->cache && (have == 2352)) cache_put(r->cache, at, raw, 1);
+      if((at < lba) || (at >= lba + count)) continue;
+      if(mode == ECM_RAW) {
+        memcpy(dest + (at - lba) * 2352, raw, have);
+      } else if(have == 2352) {
+        cook(raw, dest + (at - lba) * 2048);
+      } else {
+        memset(dest + (at - lba) * 2048, 0, 2048);
+      }
+    }
+  }
+  free(data);
+  free(image);
+  return 0;
+fail:
+  free(data);
+  free(image);
+  return 1;
+}
+
+/*
+** Put together "count" sectors from "lba" on from the ECM file, raw or
+** cooked, and keep them in the cache.  Returns nonzero if the file isn't
+** right.
+*/
+static int reconstruct(const struct ecm_reader *r, unsigned char *dest, off_t lba, off_t count, int mode) {
+  const struct ecmidx *x = &r->idx;
+  unsigned char raw[2352];
+  struct ecmpos p;
+  struct span s;
+  off_t start = lba * 2352;
+  off_t end = start + count * 2352;
+  off_t k;
+  if(r->v2) return reconstruct_chunks(r, dest, lba, count, mode);
+  p = x->entry[lba / x->step];
+  if(end > x->imagesize) end = x->imagesize;
+  s.fd = r->fd;
+  s.base = 0;
+  s.len = 0;
+  s.size = (size_t)(end - p.image) + 4096;
+  if(s.size < SPAN_MIN) s.size = SPAN_MIN;
+  if(s.size > SPAN_MAX) s.size = SPAN_MAX;
+  s.buf = malloc(s.size);
+  if(!s.buf) return 1;
+  if(span_find(&s, &p, start)) goto fail;
+  if(mode == ECM_RAW) {
+    if(span_image(&s, &p, start, end, dest, 1)) goto fail;
+    if(r->cache) {
+      for(k = 0; start + (k + 1) * 2352 <= end; k++) {
+        cache_put(r->cache, lba + k, dest + k * 2352, 1);
+      }
+    }
+  } else {
+    for(k = 0; k < count; k++) {
+      off_t from = start + k * 2352;
+      if(from + 2352 > end) {
+        /* A partial sector at the end of the image isn't a data sector */
+        memset(dest + k * 2048, 0, 2048);
+        continue;
+      }
+      if(span_image(&s, &p, from, from + 2352, raw, 0)) goto fail;
+      cook(raw, dest + k * 2048);
+      if(r->cache) cache_put(r->cache, lba + k, raw, 0);
+    }
+  }
+  free(s.buf);
+  return 0;
+fail:
+  free(s.buf);
+  return 1;
+}
+
+/***************************************************************************/
+/*
+** The prefetcher.  Every read is matched against the last few streams of
+** reads: one that starts where a stream left off goes on with it, and
+** anything else starts a new stream in place of the one that's gone
+** longest without a read.  Once a stream has gone on for PREFETCH_RUN
+** reads, the prefetcher thread puts the "window" sectors after it in the
+** cache, and tops them up whenever the reads get through half of them.
+*/
+#define PREFETCH_STREAMS (8)
+#define PREFETCH_RUN     (2)
+#define PREFETCH_QUEUE   (16)
+#define PREFETCH_CHUNK   (64)
+
+struct prefetch_stream {
+  off_t next;
+  off_t ahead;
+  unsigned reads;
+  unsigned last;
+  int mode;
+};
+
+struct prefetch_job {
+  off_t lba;
+  off_t count;
+  int mode;
+};
+
+struct ecm_prefetch {
+  const struct ecm_reader *r;
+  reader_lock lock;
+  reader_cond wake;
+  reader_thread thread;
+  int stop;
+  off_t window;
+  unsigned clock;
+  struct prefetch_stream stream[PREFETCH_STREAMS];
+  struct prefetch_job job[PREFETCH_QUEUE];
+  unsigned first;
+  unsigned jobs;
+  uint64_t sectors;
+  unsigned char *buf;
+};
+
+static void prefetch_note(struct ecm_prefetch *pf, off_t lba, off_t count, int mode) {
+  struct prefetch_stream *s = NULL;
+  unsigned k;
+  lock_take(&pf->lock);
+  pf->clock++;
+  for(k = 0; k < PREFETCH_STREAMS; k++) {
+    struct prefetch_stream *t = pf->stream + k;
+    if(t->reads && (t->next == lba) && (t->mode == mode)) {
+      s = t;
+      break;
+    }
+  }
+  if(!s) {
+    s = pf->stream;
+    for(k = 1; k < PREFETCH_STREAMS; k++) {
+      if(pf->clock - pf->stream[k].last > pf->clock - s->last) s = pf->stream + k;
+    }
+    s->reads = 0;
+    s->ahead = 0;
+    s->mode = mode;
+  }
+  s->reads++;
+  s->last = pf->clock;
+  s->next = lba + count;
+  if(s->ahead < s->next) s->ahead = s->next;
+  if(
+    (s->reads >= PREFETCH_RUN) &&
+    (s->ahead - s->next <= pf->window / 2) &&
+    (s->ahead < pf->r->sectors) &&
+    (pf->jobs < PREFETCH_QUEUE)
+  ) {
+    struct prefetch_job *j = pf->job + (pf->first + pf->jobs++) % PREFETCH_QUEUE;
+    off_t to = s->next + pf->window;
+    if(to > pf->r->sectors) to = pf->r->sectors;
+    j->lba = s->ahead;
+    j->count = to - s->ahead;
+    j->mode = mode;
+    s->ahead = to;
+    cond_signal(&pf->wake);
+  }
+  lock_release(&pf->lock);
+}
+
+/*
+** The prefetcher thread: put the sectors of each job that aren't in the
+** cache yet in it, a chunk at a time, until told to stop
+*/
+static void prefetch_run(struct ecm_prefetch *pf) {
+  struct ecm_cache *c = pf->r->cache;
+  lock_take(&pf->lock);
+  while(!pf->stop) {
+    struct prefetch_job j;
+    if(!pf->jobs) {
+      cond_wait(&pf->wake, &pf->lock);
+      continue;
+    }
+    j = pf->job[pf->first];
+    pf->first = (pf->first + 1) % PREFETCH_QUEUE;
+    pf->jobs--;
+    while(j.count && !pf->stop) {
+      off_t n = (j.count < PREFETCH_CHUNK) ? j.count : PREFETCH_CHUNK;
+      off_t done = 0;
+      off_t k = 0;
+      lock_release(&pf->lock);
+      while(k < n) {
+        off_t m = 0;
+        while((k < n) && cache_has(c, j.lba + k, j.mode)) k++;
+        while((k + m < n) && !cache_has(c, j.lba + k + m, j.mode)) m++;
+        if(m && reconstruct(pf->r, pf->buf, j.lba + k, m, j.mode)) {
+          /* Whatever's wrong, the read itself will say so */
+          n = j.count;
+          break;
+        }
+        done += m;
+        k += m;
+      }
+      j.lba += n;
+      j.count -= n;
+      lock_take(&pf->lock);
+      pf->sectors += done;
+    }
+  }
+  lock_release(&pf->lock);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI prefetch_thread(LPVOID arg) {
+  prefetch_run(arg);
+  return 0;
+}
+#elif defined(READER_THREADS)
+static void *prefetch_thread(void *arg) {
+  prefetch_run(arg);
+  return NULL;
+}
+#endif
+
+static void prefetch_stop(struct ecm_reader *r) {
+  struct ecm_prefetch *pf = r->prefetch;
+  if(!pf) return;
+  lock_take(&pf->lock);
+  pf->stop = 1;
+  cond_signal(&pf->wake);
+  lock_release(&pf->lock);
+#if defined(_WIN32)
+  WaitForSingleObject(pf->thread, INFINITE);
+  CloseHandle(pf->thread);
+#elif defined(READER_THREADS)
+  pthread_join(pf->thread, NULL);
+#endif
+  cond_free(&pf->wake);
+  lock_free(&pf->lock);
+  free(pf->buf);
+  free(pf);
+  r->prefetch = NULL;
+}
+
+/***************************************************************************/
+
+off_t ecm_pread(const struct ecm_reader *r, void *buf, off_t lba, off_t count, int mode) {
+  unsigned char *dest = buf;
+  size_t size = (mode == ECM_RAW) ? 2352 : 2048;
+  off_t k;
+  if((lba < 0) || (count < 0)) return -1;
+  if((lba >= r->sectors) || !count) return 0;
+  if(count > r->sectors - lba) count = r->sectors - lba;
+  if(r->prefetch) prefetch_note(r->prefetch, lba, count, mode);
+  if(!r->cache) {
+    if(reconstruct(r, dest, lba, count, mode)) return -1;
+  } else {
+    /* Each run of sectors that aren't in the cache is put together at once */
+    for(k = 0; k < count;) {
+      off_t n = 0;
+      while((k + n < count) && !cache_get(r->cache, lba + k + n, dest + (k + n) * size, mode)) n++;
+      if(n && reconstruct(r, dest + k * size, lba + k, n, mode)) return -1;
+      k += n + 1;
+    }
+  }
+  if(mode != ECM_RAW) return count * 2048;
+  return ((lba + count) * 2352 > r->idx.imagesize) ? r->idx.imagesize - lba * 2352 : count * 2352;
+}
+
+/*
+** Bytes of the image go through ecm_pread() up to IMAGE_CHUNK sectors at a
+** time
+*/
+#define IMAGE_CHUNK (64)
+
+off_t ecm_pread_image(const struct ecm_reader *r, void *buf, off_t offset, size_t len) {
+  unsigned char *dest = buf;
+  unsigned char *sectors;
+  off_t size = r->idx.imagesize;
+  off_t done = 0;
+  if(offset < 0) return -1;
+  if((offset >= size) || !len) return 0;
+  if((off_t)len > size - offset) len = (size_t)(size - offset);
+  sectors = malloc(IMAGE_CHUNK * 2352);
+  if(!sectors) return -1;
+  while(done < (off_t)len) {
+    off_t pos = offset + done;
+    off_t first = pos / 2352;
+    off_t skip = pos - first * 2352;
+    off_t want = (off_t)len - done;
+    off_t count = (skip + want + 2351) / 2352;
+    off_t got;
+    if(count > IMAGE_CHUNK) count = IMAGE_CHUNK;
+    got = ecm_pread(r, sectors, first, count, ECM_RAW);
+    if(got <= skip) {
+      free(sectors);
+      return -1;
+    }
+    got -= skip;
+    if(got > want) got = want;
+    memcpy(dest + done, sectors + skip, (size_t)got);
+    done += got;
+  }
+  free(sectors);
+  return done;
+}
+
+int ecm_cache(struct ecm_reader *r, size_t bytes) {
+  size_t sectors = bytes / CACHE_SECTOR_BYTES;
+  prefetch_stop(r);
+  cache_free(r->cache);
+  r->cache = NULL;
+  /* Not even room for a sector is the same as no cache */
+  if(!sectors) return 0;
+  if(sectors > 0x10000000) sectors = 0x10000000;
+  r->cache = cache_new(sectors);
+  return !r->cache;
+}
+
+void ecm_cache_stats(const struct ecm_reader *r, struct ecm_cache_stats *st) {
+  unsigned k;
+  memset(st, 0, sizeof(*st));
+  if(!r->cache) return;
+  for(k = 0; k < r->cache->shards; k++) {
+    struct cache_shard *sh = r->cache->shard + k;
+    lock_take(&sh->lock);
+    st->hits += sh->hits;
+    st->misses += sh->misses;
+    st->size += (size_t)sh->size * 2352;
+    st->used += (size_t)sh->used * 2352;
+    lock_release(&sh->lock);
+  }
+  if(r->prefetch) {
+    lock_take(&r->prefetch->lock);
+    st->prefetched = r->prefetch->sectors;
+    lock_release(&r->prefetch->lock);
+  }
+}
+
+int ecm_prefetch(struct ecm_reader *r, off_t window) {
+  struct ecm_prefetch *pf;
+  prefetch_stop(r);
+  if(window <= 0) return 0;
+#ifndef READER_THREADS
+  (void)pf;
+  return 1;
+#else
+  if(!r->cache) return 1;
+  pf = calloc(1, sizeof(*pf));
+  if(!pf) return 1;
+  pf->buf = malloc(PREFETCH_CHUNK * 2352);
+  if(!pf->buf) {
+    free(pf);
+    return 1;
+  }
+  pf->r = r;
+  pf->window = window;
+  lock_init(&pf->lock);
+  cond_init(&pf->wake);
+#if defined(_WIN32)
+  pf->thread = CreateThread(NULL, 0, prefetch_thread, pf, 0, NULL);
+  if(!pf->thread) goto fail;
+#else
+  if(pthread_create(&pf->thread, NULL, prefetch_thread, pf)) goto fail;
+#endif
+  r->prefetch = pf;
+  return 0;
+fail:
+  cond_free(&pf->wake);
+  lock_free(&pf->lock);
+  free(pf->buf);
+  free(pf);
+  return 1;
+#endif
+}
+
+/***************************************************************************/
+/*
+** The image mapped into memory.  The mapping starts out empty, registered
+** with userfaultfd, so touching a page that isn't there yet stops the
+** thread that did it and sends the fault to the map thread instead.  That
+** reconstructs the block of MAP_BLOCK bytes the page is in and copies it
+** in, which lets the faulting thread go on.
+*/
+#define MAP_BLOCK (65536)
+
+#ifdef READER_MAP
+struct ecm_map {
+  const struct ecm_reader *r;
+  unsigned char *base;
+  size_t len;
+  size_t page;
+  size_t block;
+  int uffd;
+  int stop[2];
+  pthread_t thread;
+  unsigned char *buf;
+};
+
+/*
+** Put the image from "off" on in the block buffer.  What's past the end of
+** the image, or can't be reconstructed, is zeros.
+*/
+static void map_fill(struct ecm_map *m, size_t off, size_t n) {
+  off_t got = ecm_pread_image(m->r, m->buf, (off_t)off, n);
+  if(got < 0) got = 0;
+  memset(m->buf + got, 0, n - (size_t)got);
+}
+
+static void *map_thread(void *arg) {
+  struct ecm_map *m = arg;
+  struct pollfd pfd[2];
+  pfd[0].fd = m->uffd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = m->stop[0];
+  pfd[1].events = POLLIN;
+  for(;;) {
+    struct uffd_msg msg;
+    struct uffdio_copy copy;
+    struct uffdio_range wake;
+    size_t at, off, n;
+    if(poll(pfd, 2, -1) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(pfd[1].revents) break;
+    if(read(m->uffd, &msg, sizeof(msg)) != sizeof(msg)) continue;
+    if(msg.event != UFFD_EVENT_PAGEFAULT) continue;
+    at = (size_t)(msg.arg.pagefault.address - (uintptr_t)m->base);
+    off = at - at % m->block;
+    n = m->len - off;
+    if(n > m->block) n = m->block;
+    map_fill(m, off, n);
+    memset(&copy, 0, sizeof(copy));
+    copy.dst = (uintptr_t)(m->base + off);
+    copy.src = (uintptr_t)m->buf;
+    copy.len = n;
+    if(!ioctl(m->uffd, UFFDIO_COPY, &copy)) continue;
+    /* Some of the block is there already; fill in the rest page by page */
+    for(at = 0; at < n; at += m->page) {
+      memset(&copy, 0, sizeof(copy));
+      copy.dst = (uintptr_t)(m->base + off + at);
+      copy.src = (uintptr_t)(m->buf + at);
+      copy.len = m->page;
+      copy.mode = UFFDIO_COPY_MODE_DONTWAKE;
+      ioctl(m->uffd, UFFDIO_COPY, &copy);
+    }
+    wake.start = (uintptr_t)(m->base + off);
+    wake.len = n;
+    ioctl(m->uffd, UFFDIO_WAKE, &wake);
+  }
+  return NULL;
+}
+
+static void map_free(struct ecm_map *m) {
+  if(m->uffd >= 0) close(m->uffd);
+  if(m->stop[0] >= 0) close(m->stop[0]);
+  if(m->stop[1] >= 0) close(m->stop[1]);
+  if(m->base) munmap(m->base, m->len);
+  free(m->buf);
+  free(m);
+}
+
+void *ecm_map(struct ecm_reader *r) {
+  struct ecm_map *m;
+  struct uffdio_api api;
+  struct uffdio_register reg;
+  void *base;
+  if(r->map) return r->map->base;
+  if(!r->idx.imagesize) return NULL;
+  m = calloc(1, sizeof(*m));
+  if(!m) return NULL;
+  m->r = r;
+  m->uffd = -1;
+  m->stop[0] = m->stop[1] = -1;
+  m->page = (size_t)sysconf(_SC_PAGESIZE);
+  m->block = (m->page > MAP_BLOCK) ? m->page : MAP_BLOCK;
+  m->len = ((size_t)r->idx.imagesize + m->page - 1) / m->page * m->page;
+  m->buf = malloc(m->block);
+  if(!m->buf) goto fail;
+  base = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(base == MAP_FAILED) goto fail;
+  m->base = base;
+  m->uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+  /*
+  ** Without the privilege to handle faults in the kernel too, handle just
+  ** the ones from user space; system calls given the mapping as a buffer
+  ** then fail with EFAULT on pages that aren't there yet
+  */
+  if(m->uffd < 0) m->uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+  if(m->uffd < 0) goto fail;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  if(ioctl(m->uffd, UFFDIO_API, &api)) goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.range.start = (uintptr_t)m->base;
+  reg.range.len = m->len;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if(ioctl(m->uffd, UFFDIO_REGISTER, &reg)) goto fail;
+  if(pipe(m->stop)) {
+    m->stop[0] = m->stop[1] = -1;
+    goto fail;
+  }
+  if(pthread_create(&m->thread, NULL, map_thread, m)) goto fail;
+  r->map = m;
+  return m->base;
+fail:
+  map_free(m);
+  return NULL;
+}
+
+void ecm_unmap(struct ecm_reader *r) {
+  struct ecm_map *m = r->map;
+  if(!m) return;
+  while(write(m->stop[1], "", 1) != 1) {
+    if(errno == EINTR) continue;
+    /* The thread sees the pipe hang up instead */
+    close(m->stop[1]);
+    m->stop[1] = -1;
+    break;
+  }
+  /* It mustn't be left with the map freed under it */
+  pthread_join(m->thread, NULL);
+  map_free(m);
+  r->map = NULL;
+}
+#else
+/* Without userfaultfd, there's no lazy mapping */
+void *ecm_map(struct ecm_reader *r) {
+  (void)r;
+  return NULL;
+}
+
+void ecm_unmap(struct ecm_reader *r) {
+  (void)r;
+}
+#endif
+
+/***************************************************************************/
+
+void ecm_close(struct ecm_reader *r) {
+  ecm_unmap(r);
+  prefetch_stop(r);
+  if(r->fd >= 0) close(r->fd);
+  r->fd = -1;
+  cache_free(r->cache);
+  r->cache = NULL;
+  ecmidx_free(&r->idx);
+  if(r->v2) ecm2_free(r->v2);
+  free(r->v2);
+  r->v2 = NULL;
+}
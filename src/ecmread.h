@@ -0,0 +1,108 @@
+/***************************************************************************/
+/*
+** ECMREAD - Random access to the image in an ECM file
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __ECMREAD_H__
+#define __ECMREAD_H__
+
+#include <sys/types.h>
+
+#include "ecmidx.h"
+#include "ecm2.h"
+
+/*
+** An ECM file opened for reading sectors of its image in any order.  The
+** index (see ecmidx.h) comes from the .ecmidx next to the file when that's
+** there and goes with it, or else from a scan of the record headers.  A v2
+** file (see ecm2.h) has its own index, and is read a chunk at a time, each
+** checked against its EDC as it's decoded.  For either, idx.imagesize is
+** the size of the image.
+**
+** ecm_pread() reconstructs "count" sectors from sector "lba" on into "buf",
+** either raw (ECM_RAW, 2352 bytes each) or cooked (ECM_COOKED, the 2048
+** bytes of user data of each one; zeros for audio and anything else that
+** isn't a data sector).  It returns how many bytes it put in "buf", which
+** is less than asked for at the end of the image, or -1 on error.  The
+** reader isn't changed by it, and the file is only read with positional
+** reads, so any number of threads can call it on the same reader at once.
+** ecm_pread_image() is the same for "len" bytes of the raw image from any
+** "offset", as if it were a file.
+*/
+#define ECM_RAW    (0)
+#define ECM_COOKED (1)
+
+struct ecm_cache;
+struct ecm_prefetch;
+struct ecm_map;
+
+struct ecm_reader {
+  int fd;
+  struct ecmidx idx;
+  struct ecm2 *v2;
+  off_t sectors;
+  struct ecm_cache *cache;
+  struct ecm_prefetch *prefetch;
+  struct ecm_map *map;
+};
+
+int ecm_open(struct ecm_reader *r, const char *ecmfile);
+off_t ecm_pread(const struct ecm_reader *r, void *buf, off_t lba, off_t count, int mode);
+off_t ecm_pread_image(const struct ecm_reader *r, void *buf, off_t offset, size_t len);
+void ecm_close(struct ecm_reader *r);
+
+/*
+** Sectors that are read again and again (directories, a looping stream)
+** needn't be reconstructed every time: ecm_cache() gives the reader a
+** cache of reconstructed sectors taking up to about "bytes" of memory, or
+** takes it away with 0.  Readers start without one.  Call it before the
+** reading starts; it returns nonzero if there isn't the memory.  Every
+** sector looked up in the cache counts as a hit or a miss.
+**
+** With a cache, ecm_prefetch() starts a thread that watches for streams of
+** sequential reads and reconstructs the "window" sectors ahead of each one
+** into the cache, so the reads that follow are hits; 0 stops it.  It
+** returns nonzero if there's no cache, or no threads.  The reader mustn't
+** move in memory while the prefetcher runs, and ecm_cache() stops it.
+*/
+struct ecm_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t prefetched;
+  size_t size;
+  size_t used;
+};
+
+int ecm_cache(struct ecm_reader *r, size_t bytes);
+int ecm_prefetch(struct ecm_reader *r, off_t window);
+void ecm_cache_stats(const struct ecm_reader *r, struct ecm_cache_stats *st);
+
+/*
+** ecm_map() maps the whole image into memory, read-only, and says where.
+** Nothing is reconstructed up front: the first time a page is touched,
+** userfaultfd hands the fault to a thread that reconstructs the 64 KiB
+** around it, so the mapping only costs the pages that are actually used
+** (the cache and prefetcher, if any, work as for ecm_pread()).  Bytes that
+** can't be reconstructed read as zeros.  It needs Linux with userfaultfd,
+** and returns NULL without it.  ecm_unmap() (or ecm_close()) takes the
+** mapping away; the reader mustn't move in memory while it's there.
+*/
+void *ecm_map(struct ecm_reader *r);
+void ecm_unmap(struct ecm_reader *r);
+
+#endif
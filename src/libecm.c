@@ -0,0 +1,809 @@
+/***************************************************************************/
+/*
+** LIBECM - Error Code Modeler codec, shared by ECM and UNECM
+** Copyright (C) 2002 Neill Corlett (the ECC/EDC code and record format)
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define ECM_PTHREAD_ONCE
+#endif
+
+#include "libecm.h"
+
+/***************************************************************************/
+
+const unsigned ecm_unit_image[4] = { 1, 2352, 2336, 2336 };
+const unsigned ecm_unit_file[4]  = { 1, 0x803, 0x804, 0x918 };
+
+/* LUTs used for computing ECC/EDC */
+static unsigned char ecc_f_lut[256];
+static unsigned char ecc_b_lut[256];
+static uint32_t edc_lut[256];
+
+static void eccedc_init(void) {
+  uint32_t i, j, edc;
+  for(i = 0; i < 256; i++) {
+    j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
+    ecc_f_lut[i] = (unsigned char)j;
+    ecc_b_lut[i ^ j] = (unsigned char)i;
+    edc = i;
+    for(j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
+    edc_lut[i] = edc;
+  }
+}
+
+#ifdef ECM_PTHREAD_ONCE
+static pthread_once_t eccedc_once = PTHREAD_ONCE_INIT;
+
+void ecm_init(void) {
+  pthread_once(&eccedc_once, eccedc_init);
+}
+#else
+/* Without threads to race with, the first call does it */
+void ecm_init(void) {
+  static int done;
+  if(!done) {
+    eccedc_init();
+    done = 1;
+  }
+}
+#endif
+
+/***************************************************************************/
+/*
+** Compute EDC for a block
+*/
+uint32_t ecm_edc(uint32_t edc, const void *data, size_t len) {
+  const unsigned char *src = data;
+  while(len--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
+  return edc;
+}
+
+/*
+** EDC of "n" sectors of 2336 zeros, in one step per sector.  With no input
+** the EDC update is linear, so it can be tabulated per byte of the EDC.
+*/
+static uint32_t edc_zero_lut[4][256];
+
+static void edc_zero_init(void) {
+  uint32_t i, k;
+  for(k = 0; k < 4; k++) {
+    for(i = 0; i < 256; i++) {
+      uint32_t e = i << (8 * k);
+      int j;
+      for(j = 0; j < 2336; j++) e = (e >> 8) ^ edc_lut[e & 0xFF];
+      edc_zero_lut[k][i] = e;
+    }
+  }
+}
+
+#ifdef ECM_PTHREAD_ONCE
+static pthread_once_t edc_zero_once = PTHREAD_ONCE_INIT;
+#else
+static int edc_zero_ready;
+#endif
+
+uint32_t ecm_edc_zero_sectors(uint32_t edc, uint64_t n) {
+#ifdef ECM_PTHREAD_ONCE
+  pthread_once(&edc_zero_once, edc_zero_init);
+#else
+  if(!edc_zero_ready) {
+    edc_zero_init();
+    edc_zero_ready = 1;
+  }
+#endif
+  while(n--) {
+    edc =
+      edc_zero_lut[0][(edc >>  0) & 0xFF] ^
+      edc_zero_lut[1][(edc >>  8) & 0xFF] ^
+      edc_zero_lut[2][(edc >> 16) & 0xFF] ^
+      edc_zero_lut[3][(edc >> 24) & 0xFF];
+  }
+  return edc;
+}
+
+static void edc_store(const unsigned char *src, size_t size, unsigned char *dest) {
+  uint32_t edc = ecm_edc(0, src, size);
+  dest[0] = (edc >>  0) & 0xFF;
+  dest[1] = (edc >>  8) & 0xFF;
+  dest[2] = (edc >> 16) & 0xFF;
+  dest[3] = (edc >> 24) & 0xFF;
+}
+
+/*
+** Compute ECC for a block (can do either P or Q), and either write it to
+** "dest" or check it against what's there.  Returns 0 if the check fails.
+*/
+static int ecc_computeblock(
+  const unsigned char *src,
+  uint32_t major_count,
+  uint32_t minor_count,
+  uint32_t major_mult,
+  uint32_t minor_inc,
+  unsigned char *dest,
+  int check
+) {
+  uint32_t size = major_count * minor_count;
+  uint32_t major, minor;
+  for(major = 0; major < major_count; major++) {
+    uint32_t index = (major >> 1) * major_mult + (major & 1);
+    unsigned char ecc_a = 0;
+    unsigned char ecc_b = 0;
+    for(minor = 0; minor < minor_count; minor++) {
+      unsigned char temp = src[index];
+      index += minor_inc;
+      if(index >= size) index -= size;
+      ecc_a ^= temp;
+      ecc_b ^= temp;
+      ecc_a = ecc_f_lut[ecc_a];
+    }
+    ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+    if(check) {
+      if(dest[major              ] != (ecc_a        )) return 0;
+      if(dest[major + major_count] != (ecc_a ^ ecc_b)) return 0;
+    } else {
+      dest[major              ] = ecc_a;
+      dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+  }
+  return 1;
+}
+
+/*
+** Check ECC P and Q codes for a block
+**
+** The sector is never written to, so it can live in read-only memory.  When
+** the address has to be treated as zero (mode 2), the part of the sector
+** covered by the codes is copied first; nothing in front of 0x10 is read.
+*/
+static int ecc_check(
+  const unsigned char *sector,
+  int                  zeroaddress,
+  const unsigned char *dest
+) {
+  unsigned char copy[0x8C8];
+  if(zeroaddress) {
+    copy[0x0C] = 0;
+    copy[0x0D] = 0;
+    copy[0x0E] = 0;
+    copy[0x0F] = 0;
+    memcpy(copy + 0x10, sector + 0x10, 0x8C8 - 0x10);
+    sector = copy;
+  }
+  /* Check ECC P code */
+  if(!ecc_computeblock(sector + 0xC, 86, 24,  2, 86, (unsigned char*)dest, 1)) {
+    return 0;
+  }
+  /* Check ECC Q code */
+  return ecc_computeblock(sector + 0xC, 52, 43, 86, 88,
+    (unsigned char*)dest + 0x8C8 - 0x81C, 1);
+}
+
+/*
+** Generate ECC P and Q codes for a block
+*/
+static void ecc_generate(unsigned char *sector, int zeroaddress) {
+  unsigned char address[4];
+  int i;
+  /* Save the address and zero it out */
+  if(zeroaddress) for(i = 0; i < 4; i++) {
+    address[i] = sector[12 + i];
+    sector[12 + i] = 0;
+  }
+  /* Compute ECC P code */
+  ecc_computeblock(sector + 0xC, 86, 24,  2, 86, sector + 0x81C, 0);
+  /* Compute ECC Q code */
+  ecc_computeblock(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8, 0);
+  /* Restore the address */
+  if(zeroaddress) for(i = 0; i < 4; i++) sector[12 + i] = address[i];
+}
+
+/***************************************************************************/
+/*
+** Work out which type a sector can be encoded as: 1 for a 2352-byte mode 1
+** sector (only if "canbetype1", that is, there are 2352 bytes), 2 or 3 for
+** the 2336 bytes of a mode 2 sector after its sync and header, or 0 if
+** it's none of them.  "sector" may be in read-only memory.
+*/
+int ecm_sector_type(const unsigned char *sector, int canbetype1) {
+  int canbetype2 = 1;
+  int canbetype3 = 1;
+  uint32_t myedc;
+  /* Check for mode 1 */
+  if(canbetype1) {
+    if(
+      (sector[0x00] != 0x00) ||
+      (sector[0x01] != 0xFF) ||
+      (sector[0x02] != 0xFF) ||
+      (sector[0x03] != 0xFF) ||
+      (sector[0x04] != 0xFF) ||
+      (sector[0x05] != 0xFF) ||
+      (sector[0x06] != 0xFF) ||
+      (sector[0x07] != 0xFF) ||
+      (sector[0x08] != 0xFF) ||
+      (sector[0x09] != 0xFF) ||
+      (sector[0x0A] != 0xFF) ||
+      (sector[0x0B] != 0x00) ||
+      (sector[0x0F] != 0x01) ||
+      (sector[0x814] != 0x00) ||
+      (sector[0x815] != 0x00) ||
+      (sector[0x816] != 0x00) ||
+      (sector[0x817] != 0x00) ||
+      (sector[0x818] != 0x00) ||
+      (sector[0x819] != 0x00) ||
+      (sector[0x81A] != 0x00) ||
+      (sector[0x81B] != 0x00)
+    ) {
+      canbetype1 = 0;
+    }
+  }
+  /* Check for mode 2 */
+  if(
+    (sector[0x0] != sector[0x4]) ||
+    (sector[0x1] != sector[0x5]) ||
+    (sector[0x2] != sector[0x6]) ||
+    (sector[0x3] != sector[0x7])
+  ) {
+    canbetype2 = 0;
+    canbetype3 = 0;
+    if(!canbetype1) return 0;
+  }
+
+  /* Check EDC */
+  myedc = ecm_edc(0, sector, 0x808);
+  if(canbetype2) if(
+    (sector[0x808] != ((myedc >>  0) & 0xFF)) ||
+    (sector[0x809] != ((myedc >>  8) & 0xFF)) ||
+    (sector[0x80A] != ((myedc >> 16) & 0xFF)) ||
+    (sector[0x80B] != ((myedc >> 24) & 0xFF))
+  ) {
+    canbetype2 = 0;
+  }
+  myedc = ecm_edc(myedc, sector + 0x808, 8);
+  if(canbetype1) if(
+    (sector[0x810] != ((myedc >>  0) & 0xFF)) ||
+    (sector[0x811] != ((myedc >>  8) & 0xFF)) ||
+    (sector[0x812] != ((myedc >> 16) & 0xFF)) ||
+    (sector[0x813] != ((myedc >> 24) & 0xFF))
+  ) {
+    canbetype1 = 0;
+  }
+  myedc = ecm_edc(myedc, sector + 0x810, 0x10C);
+  if(canbetype3) if(
+    (sector[0x91C] != ((myedc >>  0) & 0xFF)) ||
+    (sector[0x91D] != ((myedc >>  8) & 0xFF)) ||
+    (sector[0x91E] != ((myedc >> 16) & 0xFF)) ||
+    (sector[0x91F] != ((myedc >> 24) & 0xFF))
+  ) {
+    canbetype3 = 0;
+  }
+  /* Check ECC */
+  if(canbetype1) { if(!(ecc_check(sector       , 0, sector + 0x81C))) { canbetype1 = 0; } }
+  if(canbetype2) { if(!(ecc_check(sector - 0x10, 1, sector + 0x80C))) { canbetype2 = 0; } }
+  if(canbetype1) return 1;
+  if(canbetype2) return 2;
+  if(canbetype3) return 3;
+  return 0;
+}
+
+/*
+** Fill in the rest of a 2352-byte sector once its record data is in place:
+** the address at 0x00C and the user data at 0x010 for type 1, or the
+** subheader and the rest at 0x014 for types 2 and 3 (whose 2336 bytes then
+** start at 0x010)
+*/
+void ecm_sector_rebuild(unsigned char *sector, int type) {
+  switch(type) {
+  case 1: /* Mode 1 */
+    sector[0x00] = 0x00;
+    memset(sector + 1, 0xFF, 10);
+    sector[0x0B] = 0x00;
+    sector[0x0F] = 0x01;
+    /* Compute EDC */
+    edc_store(sector + 0x00, 0x810, sector + 0x810);
+    /* Write out zero bytes */
+    memset(sector + 0x814, 0, 8);
+    /* Generate ECC P/Q codes */
+    ecc_generate(sector, 0);
+    break;
+  case 2: /* Mode 2 form 1 */
+    memcpy(sector + 0x10, sector + 0x14, 4);
+    /* Compute EDC */
+    edc_store(sector + 0x10, 0x808, sector + 0x818);
+    /* Generate ECC P/Q codes */
+    ecc_generate(sector, 1);
+    break;
+  case 3: /* Mode 2 form 2 */
+    memcpy(sector + 0x10, sector + 0x14, 4);
+    /* Compute EDC */
+    edc_store(sector + 0x10, 0x91C, sector + 0x92C);
+    break;
+  }
+}
+
+/***************************************************************************/
+/*
+** Decoder
+**
+** The magic, record headers, sector units and trailer are gathered a byte
+** at a time as they come in, so input can be cut anywhere.  Literal bytes go
+** straight from input to output.  A rebuilt sector waits in the context
+** until there's room for all of it.  A unit read and put out in one call
+** comes out of that call, since the data of the record it's in is only
+** taken as far as the end of the unit in hand.
+*/
+enum {
+  DECODE_MAGIC,
+  DECODE_HEADER,
+  DECODE_DATA,
+  DECODE_TRAILER,
+  DECODE_END,
+  DECODE_ERROR
+};
+
+const unsigned char ecm_magic[4] = { 'E', 'C', 'M', 0x00 };
+
+void ecm_decoder_init(struct ecm_decoder *d) {
+  ecm_init();
+  memset(d, 0, sizeof(*d));
+  d->state = DECODE_MAGIC;
+}
+
+int ecm_decode(
+  struct ecm_decoder *d,
+  const unsigned char **in, size_t *inlen,
+  unsigned char **out, size_t *outlen
+) {
+  for(;;) {
+    size_t n;
+    int c;
+    if(d->outpos < d->outlen) {
+      n = d->outlen - d->outpos;
+      if(n > *outlen) n = *outlen;
+      memcpy(*out, d->sector + d->outpos, n);
+      *out += n;
+      *outlen -= n;
+      d->outpos += n;
+      if(d->outpos < d->outlen) return ECM_OK;
+    }
+    switch(d->state) {
+    case DECODE_MAGIC:
+      if(!*inlen) return ECM_OK;
+      c = *(*in)++;
+      (*inlen)--;
+      if(c != ecm_magic[d->have]) {
+        d->state = DECODE_ERROR;
+        break;
+      }
+      if(++d->have == 4) {
+        d->state = DECODE_HEADER;
+        d->have = 0;
+      }
+      break;
+    case DECODE_HEADER:
+      if(!*inlen) return ECM_OK;
+      c = *(*in)++;
+      (*inlen)--;
+      if(!d->have) {
+        d->type = c & 3;
+        d->num = (c >> 2) & 0x1F;
+        d->bits = 5;
+      } else if(d->bits > 56) {
+        d->state = DECODE_ERROR;
+        break;
+      } else {
+        d->num |= ((uint64_t)(c & 0x7F)) << d->bits;
+        d->bits += 7;
+      }
+      d->have++;
+      if(!(c & 0x80)) {
+        d->have = 0;
+        if(d->num == 0xFFFFFFFF) {
+          d->state = DECODE_TRAILER;
+        } else {
+          d->num++;
+          d->state = DECODE_DATA;
+        }
+      }
+      break;
+    case DECODE_DATA:
+      if(!d->num) {
+        d->state = DECODE_HEADER;
+        break;
+      }
+      if(!d->type) {
+        n = *inlen < *outlen ? *inlen : *outlen;
+        if(n > d->num) n = (size_t)d->num;
+        if(!n) return ECM_OK;
+        memcpy(*out, *in, n);
+        d->edc = ecm_edc(d->edc, *in, n);
+        *in += n;
+        *inlen -= n;
+        *out += n;
+        *outlen -= n;
+        d->num -= n;
+        d->total += n;
+        break;
+      }
+      /*
+      ** Type 1 goes in at 0x00D so its user data lands at 0x010, and its
+      ** address is moved back to 0x00C after
+      */
+      n = ecm_unit_file[d->type] - d->have;
+      if(n > *inlen) n = *inlen;
+      if(!n) return ECM_OK;
+      memcpy(d->sector + (d->type == 1 ? 0x00D : 0x014) + d->have, *in, n);
+      *in += n;
+      *inlen -= n;
+      d->have += (unsigned)n;
+      if(d->have < ecm_unit_file[d->type]) return ECM_OK;
+      if(d->type == 1) memmove(d->sector + 0x00C, d->sector + 0x00D, 3);
+      d->outpos = (d->type == 1) ? 0 : 0x10;
+      d->outlen = 2352;
+      if(!(d->flags & ECM_NOREBUILD)) {
+        ecm_sector_rebuild(d->sector, d->type);
+        d->edc = ecm_edc(d->edc, d->sector + d->outpos, d->outlen - d->outpos);
+      }
+      d->total += d->outlen - d->outpos;
+      d->have = 0;
+      d->num--;
+      break;
+    case DECODE_TRAILER:
+      if(!*inlen) return ECM_OK;
+      c = *(*in)++;
+      (*inlen)--;
+      if(
+        !(d->flags & ECM_NOREBUILD) &&
+        (c != (int)((d->edc >> (8 * d->have)) & 0xFF))
+      ) {
+        d->state = DECODE_ERROR;
+        break;
+      }
+      if(++d->have == 4) d->state = DECODE_END;
+      break;
+    case DECODE_END:
+      return ECM_END;
+    default:
+      return ECM_ERROR;
+    }
+  }
+}
+
+uint64_t ecm_decode_next(const struct ecm_decoder *d, int *part) {
+  uint64_t unit;
+  switch(d->state) {
+  case DECODE_MAGIC:
+    *part = ECM_MAGIC;
+    return 4 - d->have;
+  case DECODE_HEADER:
+    *part = ECM_HEADER;
+    return 1;
+  case DECODE_DATA:
+    if(!d->num) {
+      *part = ECM_HEADER;
+      return 1;
+    }
+    *part = d->type;
+    unit = ecm_unit_file[d->type];
+    /* More than there could ever be is as good as anything */
+    if(d->num > UINT64_MAX / unit) return UINT64_MAX;
+    return d->num * unit - d->have;
+  case DECODE_TRAILER:
+    *part = ECM_TRAILER;
+    return 4 - d->have;
+  default:
+    *part = ECM_TRAILER;
+    return 0;
+  }
+}
+
+void ecm_decode_skip(struct ecm_decoder *d, const void *data, uint64_t len) {
+  if(!d->type) {
+    if(data) d->edc = ecm_edc(d->edc, data, (size_t)len);
+    d->num -= len;
+    d->total += len;
+    return;
+  }
+  len /= ecm_unit_file[d->type];
+  d->num -= len;
+  d->total += len * ecm_unit_image[d->type];
+}
+
+/***************************************************************************/
+/*
+** Encoder
+**
+** A run is whole units of one type, classified one at a time.  The type of
+** a unit that doesn't have a whole sector after it (only at the end of the
+** input) is taken from what there is.
+*/
+static const struct ecm_run no_run = { -1, 0, 0 };
+
+void ecm_encoder_init_runs(struct ecm_encoder *e) {
+  ecm_init();
+  memset(e, 0, sizeof(*e));
+  e->type = -1;
+}
+
+/*
+** Put the run in hand in *done, and start a new one after it
+*/
+static void run_end(struct ecm_encoder *e, struct ecm_run *done) {
+  done->type = e->type;
+  done->count = e->count;
+  done->start = e->start;
+  if(e->count) e->start += e->count * ecm_unit_image[e->type];
+  e->type = -1;
+  e->count = 0;
+}
+
+void ecm_encode_units(struct ecm_encoder *e, int type, uint64_t count, struct ecm_run *done) {
+  *done = no_run;
+  if(e->count && (type != e->type)) run_end(e, done);
+  e->type = type;
+  e->count += count;
+}
+
+size_t ecm_encode_unit(struct ecm_encoder *e, const unsigned char *data, size_t avail, struct ecm_run *done) {
+  int type = (avail < 2336) ? 0 : ecm_sector_type(data, avail >= 2352);
+  ecm_encode_units(e, type, 1, done);
+  return ecm_unit_image[type];
+}
+
+void ecm_encode_cut(struct ecm_encoder *e, struct ecm_run *done) {
+  *done = no_run;
+  if(e->count) run_end(e, done);
+}
+
+/*
+** A type/count combo (a count of 0 is the end of the records)
+*/
+static size_t type_count(unsigned char *out, int type, uint64_t count) {
+  size_t n = 0;
+  count = count ? count - 1 : 0xFFFFFFFF;
+  out[n++] = (unsigned char)(((count >= 32 ? 1 : 0) << 7) | ((count & 31) << 2) | type);
+  count >>= 5;
+  while(count) {
+    out[n++] = (unsigned char)(((count >= 128 ? 1 : 0) << 7) | (count & 127));
+    count >>= 7;
+  }
+  return n;
+}
+
+size_t ecm_encode_header(const struct ecm_run *run, unsigned char *out) {
+  return type_count(out, run->type, run->count);
+}
+
+size_t ecm_encode_data(struct ecm_encoder *e, int type, const unsigned char *data, size_t len, unsigned char *out) {
+  const unsigned char *end = data + len;
+  unsigned char *start = out;
+  e->edc = ecm_edc(e->edc, data, len);
+  if(!type) {
+    if(out) memcpy(out, data, len);
+    return len;
+  }
+  for(; data < end; data += ecm_unit_image[type]) {
+    switch(type) {
+    case 1:
+      memcpy(out, data + 0x00C, 0x003);
+      memcpy(out + 0x003, data + 0x010, 0x800);
+      break;
+    case 2:
+      memcpy(out, data + 0x004, 0x804);
+      break;
+    case 3:
+      memcpy(out, data + 0x004, 0x918);
+      break;
+    }
+    out += ecm_unit_file[type];
+  }
+  return (size_t)(out - start);
+}
+
+void ecm_encode_zeros(struct ecm_encoder *e, uint64_t count) {
+  e->edc = ecm_edc_zero_sectors(e->edc, count);
+}
+
+size_t ecm_encode_trailer(struct ecm_encoder *e, unsigned char *out) {
+  size_t n = type_count(out, 0, 0);
+  out[n++] = (unsigned char)(e->edc >>  0);
+  out[n++] = (unsigned char)(e->edc >>  8);
+  out[n++] = (unsigned char)(e->edc >> 16);
+  out[n++] = (unsigned char)(e->edc >> 24);
+  return n;
+}
+
+/*
+** Streaming
+**
+** Input is gathered in the window, which always starts at the run in hand.
+** A position is classified once there's a whole sector after it (or once
+** the input is done).  When a run is over, or gets to half the window, it's
+** encoded to "pending" and the window is shifted down.  Nothing more is
+** done until "pending" has all gone out, so it never holds more than one
+** run and the end of the records.
+*/
+enum {
+  ENCODE_START,
+  ENCODE_RUN,
+  ENCODE_END
+};
+
+#define PENDING_SIZE (ECM_ENCODER_WINDOW / 2 + 2352 + 64)
+
+int ecm_encoder_init(struct ecm_encoder *e) {
+  ecm_encoder_init_runs(e);
+  e->window = malloc(ECM_ENCODER_WINDOW);
+  e->pending = malloc(PENDING_SIZE);
+  if(!e->window || !e->pending) {
+    ecm_encoder_end(e);
+    return 1;
+  }
+  return 0;
+}
+
+void ecm_encoder_end(struct ecm_encoder *e) {
+  free(e->window);
+  free(e->pending);
+  e->window = NULL;
+  e->pending = NULL;
+}
+
+/*
+** Encode a run that's done from the front of the window
+*/
+static void encode_run(struct ecm_encoder *e, const struct ecm_run *run) {
+  size_t len;
+  if(!run->count) return;
+  len = (size_t)run->count * ecm_unit_image[run->type];
+  e->pendlen += ecm_encode_header(run, e->pending + e->pendlen);
+  e->pendlen += ecm_encode_data(e, run->type, e->window, len, e->pending + e->pendlen);
+  memmove(e->window, e->window + len, e->fill - len);
+  e->fill -= len;
+  e->check -= len;
+}
+
+int ecm_encode(
+  struct ecm_encoder *e,
+  const unsigned char **in, size_t *inlen,
+  unsigned char **out, size_t *outlen,
+  int finish
+) {
+  for(;;) {
+    struct ecm_run done = no_run;
+    size_t n;
+    if(e->pendpos < e->pendlen) {
+      n = e->pendlen - e->pendpos;
+      if(n > *outlen) n = *outlen;
+      memcpy(*out, e->pending + e->pendpos, n);
+      *out += n;
+      *outlen -= n;
+      e->pendpos += n;
+      if(e->pendpos < e->pendlen) return ECM_OK;
+    }
+    e->pendpos = 0;
+    e->pendlen = 0;
+    if(e->state == ENCODE_END) return ECM_END;
+    if(e->state == ENCODE_START) {
+      memcpy(e->pending, ecm_magic, 4);
+      e->pendlen = 4;
+      e->state = ENCODE_RUN;
+      continue;
+    }
+    /* Take in as much as there's room for */
+    n = ECM_ENCODER_WINDOW - e->fill;
+    if(n > *inlen) n = *inlen;
+    memcpy(e->window + e->fill, *in, n);
+    *in += n;
+    *inlen -= n;
+    e->fill += n;
+    e->total += n;
+    while(e->check < e->fill) {
+      size_t avail = e->fill - e->check;
+      if((avail < 2352) && !(finish && !*inlen)) break;
+      e->check += ecm_encode_unit(e, e->window + e->check, avail, &done);
+      if(done.count) break;
+      if(e->check >= ECM_ENCODER_WINDOW / 2) {
+        ecm_encode_cut(e, &done);
+        break;
+      }
+    }
+    if(done.count) {
+      encode_run(e, &done);
+      continue;
+    }
+    /* Everything's classified, or the next unit needs more input */
+    if(*inlen) continue;
+    if(!finish) return ECM_OK;
+    ecm_encode_cut(e, &done);
+    encode_run(e, &done);
+    e->pendlen += ecm_encode_trailer(e, e->pending + e->pendlen);
+    e->state = ENCODE_END;
+  }
+}
+
+/***************************************************************************/
+
+/*
+** Run a whole buffer through a context, growing the output as needed
+*/
+static int convert_buffer(
+  int encode,
+  const void *in, size_t inlen,
+  unsigned char **out, size_t *outlen
+) {
+  struct ecm_encoder e;
+  struct ecm_decoder d;
+  const unsigned char *src = in;
+  unsigned char *buf = NULL;
+  size_t size = inlen / 2 + 65536;
+  size_t used = 0;
+  int r;
+  if(encode) {
+    if(ecm_encoder_init(&e)) return 1;
+  } else {
+    ecm_decoder_init(&d);
+  }
+  for(;;) {
+    unsigned char *dest;
+    size_t room;
+    if(!buf || (used == size)) {
+      unsigned char *grown;
+      if(buf) size *= 2;
+      grown = realloc(buf, size);
+      if(!grown) {
+        r = ECM_ERROR;
+        break;
+      }
+      buf = grown;
+    }
+    dest = buf + used;
+    room = size - used;
+    r = encode ?
+      ecm_encode(&e, &src, &inlen, &dest, &room, 1) :
+      ecm_decode(&d, &src, &inlen, &dest, &room);
+    used = (size_t)(dest - buf);
+    if(r != ECM_OK) break;
+    /* A decoder that wants input it won't get is looking at a cut file */
+    if(!encode && !inlen && (used < size)) {
+      r = ECM_ERROR;
+      break;
+    }
+  }
+  if(encode) ecm_encoder_end(&e);
+  if(r != ECM_END) {
+    free(buf);
+    return 1;
+  }
+  *out = buf;
+  *outlen = used;
+  return 0;
+}
+
+int ecm_encode_buffer(const void *in, size_t inlen, unsigned char **out, size_t *outlen) {
+  return convert_buffer(1, in, inlen, out, outlen);
+}
+
+int ecm_decode_buffer(const void *in, size_t inlen, unsigned char **out, size_t *outlen) {
+  return convert_buffer(0, in, inlen, out, outlen);
+}
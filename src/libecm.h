@@ -0,0 +1,200 @@
+/***************************************************************************/
+/*
+** LIBECM - Error Code Modeler codec, shared by ECM and UNECM
+** Copyright (C) 2002 Neill Corlett (the ECC/EDC code and record format)
+** Copyright (C) 2026 the ECM contributors
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+#ifndef __LIBECM_H__
+#define __LIBECM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Everything here works on state the caller passes in, so any number of
+** conversions can run at once, on any threads.  The only thing shared is a
+** set of lookup tables, which ecm_init() fills in the first time it's
+** called; call it before anything else (contexts do it themselves).
+*/
+void ecm_init(void);
+
+/*
+** Record types:
+** 0 - literal bytes
+** 1 - 2352 mode 1         predict sync, mode, reserved, edc, ecc
+** 2 - 2336 mode 2 form 1  predict redundant flags, edc, ecc
+** 3 - 2336 mode 2 form 2  predict redundant flags, edc
+**
+** A unit of each type (a byte, or a sector) takes ecm_unit_image[type]
+** bytes of the image and ecm_unit_file[type] bytes of the ECM file.
+*/
+extern const unsigned ecm_unit_image[4];
+extern const unsigned ecm_unit_file[4];
+
+/* Every ECM file starts with this */
+extern const unsigned char ecm_magic[4];
+
+uint32_t ecm_edc(uint32_t edc, const void *data, size_t len);
+uint32_t ecm_edc_zero_sectors(uint32_t edc, uint64_t n);
+int ecm_sector_type(const unsigned char *sector, int canbetype1);
+void ecm_sector_rebuild(unsigned char *sector, int type);
+
+/*
+** Streaming contexts, pushing input in and pulling output out like zlib:
+** each call takes what it can from *in (up to *inlen bytes) and puts what
+** it can in *out (up to *outlen bytes), moving the pointers and counts
+** along.  It returns ECM_OK when it needs more input or more room for
+** output, ECM_END once everything is out, or ECM_ERROR.  The encoder is
+** told with "finish" that there's no more input after this.
+*/
+#define ECM_OK    (0)
+#define ECM_END   (1)
+#define ECM_ERROR (-1)
+
+struct ecm_decoder {
+  int flags;
+  int state;
+  int type;
+  unsigned have;
+  unsigned bits;
+  uint64_t num;
+  uint32_t edc;
+  uint64_t total;
+  size_t outpos;
+  size_t outlen;
+  unsigned char sector[2352];
+};
+
+void ecm_decoder_init(struct ecm_decoder *d);
+int ecm_decode(
+  struct ecm_decoder *d,
+  const unsigned char **in, size_t *inlen,
+  unsigned char **out, size_t *outlen
+);
+
+/*
+** With ECM_NOREBUILD in d->flags (set after ecm_decoder_init()), sectors
+** come out with only what their records hold, in place: the address, the
+** subheader and the user data, but no sync, EDC or ECC.  The EDC at the end
+** isn't checked then.
+**
+** A caller that reads the input itself can give the decoder just what it
+** takes next, so it's never ahead of it.  ecm_decode_next() says how many
+** bytes that is (0 at the end, or after an error), and in *part what they
+** are: the type of the record whose data they are (all that's left of it),
+** or ECM_MAGIC, ECM_HEADER or ECM_TRAILER.  Record data given one unit
+** (ecm_unit_file[type] bytes) at a time comes out one unit at a time.
+**
+** ecm_decode_skip() moves the decoder past "len" bytes of record data that
+** the caller has dealt with itself: literal bytes it copied to the output
+** (which it passes as "data", for the EDC), or whole units it only wants
+** to get past, with "data" NULL, after which the EDC won't match.
+*/
+#define ECM_NOREBUILD (1)
+
+#define ECM_MAGIC   (-1)
+#define ECM_HEADER  (-2)
+#define ECM_TRAILER (-3)
+
+uint64_t ecm_decode_next(const struct ecm_decoder *d, int *part);
+void ecm_decode_skip(struct ecm_decoder *d, const void *data, uint64_t len);
+
+/*
+** The encoder works through a window of the input.  A run of one type that
+** goes on for more than half of it is split over several records.
+*/
+#define ECM_ENCODER_WINDOW (1048576)
+
+struct ecm_encoder {
+  int state;
+  int type;
+  uint64_t count;
+  uint64_t start;
+  uint32_t edc;
+  uint64_t total;
+  unsigned char *window;
+  size_t fill;
+  size_t check;
+  unsigned char *pending;
+  size_t pendpos;
+  size_t pendlen;
+};
+
+int ecm_encoder_init(struct ecm_encoder *e);
+int ecm_encode(
+  struct ecm_encoder *e,
+  const unsigned char **in, size_t *inlen,
+  unsigned char **out, size_t *outlen,
+  int finish
+);
+void ecm_encoder_end(struct ecm_encoder *e);
+
+/*
+** A run at a time
+**
+** ecm_encode() has to hold on to a run until it knows how long it is, so it
+** splits long ones.  A caller that can get at the input again once a run is
+** over (a file, or a big enough queue) can have them whole, and write the
+** records itself, with an encoder context set up by ecm_encoder_init_runs()
+** instead (which needs no ecm_encoder_end()):
+**
+** ecm_encode_unit() works out the type of the unit at "data", which has
+** "avail" bytes from there on (less than a sector only at the end of the
+** input), adds it to the run in hand, and returns its size in the image.
+** ecm_encode_units() adds "count" units of "type" known without looking,
+** like the zero sectors in a hole (type 2).  If what's added doesn't go
+** with the run in hand, that run is over, and both put it in *done;
+** otherwise done->count is 0.  ecm_encode_cut() puts the run in hand in
+** *done as it is, to end it early, or at the end of the input.
+**
+** The runs that are done go out as records, in order, after ecm_magic:
+** ecm_encode_header() puts the header of "run" in "out" and returns how
+** long it is, and ecm_encode_data() turns "len" bytes of its image (whole
+** units of "type") into the record data at "out", returning how long that
+** is.  Literal bytes stay as they are, so "out" can be NULL for a caller
+** that writes them itself.  ecm_encode_zeros() does the same for "count"
+** type 2 sectors of zeros, whose record data is count * 0x804 zeros, without
+** looking at them.  ecm_encode_trailer() puts the end of the records and
+** the EDC in "out" once every run has gone, and returns how long that is.
+*/
+#define ECM_HEADER_MAX  (10)
+#define ECM_TRAILER_MAX (5 + 4)
+
+struct ecm_run {
+  int type;
+  uint64_t count;
+  uint64_t start;
+};
+
+void ecm_encoder_init_runs(struct ecm_encoder *e);
+size_t ecm_encode_unit(struct ecm_encoder *e, const unsigned char *data, size_t avail, struct ecm_run *done);
+void ecm_encode_units(struct ecm_encoder *e, int type, uint64_t count, struct ecm_run *done);
+void ecm_encode_cut(struct ecm_encoder *e, struct ecm_run *done);
+size_t ecm_encode_header(const struct ecm_run *run, unsigned char *out);
+size_t ecm_encode_data(struct ecm_encoder *e, int type, const unsigned char *data, size_t len, unsigned char *out);
+void ecm_encode_zeros(struct ecm_encoder *e, uint64_t count);
+size_t ecm_encode_trailer(struct ecm_encoder *e, unsigned char *out);
+
+/*
+** Whole buffers at once.  The result is allocated with malloc(), and the
+** caller frees it.  Returns nonzero on error.
+*/
+int ecm_encode_buffer(const void *in, size_t inlen, unsigned char **out, size_t *outlen);
+int ecm_decode_buffer(const void *in, size_t inlen, unsigned char **out, size_t *outlen);
+
+#endif
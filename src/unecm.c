@@ -34,6 +34,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+#include "ecmio.h"
+#include "digest.h"
+#include "cue.h"
+#include "ecmidx.h"
+#include "ecm2.h"
+#include "libecm.h"
+#include "ecmread.h"
+#include "ecmnbd.h"
+
 #if !defined(_FILE_OFFSET_BITS) || _FILE_OFFSET_BITS != 64
 #define ORIGINAL_MODE
 #endif
@@ -79,333 +97,1342 @@ typedef unsigned short ecc_uint16;
 typedef unsigned int ecc_uint32;
 typedef signed int ecc_int32;
 
-/* LUTs used for computing ECC/EDC */
-static ecc_uint8 ecc_f_lut[256];
-static ecc_uint8 ecc_b_lut[256];
-static ecc_uint32 edc_lut[256];
-
-/* Init routine */
-static void eccedc_init(void) {
-  ecc_uint32 i, j, edc;
-  for(i = 0; i < 256; i++) {
-    j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-    ecc_f_lut[i] = j;
-    ecc_b_lut[i ^ j] = i;
-    edc = i;
-    for(j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-    edc_lut[i] = edc;
+/***************************************************************************/
+
+off_t mycounter;
+off_t mycounter_total;
+
+void resetcounter(off_t total) {
+  mycounter = 0;
+  mycounter_total = total;
+}
+
+void setcounter(off_t n) {
+  if((n >> 20) != (mycounter >> 20)) {
+    if(mycounter_total < 0) {
+      /* Total is unknown when reading from a pipe */
+      char strbuff[64];
+      fprintf(stderr, "Decoding %s        \r", GetByteSize(n, strbuff));
+    } else {
+      off_t a = (n+64)/128;
+      off_t d = (mycounter_total+64)/128;
+      if(!d) d = 1;
+      fprintf(stderr,
+#ifdef ORIGINAL_MODE
+        "Decoding (%02d%%)\r", (100*a) / d);
+#else
+        "Decoding (%02lld%%)\r", (long long)((100*a) / d));
+#endif
+    }
   }
+  mycounter = n;
 }
 
-/***************************************************************************/
 /*
-** Compute EDC for a block
+** Work out the size of the decoded output from the record headers alone, so
+** it can be allocated up front.  Returns -1 if that doesn't work out.  The
+** caller rewinds the input afterwards.
 */
-ecc_uint32 edc_partial_computeblock(
-        ecc_uint32 edc,
-        const ecc_uint8 *src,
-        ecc_uint16 size
-) {
-  while(size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-  return edc;
+off_t prescan(FILE *in, off_t total) {
+  struct ecm_decoder d;
+  if(fseek(in, 0, SEEK_SET)) return -1;
+  ecm_decoder_init(&d);
+  for(;;) {
+    unsigned char buf[4];
+    const unsigned char *src = buf;
+    unsigned char *dest = NULL;
+    size_t room = 0;
+    size_t n;
+    int part;
+    uint64_t want = ecm_decode_next(&d, &part);
+    if(part >= 0) {
+      /* Just the headers; the EDC isn't wanted */
+      if((want > (uint64_t)total) || fseeko(in, (off_t)want, SEEK_CUR)) return -1;
+      ecm_decode_skip(&d, NULL, want);
+      continue;
+    }
+    if(part == ECM_TRAILER) return (off_t)d.total;
+    n = (size_t)want;
+    if(fread(buf, 1, n, in) != n) return -1;
+    if(ecm_decode(&d, &src, &n, &dest, &room) == ECM_ERROR) return -1;
+  }
 }
 
-void edc_computeblock(
-  const ecc_uint8 *src,
-        ecc_uint16 size,
-        ecc_uint8 *dest
-) {
-  ecc_uint32 edc = edc_partial_computeblock(0, src, size);
-  dest[0] = (edc >>  0) & 0xFF;
-  dest[1] = (edc >>  8) & 0xFF;
-  dest[2] = (edc >> 16) & 0xFF;
-  dest[3] = (edc >> 24) & 0xFF;
+/*
+** Sinks
+**
+** Besides the output, the decoded image can go to a cooked image (the 2048
+** bytes of user data of every data sector, like an .iso) and to a set of
+** digests, all in the same pass.  Each piece of the image is handed to all
+** of them once, as soon as it's been reconstructed.
+**
+** For the cooked image, the raw image is taken apart into 2352-byte
+** sectors, lined up with the end of the last reconstructed sector (or the
+** start of the image).  Mode 1 sectors that were encoded as such are cooked
+** as they are.  Mode 2 ones come as the 16 bytes of sync and header as
+** literal bytes right before the rest; anything else that came out as
+** mode 2 (such as silence in audio) is just raw data.  Raw sectors are cooked
+** according to the mode in their header.  For mode 2, the user data is the
+** first 2048 bytes after the subheader (all of it for form 1), so every
+** data sector keeps its place.  Audio has no user data and is left out.
+*/
+struct sinks {
+  int cooked;
+  int isoonly;
+  struct tracks *tracks;
+  struct output iso;
+  struct digester dg;
+  off_t pos;
+  off_t boundary;
+  unsigned char raw[2352];
+  size_t rawfill;
+  unsigned char last[16];
+};
+
+static const unsigned char sync_pattern[12] = {
+  0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+
+static int sync_header(const unsigned char *sector, int mode) {
+  return !memcmp(sector, sync_pattern, sizeof(sync_pattern)) &&
+    (mode < 0 || sector[0x0F] == mode);
 }
 
-/***************************************************************************/
 /*
-** Compute ECC for a block (can do either P or Q)
+** Track files
+**
+** With "--split", the decoded image goes to one file per track instead of
+** a single output, along with a cue sheet for them.  The layout comes from
+** a cue sheet for the whole image, or with "auto", from the image itself: a
+** track starts wherever the sectors change from audio (no sync pattern) to
+** data or from one mode to another, which is decided on the 16 bytes of
+** sync and header at the start of each sector before any of it is written.
+** Audio tracks that follow each other can't be told apart that way.
 */
-static void ecc_computeblock(
-  ecc_uint8 *src,
-  ecc_uint32 major_count,
-  ecc_uint32 minor_count,
-  ecc_uint32 major_mult,
-  ecc_uint32 minor_inc,
-  ecc_uint8 *dest
-) {
-  ecc_uint32 size = major_count * minor_count;
-  ecc_uint32 major, minor;
-  for(major = 0; major < major_count; major++) {
-    ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-    ecc_uint8 ecc_a = 0;
-    ecc_uint8 ecc_b = 0;
-    for(minor = 0; minor < minor_count; minor++) {
-      ecc_uint8 temp = src[index];
-      index += minor_inc;
-      if(index >= size) index -= size;
-      ecc_a ^= temp;
-      ecc_b ^= temp;
-      ecc_a = ecc_f_lut[ecc_a];
-    }
-    ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-    dest[major              ] = ecc_a;
-    dest[major + major_count] = ecc_a ^ ecc_b;
+struct tracks {
+  struct cuesheet cue;
+  int autodetect;
+  const char *cuename;
+  char *base;
+  int flags;
+  off_t total;
+  int cur;
+  FILE *f;
+  struct output out;
+  int open;
+  off_t pos;
+  off_t start[CUE_MAXTRACKS];
+  unsigned char head[16];
+  int full;
+  int error;
+};
+
+/*
+** Set up the layout from "cuefile", or NULL to find it in the image.  The
+** track files are named after "cuename", which is where their cue sheet
+** goes.
+*/
+int tracks_init(struct tracks *t, const char *cuefile, const char *cuename) {
+  size_t len = strlen(cuename);
+  int k;
+  memset(t, 0, sizeof(*t));
+  t->cuename = cuename;
+  t->total = -1;
+  t->cur = -1;
+  if(cuefile) {
+    if(cue_read(&t->cue, cuefile)) return 1;
+    if(t->cue.nfiles != 1) {
+      fprintf(stderr, "%s: the image has to be a single file\n", cuefile);
+      cue_free(&t->cue);
+      return 1;
+    }
+    for(k = 0; k < t->cue.ntracks; k++) {
+      if(t->cue.track[k].sectorsize != 2352) {
+        fprintf(stderr, "%s: track %02d isn't raw 2352-byte sectors\n", cuefile,
+          t->cue.track[k].number);
+        cue_free(&t->cue);
+        return 1;
+      }
+      /* Anything before the first index goes with the first track */
+      t->start[k] = k ? t->cue.track[k].indexpos[0] * 2352 : 0;
+    }
+  } else {
+    t->autodetect = 1;
+  }
+  if((len > 4) && !strcasecmp(cuename + len - 4, ".cue")) len -= 4;
+  t->base = malloc(len + 1);
+  if(!t->base) abort();
+  memcpy(t->base, cuename, len);
+  t->base[len] = 0;
+  return 0;
+}
+
+static char *track_filename(const struct tracks *t, int k, int single) {
+  char *name = malloc(strlen(t->base) + 20);
+  if(!name) abort();
+  if(single) {
+    sprintf(name, "%s.bin", t->base);
+  } else {
+    sprintf(name, "%s (Track %02d).bin", t->base, t->cue.track[k].number);
   }
+  return name;
+}
+
+static void tracks_close(struct tracks *t) {
+  if(!t->open) return;
+  if(output_close(&t->out)) t->error = 1;
+  if(fclose(t->f)) t->error = 1;
+  t->open = 0;
 }
 
 /*
-** Generate ECC P and Q codes for a block
+** Go on to the next track in the layout
 */
-static void ecc_generate(
-  ecc_uint8 *sector,
-  int        zeroaddress
-) {
-  ecc_uint8 address[4], i;
-  /* Save the address and zero it out */
-  if(zeroaddress) for(i = 0; i < 4; i++) {
-    address[i] = sector[12 + i];
-    sector[12 + i] = 0;
-  }
-  /* Compute ECC P code */
-  ecc_computeblock(sector + 0xC, 86, 24,  2, 86, sector + 0x81C);
-  /* Compute ECC Q code */
-  ecc_computeblock(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8);
-  /* Restore the address */
-  if(zeroaddress) for(i = 0; i < 4; i++) sector[12 + i] = address[i];
+static void tracks_next(struct tracks *t) {
+  char *name;
+  tracks_close(t);
+  t->cur++;
+  name = track_filename(t, t->cur, !t->autodetect && (t->cue.ntracks == 1));
+  t->f = fopen(name, "wb");
+  if(!t->f) {
+    perror(name);
+    t->error = 1;
+  } else if(output_open(&t->out, t->f, t->flags | ECMIO_SPARSE)) {
+    fclose(t->f);
+    t->error = 1;
+  } else {
+    t->open = 1;
+    if(!t->autodetect && (t->total >= 0)) {
+      off_t end = (t->cur + 1 < t->cue.ntracks) ? t->start[t->cur + 1] : t->total;
+      output_preallocate(&t->out, end - t->start[t->cur]);
+    }
+  }
+  free(name);
 }
 
-/***************************************************************************/
 /*
-** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
-** Returns 0 on success
+** With "auto": the sector that starts at "pos" has the header in "head".
+** Start a track if it's not like the one before.
 */
-void eccedc_generate(ecc_uint8 *sector, int type) {
-  ecc_uint32 i;
-  switch(type) {
-  case 1: /* Mode 1 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x00, 0x810, sector + 0x810);
-    /* Write out zero bytes */
-    for(i = 0; i < 8; i++) sector[0x814 + i] = 0;
-    /* Generate ECC P/Q codes */
-    ecc_generate(sector, 0);
-    break;
-  case 2: /* Mode 2 form 1 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x10, 0x808, sector + 0x818);
-    /* Generate ECC P/Q codes */
-    ecc_generate(sector, 1);
-    break;
-  case 3: /* Mode 2 form 2 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x10, 0x91C, sector + 0x92C);
-    break;
+static void tracks_detect(struct tracks *t, off_t pos) {
+  int mode = sync_header(t->head, -1) ? ((t->head[0x0F] == 2) ? 2 : 1) : 0;
+  struct cuetrack *tr;
+  if((t->cur >= 0) && (mode == t->cue.track[t->cur].mode)) return;
+  if(t->cue.ntracks == CUE_MAXTRACKS) {
+    /* A cue sheet can't hold any more */
+    if(!t->full) {
+      fprintf(stderr,
+        "More than %d tracks; the rest of the image is left in track %02d\n",
+        CUE_MAXTRACKS, CUE_MAXTRACKS);
+      t->full = 1;
+    }
+    return;
   }
+  tr = &t->cue.track[t->cue.ntracks];
+  tr->number = t->cue.ntracks + 1;
+  cue_settype(tr, mode ? ((mode == 2) ? "MODE2/2352" : "MODE1/2352") : "AUDIO");
+  tr->nindex = 1;
+  tr->indexnum[0] = 1;
+  tr->indexpos[0] = pos / 2352;
+  t->start[t->cue.ntracks++] = pos;
+  tracks_next(t);
 }
 
-/***************************************************************************/
+void tracks_write(struct tracks *t, const unsigned char *data, size_t len) {
+  while(len) {
+    size_t n = len;
+    if(t->autodetect) {
+      size_t at = (size_t)(t->pos % 2352);
+      if(at < 16) {
+        /* Hold the header back until the sector's track is known */
+        if(n > 16 - at) n = 16 - at;
+        memcpy(t->head + at, data, n);
+        t->pos += n;
+        data += n;
+        len -= n;
+        if(at + n == 16) {
+          tracks_detect(t, t->pos - 16);
+          if(t->open) output_put(&t->out, t->head, 16);
+        }
+        continue;
+      }
+      if(n > 2352 - at) n = 2352 - at;
+    } else {
+      if((t->cur + 1 < t->cue.ntracks) && (t->pos >= t->start[t->cur + 1])) {
+        tracks_next(t);
+        continue;
+      }
+      if((t->cur + 1 < t->cue.ntracks) && ((off_t)n > t->start[t->cur + 1] - t->pos)) {
+        n = (size_t)(t->start[t->cur + 1] - t->pos);
+      }
+    }
+    if(t->open) output_put(&t->out, data, n);
+    t->pos += n;
+    data += n;
+    len -= n;
+  }
+}
 
-off_t mycounter;
-off_t mycounter_total;
+/*
+** Close the last track and write the cue sheet for the track files.
+** Returns nonzero if anything went wrong.
+*/
+int tracks_finish(struct tracks *t) {
+  struct cuesheet *c = &t->cue;
+  FILE *f;
+  int k;
+  if(t->autodetect) {
+    size_t at = (size_t)(t->pos % 2352);
+    if((at && (at < 16)) || !c->ntracks) {
+      /* A sector too short to have a header (or no image at all) */
+      memset(t->head + at, 0, 16 - at);
+      tracks_detect(t, t->pos - at);
+      if(t->open) output_put(&t->out, t->head, at);
+    }
+  } else {
+    while((t->cur + 1 < c->ntracks) && (t->start[t->cur + 1] <= t->pos)) {
+      tracks_next(t);
+    }
+    if(t->cur + 1 < c->ntracks) {
+      fprintf(stderr, "The image ends before track %02d\n", c->track[t->cur + 1].number);
+      t->error = 1;
+    }
+  }
+  tracks_close(t);
+  if(t->error) return 1;
+  if(t->autodetect && (c->ntracks == 1)) {
+    char *from = track_filename(t, 0, 0);
+    char *to = track_filename(t, 0, 1);
+    remove(to);
+    if(rename(from, to)) {
+      perror(to);
+      t->error = 1;
+    }
+    free(from);
+    free(to);
+  }
+  /* Every track in a file of its own */
+  for(k = 0; k < c->nfiles; k++) free(c->files[k]);
+  c->nfiles = 0;
+  for(k = 0; k < c->ntracks; k++) {
+    struct cuetrack *tr = &c->track[k];
+    char *name = track_filename(t, k, c->ntracks == 1);
+    const char *p = name + strlen(name);
+    int i;
+    while((p > name) && (p[-1] != '/') && (p[-1] != '\\')) p--;
+    c->files[c->nfiles] = malloc(strlen(p) + 1);
+    if(!c->files[c->nfiles]) abort();
+    strcpy(c->files[c->nfiles], p);
+    free(name);
+    tr->file = c->nfiles++;
+    for(i = 0; i < tr->nindex; i++) tr->indexpos[i] -= t->start[k] / 2352;
+  }
+  f = fopen(t->cuename, "wb");
+  if(!f) {
+    perror(t->cuename);
+    return 1;
+  }
+  cue_write(c, f);
+  if(fclose(f)) {
+    perror(t->cuename);
+    return 1;
+  }
+  return t->error;
+}
 
-void resetcounter(off_t total) {
-  mycounter = 0;
-  mycounter_total = total;
+void tracks_free(struct tracks *t) {
+  tracks_close(t);
+  cue_free(&t->cue);
+  free(t->base);
 }
 
-void setcounter(off_t n) {
-  if((n >> 20) != (mycounter >> 20)) {
-    off_t a = (n+64)/128;
-    off_t d = (mycounter_total+64)/128;
-    if(!d) d = 1;
-    fprintf(stderr,
-#ifdef ORIGINAL_MODE
-      "Decoding (%02d%%)\r", (100*a) / d);
-#else
-      "Decoding (%02lld%%)\r", (100*a) / d);
-#endif
+/*
+** 2048 bytes of user data for the cooked image, or zeros if "data" is NULL.
+** With "--iso" the cooked image is the only one, and the digests are of it.
+*/
+static void sink_cook(struct sinks *s, const unsigned char *data) {
+  if(data) {
+    output_put(&s->iso, data, 0x800);
+    if(s->isoonly) digester_update(&s->dg, data, 0x800);
+  } else {
+    output_zeros(&s->iso, 0x800);
+    if(s->isoonly) digester_zeros(&s->dg, 0x800);
   }
-  mycounter = n;
 }
 
+/*
+** Put raw sectors together from the image, and cook them
+*/
+static void sink_raw(struct sinks *s, const unsigned char *data, size_t len) {
+  while(len) {
+    size_t b;
+    if(!s->rawfill) {
+      /* Skip to where the next sector would start */
+      size_t to = (size_t)((2352 - (s->pos - s->boundary) % 2352) % 2352);
+      if(to) {
+        if(to > len) to = len;
+        s->pos += to;
+        data += to;
+        len -= to;
+        continue;
+      }
+    }
+    b = 2352 - s->rawfill;
+    if(b > len) b = len;
+    memcpy(s->raw + s->rawfill, data, b);
+    s->rawfill += b;
+    s->pos += b;
+    data += b;
+    len -= b;
+    if(s->rawfill == 2352) {
+      s->rawfill = 0;
+      if(!sync_header(s->raw, -1)) continue;
+      switch(s->raw[0x0F]) {
+      case 1:  sink_cook(s, s->raw + 0x10); break;
+      case 2:  sink_cook(s, s->raw + 0x18); break;
+      default: sink_cook(s, NULL);          break;
+      }
+    }
+  }
+}
+
+/*
+** Literal bytes of the image.  The last 16 are kept around, since they may
+** be the header of a mode 2 sector.
+*/
+void sinks_literal(struct sinks *s, const unsigned char *data, size_t len) {
+  if(!s->isoonly) digester_update(&s->dg, data, len);
+  if(s->tracks) tracks_write(s->tracks, data, len);
+  if(s->cooked) {
+    if(len >= 16) {
+      memcpy(s->last, data + len - 16, 16);
+    } else {
+      memmove(s->last, s->last + len, 16 - len);
+      memcpy(s->last + 16 - len, data, len);
+    }
+    sink_raw(s, data, len);
+  } else {
+    s->pos += len;
+  }
+}
+
+/*
+** A reconstructed sector: 2352 bytes for type 1, or the 2336 bytes of a
+** mode 2 sector after the header for types 2 and 3
+*/
+void sinks_sector(struct sinks *s, const unsigned char *data, size_t len, int type) {
+  if(!s->isoonly) digester_update(&s->dg, data, len);
+  if(s->tracks) tracks_write(s->tracks, data, len);
+  if(s->cooked) {
+    if(type != 1 && !sync_header(s->last, 2)) {
+      memcpy(s->last, data + len - 16, 16);
+      sink_raw(s, data, len);
+      return;
+    }
+    sink_cook(s, data + (type == 1 ? 0x10 : 0x08));
+    memcpy(s->last, data + len - 16, 16);
+    s->rawfill = 0;
+  }
+  s->pos += len;
+  s->boundary = s->pos;
+}
+
+/*
+** With "--iso" there's no raw image, and sectors are cooked straight from
+** their records (decoded with ECM_NOREBUILD into "sector"), which hold the
+** user data as it is: no sync, EDC or ECC is generated.  A mode 2 record
+** that doesn't follow its header is raw data though, and is reconstructed
+** in full as usual.  Whether the next record follows a header depends on
+** the last 16 bytes of the sector; for mode 1 and mode 2 form 1 those are
+** ECC, which is taken not to look like a header (the odds are 2^-104), and
+** for form 2 the EDC at the end is generated only if the data before it
+** does.
+*/
+static void iso_sector(struct sinks *s, unsigned char *sector, int type) {
+  if(type == 1) {
+    sink_cook(s, sector + 0x010);
+    memset(s->last, 0, 16);
+    s->rawfill = 0;
+    s->pos += 2352;
+    s->boundary = s->pos;
+    return;
+  }
+  if(!sync_header(s->last, 2)) {
+    ecm_sector_rebuild(sector, type);
+    sinks_sector(s, sector + 0x10, 2336, type);
+    return;
+  }
+  sink_cook(s, sector + 0x018);
+  if((type == 3) && !memcmp(sector + 0x920, sync_pattern, sizeof(sync_pattern))) {
+    ecm_sector_rebuild(sector, 3);
+    memcpy(s->last, sector + 0x920, 16);
+  } else {
+    memset(s->last, 0, 16);
+  }
+  s->rawfill = 0;
+  s->pos += 2336;
+  s->boundary = s->pos;
+}
+
+/*
+** Long literal runs go straight from the ECM file to the output without
+** passing through user space (see output_passthrough), and the decoder
+** is moved past them.  The EDC is computed from a mapped view of the ECM
+** file instead of a copy of the data.  Returns how many bytes were handled.
+*/
+#define PASSTHROUGH_MIN   (65536)
+#define PASSTHROUGH_PIECE (67108864)
+
+off_t passthrough(
+  struct input *i,
+  struct output *o,
+  struct sinks *s,
+  off_t num,
+  struct ecm_decoder *d
+) {
+  off_t done = 0;
+  /* Mapping the input would pull it into the page cache after all */
+  if(!i->regular || i->direct || (num < PASSTHROUGH_MIN)) return 0;
+  while(done < num) {
+    struct view v;
+    off_t piece = num - done;
+    off_t r;
+    if(piece > PASSTHROUGH_PIECE) piece = PASSTHROUGH_PIECE;
+    /* A record running past the end is left to input_read to report */
+    if(piece > i->size - i->pos) piece = i->size - i->pos;
+    if(piece <= 0 || view_map(&v, fileno(i->f), i->pos, (size_t)piece)) break;
+    r = output_passthrough(o, fileno(i->f), i->pos, piece, v.data);
+    ecm_decode_skip(d, v.data, (uint64_t)r);
+    sinks_literal(s, v.data, (size_t)r);
+    view_unmap(&v);
+    if(r) input_skip(i, r);
+    done += r;
+    setcounter(i->pos);
+    if(r < piece) break;
+  }
+  return done;
+}
+
+/*
+** Decode "in" to "out", and to "iso" (if not NULL) as a cooked image.
+** "digests" is the set of digests to compute of the decoded image, which
+** also go to "digestfile" (if not NULL) in machine-readable form.
+**
+** With "out" NULL, the image goes to "tracks" instead if that's not NULL.
+** Otherwise only the cooked image is written (see iso_sector), and the
+** digests are of that.  The EDC can't be checked then.
+*/
 int unecmify(
   FILE *in,
-  FILE *out
+  FILE *out,
+  FILE *iso,
+  struct tracks *tracks,
+  int digests,
+  FILE *digestfile,
+  int ioflags
 ) {
-  ecc_uint32 checkedc = 0;
-  unsigned char sector[2352];
-  ecc_uint32 type;
-  off_t num;
-  fseek(in, 0, SEEK_END);
-  resetcounter(ftell(in));
-  fseek(in, 0, SEEK_SET);
-  if(
-    (fgetc(in) != 'E') ||
-    (fgetc(in) != 'C') ||
-    (fgetc(in) != 'M') ||
-    (fgetc(in) != 0x00)
-  ) {
-    fprintf(stderr, "Header not found!\n");
-    goto corrupt;
+  struct ecm_decoder d;
+  unsigned char buf[2352];
+  unsigned char scratch[2352];
+  unsigned char trailer[4];
+  int edcbad = 0;
+  struct input i;
+  struct output o;
+  struct sinks s;
+  if(!fseek(in, 0, SEEK_END)) {
+    resetcounter(ftell(in));
+    fseek(in, 0, SEEK_SET);
+  } else {
+    resetcounter(-1);
   }
-  for(;;) {
-    int c = fgetc(in);
-    unsigned int bits = 5;
-    if(c == EOF) goto uneof;
-    type = c & 3;
-    num = (c >> 2) & 0x1F;
-    while(c & 0x80) {
-      c = fgetc(in);
-      if(c == EOF) goto uneof;
-      num |= ((off_t)(c & 0x7F)) << bits;
-      bits += 7;
+  if(out && output_open(&o, out, ioflags | ECMIO_SPARSE)) return 1;
+  memset(&s, 0, sizeof(s));
+  if(iso) {
+    if(output_open(&s.iso, iso, ioflags | ECMIO_SPARSE)) {
+      if(out) output_close(&o);
+      return 1;
     }
-    if(num == 0xFFFFFFFF) break;
-    num++;
-    if(num >= 0x8000000000000000) goto corrupt;
-    if(!type) {
-      while(num) {
-        ecc_uint16 b = (num > 2352 ? 2352 : (ecc_uint16)num);
-        if(fread(sector, 1, b, in) != b) goto uneof;
-        checkedc = edc_partial_computeblock(checkedc, sector, b);
-        fwrite(sector, 1, b, out);
-        num -= b;
-        setcounter(ftell(in));
-      }
+    s.cooked = 1;
+    s.isoonly = !out && !tracks;
+  }
+  if(tracks) {
+    tracks->flags = ioflags;
+    s.tracks = tracks;
+  }
+  digester_start(&s.dg, digests);
+  if(((out && o.sparse) || tracks) && (mycounter_total >= 0)) {
+    off_t size;
+#ifdef __linux__
+    /* The scan only needs the headers; don't read ahead or keep the rest */
+    if(ioflags & ECMIO_DIRECT) posix_fadvise(fileno(in), 0, 0, POSIX_FADV_RANDOM);
+#endif
+    size = prescan(in, mycounter_total);
+    if(out) output_preallocate(&o, size);
+    if(tracks) tracks->total = size;
+    fseek(in, 0, SEEK_SET);
+#ifdef __linux__
+    if(ioflags & ECMIO_DIRECT) posix_fadvise(fileno(in), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  }
+  input_open(&i, in, ioflags);
+  ecm_decoder_init(&d);
+  if(s.isoonly) d.flags = ECM_NOREBUILD;
+  /*
+  ** The decoder is given just what it takes next, and record data a unit
+  ** at a time, so each sector goes to the sinks whole, with its type
+  */
+  for(;;) {
+    const unsigned char *src = buf;
+    unsigned char *sector;
+    unsigned char *dest;
+    size_t n, room;
+    int part;
+    uint64_t want = ecm_decode_next(&d, &part);
+    int r;
+    if(!part && out && passthrough(&i, &o, &s, (off_t)want, &d)) continue;
+    if(part > 0) {
+      n = ecm_unit_file[part];
+      room = ecm_unit_image[part];
     } else {
-      while(num--) {
-        memset(sector, 0, sizeof(sector));
-        memset(sector + 1, 0xFF, 10);
-        switch(type) {
-        case 1:
-          sector[0x0F] = 0x01;
-          if(fread(sector + 0x00C, 1, 0x003, in) != 0x003) goto uneof;
-          if(fread(sector + 0x010, 1, 0x800, in) != 0x800) goto uneof;
-          eccedc_generate(sector, 1);
-          checkedc = edc_partial_computeblock(checkedc, sector, 2352);
-          fwrite(sector, 2352, 1, out);
-          setcounter(ftell(in));
-          break;
-        case 2:
-          sector[0x0F] = 0x02;
-          if(fread(sector + 0x014, 1, 0x804, in) != 0x804) goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 2);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-          fwrite(sector + 0x10, 2336, 1, out);
-          setcounter(ftell(in));
-          break;
-        case 3:
-          sector[0x0F] = 0x02;
-          if(fread(sector + 0x014, 1, 0x918, in) != 0x918) goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 3);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-          fwrite(sector + 0x10, 2336, 1, out);
-          setcounter(ftell(in));
-          break;
-        }
+      n = (want > sizeof(buf)) ? sizeof(buf) : (size_t)want;
+      room = part ? 0 : n;
+    }
+    if(input_read(&i, buf, n) != n) {
+      if(part == ECM_MAGIC) goto nomagic;
+      goto uneof;
+    }
+    if(part == ECM_TRAILER) memcpy(trailer, buf, 4);
+    /* Mode 2 sectors are output without the first 0x10 bytes */
+    sector = (out && room) ? output_reserve(&o, room) : scratch + (part > 1 ? 0x10 : 0);
+    dest = sector;
+    r = ecm_decode(&d, &src, &n, &dest, &room);
+    if(r == ECM_ERROR) {
+      if(part == ECM_MAGIC) goto nomagic;
+      if(part != ECM_TRAILER) goto corrupt;
+      /* Said after the report */
+      edcbad = 1;
+      break;
+    }
+    if(part >= 0) {
+      if(s.isoonly && part) {
+        iso_sector(&s, scratch, part);
+      } else if(!part) {
+        sinks_literal(&s, sector, (size_t)(dest - sector));
+      } else {
+        sinks_sector(&s, sector, (size_t)(dest - sector), part);
       }
+      if(out) output_commit(&o, (size_t)(dest - sector));
+      setcounter(i.pos);
     }
+    if(r == ECM_END) break;
+  }
+  input_close(&i);
+  digester_finish(&s.dg);
+  if((out && output_close(&o)) || (s.cooked && output_close(&s.iso))) {
+    perror("write");
+    return 1;
+  }
+  if(tracks && tracks_finish(tracks)) {
+    fprintf(stderr, "Couldn't write the tracks\n");
+    return 1;
   }
-  if(fread(sector, 1, 4, in) != 4) goto uneof;
   char strbuff1[64], strbuff2[64];
-  fprintf(stderr, "Decoded %s -> %s\n", GetByteSize(ftell(in), strbuff1), GetByteSize(ftell(out), strbuff2));
-  if(
-    (sector[0] != ((checkedc >>  0) & 0xFF)) ||
-    (sector[1] != ((checkedc >>  8) & 0xFF)) ||
-    (sector[2] != ((checkedc >> 16) & 0xFF)) ||
-    (sector[3] != ((checkedc >> 24) & 0xFF))
-  ) {
+  if(s.isoonly) {
+    fprintf(stderr, "Extracted %s -> %s\n", GetByteSize(i.pos, strbuff1), GetByteSize(s.iso.total, strbuff2));
+    digests_print(&s.dg.d, stderr, 1);
+    if(digestfile) digests_print(&s.dg.d, digestfile, 0);
+    fprintf(stderr, "Done; EDC not checked\n");
+    return 0;
+  }
+  fprintf(stderr, "Decoded %s -> %s\n", GetByteSize(i.pos, strbuff1),
+    GetByteSize(out ? o.total : tracks ? tracks->pos : s.pos, strbuff2));
+  if(tracks) {
+    fprintf(stderr, "Tracks.................. %10d\n", tracks->cue.ntracks);
+  }
+  if(s.cooked) {
+    fprintf(stderr, "Cooked image............ %s\n", GetByteSize(s.iso.total, strbuff1));
+  }
+  digests_print(&s.dg.d, stderr, 1);
+  if(edcbad) {
     fprintf(stderr, "EDC error (%08X, should be %02X%02X%02X%02X)\n",
-      checkedc,
-      sector[3],
-      sector[2],
-      sector[1],
-      sector[0]
+      d.edc,
+      trailer[3],
+      trailer[2],
+      trailer[1],
+      trailer[0]
     );
     goto corrupt;
   }
+  if(digestfile) digests_print(&s.dg.d, digestfile, 0);
   fprintf(stderr, "Done; file is OK\n");
   return 0;
+nomagic:
+  fprintf(stderr, "Header not found!\n");
+  goto corrupt;
 uneof:
   fprintf(stderr, "Unexpected EOF!\n");
 corrupt:
+  input_close(&i);
+  digester_finish(&s.dg);
+  if(out) output_close(&o);
+  if(s.cooked) output_close(&s.iso);
   fprintf(stderr, "Corrupt ECM file!\n");
   return 1;
 }
 
+/*
+** Decode the ECM v2 file "in" (see ecm2.h) like unecmify(), with "out",
+** "iso" and "tracks" as there.  The chunks are decoded a batch at a time on
+** every CPU at once, each checked against its own EDC, and their image goes
+** out in order.  With nowhere for it to go, the file is only checked, and
+** every chunk that's wrong is listed, with its sectors, instead of stopping
+** at the first.
+*/
+struct chunkjob {
+  off_t k;
+  unsigned char *data;
+  size_t size;
+  unsigned char *image;
+  int bad;
+};
+
+struct chunkbatch {
+  const struct ecm2 *v;
+  struct chunkjob *job;
+};
+
+static int decode_job(void *arg, size_t k) {
+  struct chunkbatch *b = arg;
+  struct chunkjob *j = b->job + k;
+  j->bad = ecm2_decode_chunk(b->v, j->k, j->data, j->image);
+  return j->bad;
+}
+
+/*
+** Pass the image of a chunk that checked out on to the sinks, a record at a
+** time as unecmify() does, so sectors are cooked where the records put them
+*/
+static void sinks_chunk(struct sinks *s, const unsigned char *data, size_t len, const unsigned char *image) {
+  size_t at = 0;
+  while(at < len) {
+    unsigned bits = 5;
+    int c = data[at++];
+    int type = c & 3;
+    off_t num = (c >> 2) & 0x1F;
+    while(c & 0x80) {
+      c = data[at++];
+      num |= ((off_t)(c & 0x7F)) << bits;
+      bits += 7;
+    }
+    if(num == 0xFFFFFFFF) break;
+    num++;
+    at += (size_t)num * ecm_unit_file[type];
+    if(!type) {
+      sinks_literal(s, image, (size_t)num);
+      image += num;
+      continue;
+    }
+    while(num--) {
+      sinks_sector(s, image, ecm_unit_image[type], type);
+      image += ecm_unit_image[type];
+    }
+  }
+}
+
+int unecmify2(
+  FILE *in,
+  FILE *out,
+  FILE *iso,
+  struct tracks *tracks,
+  int digests,
+  FILE *digestfile,
+  int ioflags
+) {
+  struct ecm2 v;
+  struct chunkbatch b;
+  struct output o;
+  struct sinks s;
+  unsigned threads = ecm2_threads();
+  size_t batch = (size_t)threads * 4;
+  int checkonly = !out && !iso && !tracks;
+  int corrupt = 0;
+  off_t bad = 0;
+  off_t k;
+  size_t n, j;
+  int ret = 1;
+  char strbuff1[64], strbuff2[64];
+  if(ecm2_load(&v, in)) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  resetcounter(v.count ? v.chunk[v.count - 1].file + v.chunk[v.count - 1].len : 0);
+  if(out && output_open(&o, out, ioflags | ECMIO_SPARSE)) {
+    ecm2_free(&v);
+    return 1;
+  }
+  if(out && o.sparse) output_preallocate(&o, v.imagesize);
+  memset(&s, 0, sizeof(s));
+  if(iso) {
+    if(output_open(&s.iso, iso, ioflags | ECMIO_SPARSE)) {
+      if(out) output_close(&o);
+      ecm2_free(&v);
+      return 1;
+    }
+    s.cooked = 1;
+    s.isoonly = !out && !tracks;
+  }
+  if(tracks) {
+    tracks->flags = ioflags;
+    tracks->total = v.imagesize;
+    s.tracks = tracks;
+  }
+  digester_start(&s.dg, digests);
+  b.v = &v;
+  b.job = calloc(batch, sizeof(*b.job));
+  if(!b.job) abort();
+  for(j = 0; j < batch; j++) {
+    b.job[j].image = malloc(v.chunksize);
+    if(!b.job[j].image) {
+      fprintf(stderr, "Out of memory\n");
+      goto done;
+    }
+  }
+  for(k = 0; k < v.count; k += (off_t)n) {
+    n = (v.count - k < (off_t)batch) ? (size_t)(v.count - k) : batch;
+    for(j = 0; j < n; j++) {
+      struct chunkjob *c = b.job + j;
+      const struct ecm2_chunk *e = v.chunk + k + (off_t)j;
+      c->k = k + (off_t)j;
+      if(c->size < e->len) {
+        free(c->data);
+        c->data = malloc(e->len);
+        c->size = c->data ? e->len : 0;
+        if(!c->data) {
+          fprintf(stderr, "Out of memory\n");
+          goto done;
+        }
+      }
+      if(fseeko(in, e->file, SEEK_SET) || (fread(c->data, 1, e->len, in) != e->len)) {
+        fprintf(stderr, "Unexpected EOF!\n");
+        corrupt = 1;
+        goto done;
+      }
+    }
+    ecm2_run(decode_job, &b, n, threads);
+    for(j = 0; j < n; j++) {
+      struct chunkjob *c = b.job + j;
+      size_t len = ecm2_image(&v, c->k);
+      if(c->bad) {
+        off_t first = c->k * (v.chunksize / 2352);
+        bad++;
+        fprintf(stderr,
+#ifdef ORIGINAL_MODE
+          "Chunk %d (sectors %d-%d) is corrupt\n",
+          c->k, first, first + (off_t)(len + 2351) / 2352 - 1);
+#else
+          "Chunk %lld (sectors %lld-%lld) is corrupt\n",
+          (long long)c->k, (long long)first,
+          (long long)(first + (off_t)(len + 2351) / 2352 - 1));
+#endif
+        if(checkonly) continue;
+        goto done;
+      }
+      if(out) output_put(&o, c->image, len);
+      sinks_chunk(&s, c->data, v.chunk[c->k].len, c->image);
+      setcounter(v.chunk[c->k].file + v.chunk[c->k].len);
+    }
+  }
+  ret = 0;
+done:
+  digester_finish(&s.dg);
+  for(j = 0; j < batch; j++) {
+    free(b.job[j].data);
+    free(b.job[j].image);
+  }
+  free(b.job);
+  if((out && output_close(&o)) || (s.cooked && output_close(&s.iso))) {
+    perror("write");
+    ret = 1;
+  }
+  if(!ret && !bad && tracks && tracks_finish(tracks)) {
+    fprintf(stderr, "Couldn't write the tracks\n");
+    ret = 1;
+  }
+  if(bad) {
+    fprintf(stderr,
+#ifdef ORIGINAL_MODE
+      "%d of %d chunks are corrupt\n",
+      bad, v.count);
+#else
+      "%lld of %lld chunks are corrupt\n",
+      (long long)bad, (long long)v.count);
+#endif
+  } else if(!ret) {
+    fprintf(stderr, "Decoded %s -> %s\n", GetByteSize(mycounter_total, strbuff1),
+      GetByteSize(v.imagesize, strbuff2));
+    fprintf(stderr,
+#ifdef ORIGINAL_MODE
+      "Chunks.................. %10d\n", v.count);
+#else
+      "Chunks.................. %10lld\n", (long long)v.count);
+#endif
+    if(tracks) {
+      fprintf(stderr, "Tracks.................. %10d\n", tracks->cue.ntracks);
+    }
+    if(s.cooked) {
+      fprintf(stderr, "Cooked image............ %s\n", GetByteSize(s.iso.total, strbuff1));
+    }
+    digests_print(&s.dg.d, stderr, 1);
+    if(digestfile) digests_print(&s.dg.d, digestfile, 0);
+    fprintf(stderr, "Done; file is OK\n");
+  }
+  ecm2_free(&v);
+  if(bad || corrupt) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  return ret;
+}
+
 /***************************************************************************/
+/*
+** Decode "count" sectors of the image from sector "first" on, raw or (with
+** "--iso") cooked.  The index says where in the records to start, so only
+** the records those sectors are in are read, and only those sectors are
+** reconstructed.  The EDC of the whole file can't be checked then.
+*/
+#define SECTORS_CHUNK (256)
+
+int unecm_sectors(const char *ecmname, FILE *out, off_t first, off_t count, int mode) {
+  struct ecm_reader r;
+  unsigned char *buf;
+  off_t total = 0;
+  char strbuff[64];
+  if(ecm_open(&r, ecmname)) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  if(first >= r.sectors) {
+    fprintf(stderr, "The image doesn't have those sectors\n");
+    ecm_close(&r);
+    return 1;
+  }
+  buf = malloc(SECTORS_CHUNK * 2352);
+  if(!buf) abort();
+  if(count > r.sectors - first) count = r.sectors - first;
+  while(count > 0) {
+    off_t n = (count < SECTORS_CHUNK) ? count : SECTORS_CHUNK;
+    off_t got = ecm_pread(&r, buf, first, n, mode);
+    if(got < 0) {
+      fprintf(stderr, "Corrupt ECM file!\n");
+      free(buf);
+      ecm_close(&r);
+      return 1;
+    }
+    fwrite(buf, 1, (size_t)got, out);
+    total += got;
+    first += n;
+    count -= n;
+  }
+  free(buf);
+  ecm_close(&r);
+  if(fflush(out) || ferror(out)) {
+    perror("write");
+    return 1;
+  }
+  fprintf(stderr, "Decoded %s of the image; EDC not checked\n", GetByteSize(total, strbuff));
+  return 0;
+}
+
+/*
+** Serve the image to NBD clients on a Unix socket until stopped, with a
+** sector cache and read-ahead for the clients' sequential reads
+*/
+#define NBD_CACHE    (64)
+#define NBD_PREFETCH (256)
+
+int unecm_nbd(const char *ecmname, const char *socketname) {
+  struct ecm_reader r;
+  char strbuff[64];
+  int ret;
+  if(ecm_open(&r, ecmname)) {
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+  }
+  if(!ecm_cache(&r, (size_t)NBD_CACHE * 1048576)) ecm_prefetch(&r, NBD_PREFETCH);
+  fprintf(stderr, "Serving %s of %s on %s\n",
+    GetByteSize(r.idx.imagesize, strbuff), ecmname, socketname);
+  ret = ecmnbd_serve(&r, socketname);
+  ecm_close(&r);
+  return ret;
+}
+
+/***************************************************************************/
+
+void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options] ecmfile [outputfile]\n"
+    "       Use - for standard input/output.  When reading standard input,\n"
+    "       outputfile defaults to standard output.\n"
+    "\n"
+    "options:\n"
+    "  --iso           Write only the user data of each sector (an .iso), without\n"
+    "                  reconstructing the rest; the EDC can't be checked then\n"
+    "  --cooked file   Also write the user data of each sector (an .iso) to file\n"
+    "  --split cuefile Write one file per track, as laid out in cuefile (a cue\n"
+    "                  sheet for the whole image), and a cue sheet for them as\n"
+    "                  outputfile; with auto instead of cuefile, start a track\n"
+    "                  wherever the sector mode changes\n"
+    "  --sectors first[,count]\n"
+    "                  Decode only count sectors (default 1) from sector first\n"
+    "                  on, to standard output by default, using the index; with\n"
+    "                  --iso, just their user data\n"
+    "  --index         Write an index (image.bin.ecmidx for image.bin.ecm) so\n"
+    "                  --sectors can go straight to the sectors, and exit\n"
+    "  --index-step n  Index every n sectors (default 16)\n"
+    "  --verify        Decode without writing anything, to check the file; every\n"
+    "                  corrupt chunk of a v2 file is listed\n"
+    "  --nbd socket    Serve the image read-only over NBD on the Unix socket,\n"
+    "                  reconstructing just the sectors clients read\n"
+    "  --digest list   Compute digests of the decoded image: any of crc32, md5,\n"
+    "                  sha1 and sha256, separated by commas, or all\n"
+    "  --digest-file file\n"
+    "                  Also write the digests to file (- for standard output)\n"
+    "                  as \"name hex\" lines; implies --digest all by default\n"
+#ifdef HAVE_IO_URING
+    "  --uring         Use io_uring for file input and output\n"
+#endif
+#ifdef __linux__
+    "  --direct        Bypass the page cache (O_DIRECT)\n"
+    "  --nocache       Drop input and output from the page cache behind us\n"
+#endif
+    , name
+  );
+}
 
 int main(int argc, char **argv) {
-  FILE *fin, *fout;
-  char *infilename;
-  char *outfilename;
+  FILE *fin, *fout = NULL, *fiso = NULL;
+  char *infilename = NULL;
+  char *outfilename = NULL;
+  char *isofilename = NULL;
+  char *digestfilename = NULL;
+  FILE *fdigest = NULL;
+  int digests = 0;
+  int isoonly = 0;
+  char *splitfrom = NULL;
+  struct tracks tracks;
+  int index = 0;
+  struct ecmidx x;
+  unsigned indexstep = ECMIDX_STEP;
+  off_t first = -1;
+  off_t count = 1;
+  char *nbdsocket = NULL;
+  int verify = 0;
+  int v2 = 0;
+  int ioflags = 0;
+  int ret;
+  int i;
   banner();
   /*
   ** Initialize the ECC/EDC tables
   */
-  eccedc_init();
+  ecm_init();
   /*
   ** Check command line
   */
-  if((argc != 2) && (argc != 3)) {
-    fprintf(stderr, "usage: %s ecmfile [outputfile]\n", argv[0]);
+  for(i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--iso")) {
+      isoonly = 1;
+      continue;
+    }
+    if(!strcmp(argv[i], "--cooked") && (i + 1 < argc)) {
+      isofilename = argv[++i];
+      continue;
+    }
+    if(!strcmp(argv[i], "--split") && (i + 1 < argc)) {
+      splitfrom = argv[++i];
+      continue;
+    }
+    if(!strcmp(argv[i], "--index")) {
+      index = 1;
+      continue;
+    }
+    if(!strcmp(argv[i], "--index-step") && (i + 1 < argc)) {
+      char *end;
+      unsigned long n = strtoul(argv[++i], &end, 10);
+      if(*end || !n || (n > 0xFFFFFFFFUL)) {
+        fprintf(stderr, "bad index step '%s'\n", argv[i]);
+        return 1;
+      }
+      indexstep = (unsigned)n;
+      continue;
+    }
+    if(!strcmp(argv[i], "--sectors") && (i + 1 < argc)) {
+      char *end;
+      first = (off_t)strtoull(argv[++i], &end, 10);
+      if(*end == ',') count = (off_t)strtoull(end + 1, &end, 10);
+      if(*end || (argv[i][0] == ',') || (first < 0) || (count < 1)) {
+        fprintf(stderr, "bad sectors '%s'\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if(!strcmp(argv[i], "--verify")) {
+      verify = 1;
+      continue;
+    }
+    if(!strcmp(argv[i], "--nbd") && (i + 1 < argc)) {
+      nbdsocket = argv[++i];
+      continue;
+    }
+    if(!strcmp(argv[i], "--digest") && (i + 1 < argc)) {
+      digests = digests_parse(argv[++i]);
+      if(digests < 0) {
+        fprintf(stderr, "unknown digest in '%s'\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if(!strcmp(argv[i], "--digest-file") && (i + 1 < argc)) {
+      digestfilename = argv[++i];
+      continue;
+    }
+#ifdef HAVE_IO_URING
+    if(!strcmp(argv[i], "--uring")) {
+      ioflags |= ECMIO_URING;
+      continue;
+    }
+#endif
+#ifdef __linux__
+    if(!strcmp(argv[i], "--direct")) {
+      ioflags |= ECMIO_DIRECT;
+      continue;
+    }
+    if(!strcmp(argv[i], "--nocache")) {
+      ioflags |= ECMIO_NOCACHE;
+      continue;
+    }
+#endif
+    if(argv[i][0] == '-' && argv[i][1]) {
+      usage(argv[0]);
+      return 1;
+    } else if(!infilename) {
+      infilename = argv[i];
+    } else if(!outfilename) {
+      outfilename = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(!infilename) {
+    usage(argv[0]);
     return 1;
   }
-  /*
-  ** Verify that the input filename is valid
-  */
-  infilename = argv[1];
-  if(strlen(infilename) < 5) {
-    fprintf(stderr, "filename '%s' is too short\n", infilename);
+  if(isoonly && isofilename) {
+    fprintf(stderr, "--iso and --cooked can't be used together\n");
     return 1;
   }
-  if(strcasecmp(infilename + strlen(infilename) - 4, ".ecm")) {
-    fprintf(stderr, "filename must end in .ecm\n");
+  if(isoonly && splitfrom) {
+    fprintf(stderr, "--iso and --split can't be used together\n");
     return 1;
   }
+  if(digestfilename && !digests) digests = DIGEST_ALL;
+  if(verify && (isoonly || isofilename || splitfrom || index || (first >= 0) || nbdsocket || outfilename)) {
+    fprintf(stderr, "--verify can't be used with an output file or options other than --digest\n");
+    return 1;
+  }
+  if(nbdsocket) {
+    if(isoonly || isofilename || splitfrom || digests || index || (first >= 0) || outfilename) {
+      fprintf(stderr, "--nbd can't be used with an output file or other options\n");
+      return 1;
+    }
+    if(!strcmp(infilename, "-")) {
+      fprintf(stderr, "--nbd needs an ECM file, not a pipe\n");
+      return 1;
+    }
+    return unecm_nbd(infilename, nbdsocket);
+  }
+  if(index || (first >= 0)) {
+    if(isofilename || splitfrom || digests) {
+      fprintf(stderr, "--index and --sectors can't be used with --cooked, --split or --digest\n");
+      return 1;
+    }
+    if(index && isoonly) {
+      fprintf(stderr, "--index can't be used with --iso\n");
+      return 1;
+    }
+    if(index && (first >= 0)) {
+      fprintf(stderr, "--index and --sectors can't be used together\n");
+      return 1;
+    }
+    if(!strcmp(infilename, "-")) {
+      fprintf(stderr, "--index and --sectors need an ECM file, not a pipe\n");
+      return 1;
+    }
+    if(index) {
+      if(outfilename) {
+        usage(argv[0]);
+        return 1;
+      }
+      fin = fopen(infilename, "rb");
+      if(!fin) {
+        perror(infilename);
+        return 1;
+      }
+      if(ecm2_probe(fin)) {
+        fprintf(stderr, "%s is a v2 file, which has its index built in\n", infilename);
+        fclose(fin);
+        return 1;
+      }
+      ret = ecmidx_save(&x, fin, infilename, indexstep);
+      if(!ret) {
+        char strbuff[64];
+        fprintf(stderr, "Indexed %s in %lu entries\n",
+          GetByteSize(x.imagesize, strbuff), (unsigned long)x.count);
+        ecmidx_free(&x);
+      }
+      fclose(fin);
+      return ret;
+    }
+    /* Just a few sectors, so they go to standard output by default */
+    if(!outfilename) outfilename = "-";
+  }
   /*
   ** Figure out what the output filename should be
   */
-  if(argc == 3) {
-    outfilename = argv[2];
+  if(!outfilename && !verify) {
+    if(!strcmp(infilename, "-")) {
+      outfilename = "-";
+    } else {
+      /*
+      ** Verify that the input filename is valid
+      */
+      if(strlen(infilename) < 5) {
+        fprintf(stderr, "filename '%s' is too short\n", infilename);
+        return 1;
+      }
+      if(strcasecmp(infilename + strlen(infilename) - 4, ".ecm")) {
+        fprintf(stderr, "filename must end in .ecm\n");
+        return 1;
+      }
+      outfilename = malloc(strlen(infilename) + 1);
+      if(!outfilename) abort();
+      memcpy(outfilename, infilename, strlen(infilename) - 4);
+      outfilename[strlen(infilename) - 4] = 0;
+      if(isoonly || splitfrom) {
+        /* image.bin.ecm -> image.iso, or image.cue */
+        size_t len = strlen(outfilename);
+        if((len > 4) && !strcasecmp(outfilename + len - 4, ".bin")) {
+          outfilename[len - 4] = 0;
+        }
+        strcat(outfilename, isoonly ? ".iso" : ".cue");
+      }
+    }
+  }
+  if(splitfrom) {
+    if(!strcmp(outfilename, "-")) {
+      fprintf(stderr, "--split needs a name for the cue sheet to write\n");
+      return 1;
+    }
+    if(!strcmp(outfilename, splitfrom)) {
+      fprintf(stderr, "the cue sheet to write would replace %s\n", splitfrom);
+      return 1;
+    }
+    if(tracks_init(&tracks, strcmp(splitfrom, "auto") ? splitfrom : NULL, outfilename)) {
+      return 1;
+    }
+  }
+  if(verify) {
+    fprintf(stderr, "Checking %s.\n", strcmp(infilename, "-") ? infilename : "(stdin)");
   } else {
-    outfilename = malloc(strlen(infilename) - 3);
-    if(!outfilename) abort();
-    memcpy(outfilename, infilename, strlen(infilename) - 4);
-    outfilename[strlen(infilename) - 4] = 0;
+    fprintf(stderr, "Decoding %s to %s.\n",
+      strcmp(infilename, "-") ? infilename : "(stdin)",
+      strcmp(outfilename, "-") ? outfilename : "(stdout)"
+    );
   }
-  fprintf(stderr, "Decoding %s to %s.\n", infilename, outfilename);
   /*
   ** Open both files
   */
-  fin = fopen(infilename, "rb");
-  if(!fin) {
-    perror(infilename);
-    return 1;
+  if(!strcmp(infilename, "-")) {
+    fin = stdin;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  } else {
+    fin = fopen(infilename, "rb");
+    if(!fin) {
+      perror(infilename);
+      return 1;
+    }
+    v2 = ecm2_probe(fin);
   }
-  fout = fopen(outfilename, "wb");
-  if(!fout) {
-    perror(outfilename);
-    fclose(fin);
-    return 1;
+  if(splitfrom || verify) {
+    /*
+    ** The track files and their cue sheet are written as they're ready, and
+    ** when only checking, nothing is
+    */
+  } else if(!strcmp(outfilename, "-")) {
+    fout = stdout;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  } else {
+    fout = fopen(outfilename, "wb");
+    if(!fout) {
+      perror(outfilename);
+      fclose(fin);
+      return 1;
+    }
+  }
+  if(isofilename) {
+    fiso = fopen(isofilename, "wb");
+    if(!fiso) {
+      perror(isofilename);
+      if(fout) fclose(fout);
+      fclose(fin);
+      return 1;
+    }
+  }
+  if(digestfilename) {
+    if(!strcmp(digestfilename, "-")) {
+      if(fout == stdout) {
+        fprintf(stderr, "standard output is already the output file\n");
+        if(fiso) fclose(fiso);
+        fclose(fin);
+        return 1;
+      }
+      fdigest = stdout;
+    } else {
+      fdigest = fopen(digestfilename, "w");
+      if(!fdigest) {
+        perror(digestfilename);
+        if(fiso) fclose(fiso);
+        if(fout) fclose(fout);
+        fclose(fin);
+        return 1;
+      }
+    }
   }
   /*
   ** Decode
   */
-  unecmify(fin, fout);
+  if(first >= 0) {
+    ret = unecm_sectors(infilename, fout, first, count, isoonly ? ECM_COOKED : ECM_RAW);
+  } else if(isoonly) {
+    ret = (v2 ? unecmify2 : unecmify)(fin, NULL, fout, NULL, digests, fdigest, ioflags);
+  } else if(splitfrom) {
+    ret = (v2 ? unecmify2 : unecmify)(fin, NULL, fiso, &tracks, digests, fdigest, ioflags);
+    tracks_free(&tracks);
+  } else {
+    ret = (v2 ? unecmify2 : unecmify)(fin, fout, fiso, NULL, digests, fdigest, ioflags);
+  }
   /*
   ** Close everything
   */
-  fclose(fout);
+  if(fdigest && (fdigest != stdout)) fclose(fdigest);
+  if(fiso) fclose(fiso);
+  if(fout) fclose(fout);
   fclose(fin);
-  return 0;
+  return ret;
 }